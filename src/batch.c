@@ -0,0 +1,228 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "srm.h"
+#include "impl.h"
+
+#ifndef _O_BINARY
+#define _O_BINARY 0
+#endif
+
+/* Files that fit into a single write are dominated by the barrier
+   after each pass. batch_add() collects up to batch_files of them and
+   batch_flush() overwrites the whole group pass by pass with one
+   barrier per pass, see overwrite_group(), and renames it with one more
+   before the files are unlinked, see sunlink_finish_group(). */
+
+/** maximum number of files in a group, 0 disables batching. */
+unsigned batch_files = 0;
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+
+/* descriptors left to the walker, the journal and stdio while a group is open */
+#define BATCH_FD_RESERVE 32
+
+static struct srm_target *batch = NULL;
+/* directory of each queued file, released once it is removed */
+static struct walk_node **batch_parents = NULL;
+/* errno value of each file of the group that could not be removed, else 0 */
+static int *batch_status = NULL;
+static unsigned batch_count = 0;
+static unsigned batch_buffer_size = 0;
+/* options of the queued files, which all use the same mode */
+static int batch_options = 0;
+/* files of the groups flushed by batch_add() that could not be removed */
+static int batch_failed = 0;
+
+static int batch_group(void);
+
+/* the files are opened without O_SYNC, the group barrier makes each pass durable. */
+static const int batch_oflags = O_WRONLY|_O_BINARY;
+
+/**
+   queue path for batched overwriting if it is a small regular file.
+
+   @param parent directory of path, held until the file is removed
+   @param options bitfield of SRM_* bits
+   @return 1 if path was queued, or removed right away because --cow
+   skips its overwrite; 0 if the caller should remove path with sunlink().
+*/
+int batch_add(const char *path, struct walk_node *parent, const int options)
+{
+  struct srm_target target, *srm = &target;
+  struct stat statbuf;
+  int opened, cow;
+
+  if (batch_files == 0 || !path) return 0;
+
+  if (lstat(path, &statbuf) < 0)
+    return 0;
+  if (!S_ISREG(statbuf.st_mode) || statbuf.st_nlink > 1 || statbuf.st_size == 0 || statbuf.st_size > statbuf.st_blksize)
+    return 0;
+
+  if (!batch)
+    {
+      struct rlimit rl;
+      /* every queued file holds a descriptor until its group is written */
+      if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+	{
+	  const rlim_t max = rl.rlim_cur > 2 * BATCH_FD_RESERVE ? rl.rlim_cur - BATCH_FD_RESERVE : rl.rlim_cur / 2;
+	  if (batch_files > max)
+	    {
+	      batch_files = max > 0 ? (unsigned)max : 1;
+	      if (options & SRM_OPT_V)
+		error("--batch groups limited to %u files by the open file limit", batch_files);
+	    }
+	}
+      if ((batch = (struct srm_target*)calloc(batch_files, sizeof(struct srm_target))) == NULL)
+	return 0;
+      batch_parents = (struct walk_node**)calloc(batch_files, sizeof(struct walk_node*));
+      batch_status = (int*)calloc(batch_files, sizeof(int));
+      if (!batch_parents || !batch_status)
+	{
+	  free(batch);
+	  free(batch_parents);
+	  free(batch_status);
+	  batch = NULL;
+	  batch_parents = NULL;
+	  batch_status = NULL;
+	  return 0;
+	}
+    }
+
+  memset(srm, 0, sizeof(*srm));
+  if ((srm->file_name = strdup(path)) == NULL)
+    return 0;
+  srm->file_size = statbuf.st_size;
+  srm->buffer_size = statbuf.st_blksize;
+  srm->options = options;
+
+  opened = sunlink_open(srm, &statbuf, batch_oflags);
+  if (opened < 0 && errno == EMFILE && batch_count > 0)
+    {
+      /* the queued files hold the descriptors, write them out and try again */
+      batch_failed += batch_group();
+      opened = sunlink_open(srm, &statbuf, batch_oflags);
+    }
+  if (opened < 0)
+    {
+      /* let sunlink() try again and report the error */
+      free((char*)srm->file_name);
+      return 0;
+    }
+
+  walk_node_hold(parent);
+  /* the passes would not reach copy-on-write blocks, see cow_check() */
+  if ((cow = cow_check(srm)) < 0)
+    {
+      const int f = sunlink_finish(srm, batch_oflags) < 0;
+      if (f)
+	{
+	  errorp("unable to remove %s", srm->file_name);
+	  ++batch_failed;
+	}
+      free((char*)srm->file_name);
+      walk_node_release(parent, f);
+      return 1;
+    }
+  srm->options = cow;
+
+  /* a --policy rule or --cow=once may select another mode, a group has only one */
+  if (batch_count > 0 && (srm->options & SRM_MODE_MASK) != (batch_options & SRM_MODE_MASK))
+    batch_failed += batch_group();
+
+  batch[batch_count] = *srm;
+  batch_options = srm->options;
+  batch_parents[batch_count] = parent;
+  if (srm->buffer_size > batch_buffer_size)
+    batch_buffer_size = srm->buffer_size;
+  if (++batch_count == batch_files)
+    batch_failed += batch_group();
+  return 1;
+}
+
+/**
+   overwrite and unlink all queued files with the mode they were queued with.
+   @return the number of files that could not be removed.
+*/
+static int batch_group(void)
+{
+  unsigned i;
+  int failed;
+
+  if (batch_count == 0) return 0;
+
+  if (overwrite_group(batch, batch_count, batch_buffer_size, batch_options) < 0)
+    {
+      errorp("could not overwrite %u files", batch_count);
+      for (i = 0; i < batch_count; i++)
+	{
+	  close(batch[i].fd);
+	  batch[i].fd = -1;
+	}
+    }
+
+  /* one barrier for the renames of the group, see sunlink_finish_group() */
+  failed = sunlink_finish_group(batch, batch_count, batch_oflags, batch_status);
+  for (i = 0; i < batch_count; i++)
+    {
+      struct srm_target *srm = batch + i;
+      if (batch_status[i])
+	{
+	  errno = batch_status[i];
+	  errorp("unable to remove %s", srm->file_name);
+	}
+      free((char*)srm->file_name);
+      walk_node_release(batch_parents[i], batch_status[i] != 0);
+    }
+
+  batch_count = 0;
+  batch_buffer_size = 0;
+  return failed;
+}
+
+/**
+   remove all queued files.
+
+   @param options bitfield of SRM_* bits, unused
+   @return the number of files that could not be removed, with those of
+   the groups that were full before.
+*/
+int batch_flush(const int options)
+{
+  int failed = batch_failed + batch_group();
+
+  (void)options;
+  batch_failed = 0;
+  return failed;
+}
+
+#else
+
+int batch_add(const char *path, struct walk_node *parent, const int options)
+{
+  (void)path;
+  (void)parent;
+  (void)options;
+  return 0;
+}
+
+int batch_flush(const int options)
+{
+  (void)options;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,928 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#if defined(__linux__)
+/* pwrite() */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#endif
+
+#if defined(HAVE_LINUX_FALLOC_H)
+#include <linux/falloc.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+#ifndef _O_BINARY
+#define _O_BINARY 0
+#endif
+
+/* Block devices and disk images are overwritten by their own engine.
+   Every pass is split into chunks of the device's preferred request
+   size: whole stripes of a RAID (see fs_info_stripe_head()), or, if
+   the device reports none, queue/max_sectors_kb. A chunk that starts
+   within a stripe, at the start of an unaligned partition or a
+   --journal segment, only goes up to its boundary. blockdev_depth() threads
+   take the next chunk from a shared cursor and write it with pwrite(),
+   so that many requests are in flight per device. A pass is synced in
+   segments of journal_interval bytes with --journal, otherwise once at
+   its end; the segments give --resume its checkpoints.
+
+   Several device operands are wiped at the same time by
+   blockdev_wipe_all(), one thread per device, each with its own queue
+   depth. --queue-depth fixes the depth. Otherwise it only starts out
+   by the device: a rotational disk with two requests in flight, enough
+   to keep it streaming without reordering, a solid-state device with
+   sixteen. From there a controller per device adapts the depth and the
+   request size to the throughput and latency it sees, see
+   aimd_sample(). Its writes bypass the page cache with O_DIRECT, so
+   that a pwrite() takes as long as the device does; a request the
+   device does not take directly, like the unaligned tail of an image,
+   goes through the page cache.
+
+   With SRM_OPT_ZERO_OFFLOAD the 0x00 passes to a block device are
+   handed to the kernel with BLKZEROOUT, or fallocate() with
+   FALLOC_FL_ZERO_RANGE, which lets the device write the zeros itself
+   (WRITE ZEROES, WRITE SAME) instead of transferring them. Both keep
+   the blocks mapped. If the device supports neither, the pass is
+   written as usual. Disk images are never offloaded, a file system
+   may only mark the range as unwritten and leave the old data in
+   place.
+
+   With SRM_OPT_DISCARD the device is discarded after the last pass,
+   which returns the blocks to a thin pool or the SSD's free space.
+   Whether a device supports it comes from sysfs discard_max_bytes, see
+   fs_info_lookup(). Disk images get a hole punched over their whole
+   length instead. */
+
+/** number of concurrent writes per device, 0 to choose by the device, see blockdev_depth(). */
+unsigned blockdev_queue_depth = 0;
+
+#define BLOCKDEV_DEPTH 4
+#define BLOCKDEV_DEPTH_ROTATIONAL 2
+#define BLOCKDEV_DEPTH_SOLID_STATE 16
+
+/**
+   @return the number of concurrent writes to the device of fs.
+*/
+unsigned blockdev_depth(const struct srm_fs_info *fs)
+{
+  if (blockdev_queue_depth > 0)
+    return blockdev_queue_depth;
+  if (!fs || fs->rotational < 0)
+    return BLOCKDEV_DEPTH;
+  return fs->rotational ? BLOCKDEV_DEPTH_ROTATIONAL : BLOCKDEV_DEPTH_SOLID_STATE;
+}
+
+#define BLOCKDEV_MIN_IO (256 * 1024)
+#define BLOCKDEV_DEFAULT_IO (1024 * 1024)
+#define BLOCKDEV_MAX_IO (16 * 1024 * 1024)
+
+/* seconds of writes between two adjustments */
+#define AIMD_WINDOW 0.25
+/* a step only paid off if the throughput grew by this factor */
+#define AIMD_GAIN 1.05
+/* past the knee a request waits this many times longer per byte than at best */
+#define AIMD_LATENCY 1.5
+#define AIMD_MAX_DEPTH 64
+/* memory alignment of direct I/O buffers */
+#define BLOCKDEV_ALIGN 4096
+
+#if defined(__unix__) || defined(__APPLE__)
+
+/* queue depth and request size of one device, see aimd_sample() */
+struct blockdev_aimd
+{
+  struct blockdev_aimd *next;
+  unsigned long long dev;
+  /* the request size changes by step bytes up to max_io */
+  unsigned depth, io, step, max_io;
+  /* 1 if the last increase was of the request size */
+  int grew_io;
+  /* the current window */
+  double start, latency;
+  unsigned long long bytes;
+  unsigned requests;
+  /* throughput of the last window, lowest latency per byte */
+  double rate, best_latency;
+  /* the best window */
+  double peak;
+  unsigned peak_depth, peak_io;
+  unsigned long increases, decreases;
+};
+
+static struct blockdev_aimd *aimds = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t aimd_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* one segment of a pass, shared by the writer threads */
+struct blockdev_segment
+{
+  struct srm_target *srm;
+  my_off_t next, end;
+  int err;
+  /* 1 while the writes bypass the page cache */
+  int direct;
+  /* controller of the device, NULL with --queue-depth */
+  struct blockdev_aimd *aimd;
+  /* writes in flight and their size */
+  unsigned depth, io;
+  /* writers running and started, with the calling thread */
+  unsigned running, started;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+  /* writers above the depth wait here */
+  pthread_cond_t wake;
+  pthread_t threads[AIMD_MAX_DEPTH - 1];
+#endif
+};
+
+static void blockdev_sync(const int fd)
+{
+#if defined F_FULLFSYNC
+  if (fcntl(fd, F_FULLFSYNC, NULL) != 0)
+    fsync(fd);
+#elif HAVE_FDATASYNC
+  fdatasync(fd);
+#else
+  fsync(fd);
+#endif
+}
+
+/**
+   @return the size of the writes to the device dev with sectors of sector bytes.
+*/
+unsigned blockdev_io_size(const struct srm_fs_info *fs, const unsigned long long dev, const unsigned sector)
+{
+  const unsigned stripe = fs ? fs->stripe : 0;
+  unsigned long long u = 0;
+  unsigned io = stripe;
+
+#if defined(__linux__)
+  if (io == 0 && sysfs_read(dev, "queue/max_sectors_kb", &u) == 0 && u > 0)
+    io = (unsigned)u * 1024;
+#else
+  (void)dev;
+  (void)u;
+#endif
+  if (io == 0)
+    io = BLOCKDEV_DEFAULT_IO;
+  /* a small stripe is written several at a time */
+  while (io < BLOCKDEV_MIN_IO)
+    io *= 2;
+  if (io > BLOCKDEV_MAX_IO)
+    io = stripe > 0 && stripe <= BLOCKDEV_MAX_IO ? BLOCKDEV_MAX_IO - BLOCKDEV_MAX_IO % stripe : BLOCKDEV_MAX_IO;
+  if (sector > 0)
+    io -= io % sector;
+  return io ? io : sector;
+}
+
+/**
+   @return the controller of the device of fs, which starts with
+   blockdev_depth() writes of io bytes in flight. NULL if out of memory.
+*/
+static struct blockdev_aimd *aimd_get(const struct srm_fs_info *fs, const unsigned io)
+{
+  const unsigned long long dev = fs ? fs->dev : 0;
+  struct blockdev_aimd *a;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&aimd_lock);
+#endif
+  for (a = aimds; a; a = a->next)
+    if (a->dev == dev)
+      break;
+  if (!a && (a = (struct blockdev_aimd*)calloc(1, sizeof(*a))) != NULL)
+    {
+      a->dev = dev;
+      a->depth = blockdev_depth(fs);
+      /* whole stripes, as in blockdev_io_size() */
+      a->step = fs && fs->stripe ? fs->stripe : BLOCKDEV_MIN_IO;
+      while (a->step < BLOCKDEV_MIN_IO)
+	a->step *= 2;
+      if (io % a->step)
+	a->step = io;
+      a->max_io = BLOCKDEV_MAX_IO - BLOCKDEV_MAX_IO % a->step;
+      if (a->max_io < io)
+	a->max_io = io;
+      a->io = io;
+      a->next = aimds;
+      aimds = a;
+    }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&aimd_lock);
+#endif
+  return a;
+}
+
+/**
+   start a segment with the depth and request size of its controller.
+*/
+static void aimd_begin(struct blockdev_segment *seg)
+{
+  struct blockdev_aimd *a = seg->aimd;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&aimd_lock);
+#endif
+  /* the sync of the last segment is no part of the window */
+  a->start = plan_clock();
+  a->bytes = 0;
+  a->latency = 0;
+  a->requests = 0;
+  seg->depth = a->depth;
+  seg->io = a->io < seg->srm->buffer_size ? a->io : seg->srm->buffer_size;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&aimd_lock);
+#endif
+}
+
+/**
+   account a direct write of bytes which took latency seconds.
+
+   Once per window of AIMD_WINDOW seconds, and at least two writes per
+   writer, the controller looks at the throughput and at the latency
+   per byte of the window. As long as the throughput grows, or the
+   latency stays close to the lowest seen, one more write is put in
+   flight or the request size grows by a step, in turn. Once the
+   throughput stops growing while the latency rises, the device is past
+   the knee of its throughput curve, more requests only wait longer in
+   its queue, and whichever of the depth and the request size grew last
+   is halved. Both so swing around the knee.
+
+   Must be called with seg->lock held.
+*/
+static void aimd_sample(struct blockdev_segment *seg, const size_t bytes, const double latency)
+{
+  struct blockdev_aimd *a = seg->aimd;
+  const double now = plan_clock();
+  double rate, per_byte;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&aimd_lock);
+#endif
+  a->bytes += bytes;
+  a->latency += latency;
+  a->requests++;
+  if (now - a->start >= AIMD_WINDOW && a->requests >= 2 * a->depth)
+    {
+      rate = (double)a->bytes / (now - a->start);
+      per_byte = a->latency / (double)a->bytes;
+      a->start = now;
+      a->bytes = 0;
+      a->latency = 0;
+      a->requests = 0;
+      if (a->best_latency == 0 || per_byte < a->best_latency)
+	a->best_latency = per_byte;
+      if (rate > a->peak)
+	{
+	  a->peak = rate;
+	  a->peak_depth = a->depth;
+	  a->peak_io = a->io;
+	}
+
+      if (a->rate > 0 && rate < a->rate * AIMD_GAIN && per_byte > a->best_latency * AIMD_LATENCY)
+	{
+	  if (a->grew_io)
+	    a->io = a->io / 2 > a->step ? a->io / 2 - a->io / 2 % a->step : a->step;
+	  else
+	    a->depth = a->depth > 1 ? a->depth / 2 : 1;
+	  a->grew_io = 0;
+	  a->decreases++;
+	}
+      else
+	{
+	  const int more_io = a->io + a->step <= a->max_io, more_depth = a->depth < AIMD_MAX_DEPTH;
+	  if (more_io && (!a->grew_io || !more_depth))
+	    {
+	      a->io += a->step;
+	      a->grew_io = 1;
+	      a->increases++;
+	    }
+	  else if (more_depth)
+	    {
+	      a->depth++;
+	      a->grew_io = 0;
+	      a->increases++;
+	    }
+	}
+      a->rate = rate;
+      if ((seg->srm->options & SRM_OPT_V) > 2)
+	error("%s: %.1f MiB/s, %.2f ms per MiB: queue depth %u, %u byte writes", seg->srm->file_name,
+	      rate / (1024 * 1024), per_byte * 1024 * 1024 * 1000, a->depth, a->io);
+    }
+  seg->depth = a->depth;
+  seg->io = a->io < seg->srm->buffer_size ? a->io : seg->srm->buffer_size;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&aimd_lock);
+#endif
+}
+
+static void *blockdev_writer(void *arg)
+{
+  struct blockdev_segment *seg = (struct blockdev_segment*)arg;
+  struct srm_target *srm = seg->srm;
+  size_t len = 0;
+  double latency = 0;
+  int sampled = 0;
+
+  for (;;)
+    {
+      my_off_t off;
+      size_t done = 0;
+      double start;
+      unsigned want;
+
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_lock(&seg->lock);
+#endif
+      if (sampled)
+	aimd_sample(seg, len, latency);
+      /* fewer writers under I/O pressure, see throttle_depth() */
+      want = throttle_depth(seg->depth);
+#ifdef HAVE_PTHREAD_H
+      if (seg->next < seg->end && !seg->err)
+	{
+	  /* wake waiting writers first, then start new ones */
+	  if (seg->running < want && seg->started > seg->running)
+	    pthread_cond_signal(&seg->wake);
+	  else
+	    while (seg->running < want && seg->started < AIMD_MAX_DEPTH
+		   && pthread_create(&seg->threads[seg->started - 1], NULL, blockdev_writer, seg) == 0)
+	      {
+		seg->started++;
+		seg->running++;
+	      }
+	  if (seg->running > want)
+	    {
+	      seg->running--;
+	      pthread_cond_wait(&seg->wake, &seg->lock);
+	      seg->running++;
+	      pthread_mutex_unlock(&seg->lock);
+	      sampled = 0;
+	      continue;
+	    }
+	}
+#endif
+      off = seg->next;
+      len = seg->io;
+      /* a write from within a stripe ends at its boundary */
+      if ((done = (size_t)fs_info_stripe_head(srm->fs, off)) > 0 && done < len)
+	len = done;
+      done = 0;
+      if (seg->end - off < (my_off_t)len)
+	len = (size_t)(seg->end - off);
+      seg->next += len;
+      if (seg->err)
+	len = 0;
+      sampled = seg->aimd && seg->direct;
+#ifdef HAVE_PTHREAD_H
+      /* the waiting writers see the end */
+      if (len == 0)
+	pthread_cond_broadcast(&seg->wake);
+      pthread_mutex_unlock(&seg->lock);
+#endif
+      if (len == 0)
+	break;
+
+      throttle(srm->fs, len);
+      start = plan_clock();
+      while (done < len)
+	{
+	  ssize_t w = pwrite(srm->fd, srm->buffer + done, len - done, off + done);
+	  if (w < 0 && errno == EINVAL && sampled)
+	    {
+	      /* not aligned for direct I/O, the rest of the segment is
+		 written through the page cache */
+#ifdef HAVE_PTHREAD_H
+	      pthread_mutex_lock(&seg->lock);
+#endif
+	      seg->direct = 0;
+	      direct_io(srm->fd, 0);
+#ifdef HAVE_PTHREAD_H
+	      pthread_mutex_unlock(&seg->lock);
+#endif
+	      sampled = 0;
+	      continue;
+	    }
+	  if (w <= 0)
+	    {
+#ifdef HAVE_PTHREAD_H
+	      pthread_mutex_lock(&seg->lock);
+#endif
+	      seg->err = w < 0 ? errno : EIO;
+#ifdef HAVE_PTHREAD_H
+	      pthread_cond_broadcast(&seg->wake);
+	      pthread_mutex_unlock(&seg->lock);
+#endif
+	      return NULL;
+	    }
+	  done += w;
+	}
+      latency = plan_clock() - start;
+    }
+  return NULL;
+}
+
+/**
+   let the kernel write zeros to from..end of the block device of srm.
+   @return the name of the method that worked, NULL if none did.
+*/
+static const char *blockdev_zeroout(struct srm_target *srm, const my_off_t from, const my_off_t end)
+{
+#if defined(__linux__) && defined(BLKZEROOUT)
+  uint64_t range[2];
+  range[0] = from;
+  range[1] = end - from;
+  if (ioctl(srm->fd, BLKZEROOUT, range) == 0)
+    return "BLKZEROOUT";
+#endif
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_ZERO_RANGE)
+  if (fallocate(srm->fd, FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE, from, end - from) == 0)
+    return "FALLOC_FL_ZERO_RANGE";
+#endif
+  (void)srm;
+  (void)from;
+  (void)end;
+  return NULL;
+}
+
+/**
+   discard the overwritten blocks of srm, see SRM_OPT_DISCARD.
+*/
+static void blockdev_discard(struct srm_target *srm)
+{
+  const char *method = NULL;
+  int ret = -1;
+
+  if (srm->fs && !(srm->fs->flags & FS_INFO_BLOCKDEV))
+    {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+      method = "hole punching";
+      if (fs_info_punch_hole(srm->fs, srm->fd))
+	ret = fallocate(srm->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, srm->file_size);
+      else
+	errno = EOPNOTSUPP;
+#endif
+    }
+  else if (srm->fs && srm->fs->discard == 0)
+    {
+      method = "discard";
+      errno = EOPNOTSUPP;
+    }
+  else
+    {
+#if defined(__linux__) && defined(BLKDISCARD)
+      uint64_t range[2];
+      range[0] = 0;
+      range[1] = srm->file_size;
+# if defined(BLKSECDISCARD)
+      if (srm->options & SRM_OPT_SECURE_DISCARD)
+	{
+	  method = "secure discard";
+	  if ((ret = ioctl(srm->fd, BLKSECDISCARD, range)) < 0 && (srm->options & SRM_OPT_V))
+	    errorp("%s: secure discard failed, falling back to discard", srm->file_name);
+	}
+# endif
+      if (ret < 0)
+	{
+	  method = "discard";
+	  ret = ioctl(srm->fd, BLKDISCARD, range);
+	}
+#endif
+    }
+
+  if (!method)
+    {
+      if (srm->options & SRM_OPT_V)
+	error("%s: discard is not supported on this platform", srm->file_name);
+    }
+  else if (ret < 0)
+    {
+      if (srm->options & SRM_OPT_V)
+	errorp("%s: %s failed", srm->file_name, method);
+    }
+  else if ((srm->options & SRM_OPT_V) > 1)
+    error("%s: %s done", srm->file_name, method);
+}
+
+/**
+   write the bytes from..end of the current pass with the queue depth
+   of aimd, or blockdev_depth() if it is NULL.
+*/
+static int blockdev_segment(struct srm_target *srm, struct blockdev_aimd *aimd, const my_off_t from, const my_off_t end)
+{
+  struct blockdev_segment seg;
+#ifdef HAVE_PTHREAD_H
+  unsigned i;
+#endif
+
+  seg.srm = srm;
+  seg.next = from;
+  seg.end = end;
+  seg.err = 0;
+  seg.aimd = aimd;
+  seg.depth = blockdev_depth(srm->fs);
+  seg.io = srm->buffer_size;
+  if (aimd)
+    aimd_begin(&seg);
+  /* a fall back to the page cache only lasts for one segment */
+  seg.direct = srm->direct_align > 0;
+  if (seg.direct)
+    direct_io(srm->fd, 1);
+  /* the calling thread is one of the writers, it starts the others */
+  seg.running = seg.started = 1;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&seg.lock, NULL);
+  pthread_cond_init(&seg.wake, NULL);
+  blockdev_writer(&seg);
+  /* the writers that still run may start more */
+  for (i = 0; ; i++)
+    {
+      pthread_t t;
+      pthread_mutex_lock(&seg.lock);
+      if (i + 1 >= seg.started)
+	{
+	  pthread_mutex_unlock(&seg.lock);
+	  break;
+	}
+      t = seg.threads[i];
+      pthread_mutex_unlock(&seg.lock);
+      pthread_join(t, NULL);
+    }
+  pthread_cond_destroy(&seg.wake);
+  pthread_mutex_destroy(&seg.lock);
+#else
+  blockdev_writer(&seg);
+#endif
+
+  if (seg.err)
+    {
+      errno = seg.err;
+      return -1;
+    }
+  blockdev_sync(srm->fd);
+  return 0;
+}
+
+/**
+   overwrite the open device or image of srm with all passes of the
+   selected mode. srm->buffer_size is the size of the writes.
+   @return 0 upon success, negative upon error.
+*/
+int blockdev_wipe(struct srm_target *srm)
+{
+  const struct srm_scheme *scheme = scheme_lookup(srm->options);
+  unsigned p, first;
+  my_off_t from;
+  int ret = 0;
+  /* only block devices are offloaded, see above */
+  int offload = (srm->options & SRM_OPT_ZERO_OFFLOAD) && srm->fs && (srm->fs->flags & FS_INFO_BLOCKDEV);
+  const char *method = NULL;
+  char offloaded[128] = "";
+  struct blockdev_aimd *aimd = NULL;
+  unsigned char *buffer;
+  unsigned long long written = 0;
+  double seconds = 0;
+
+  /* the controller needs the latency of the device, see above */
+  if (srm->direct_align && (aimd = aimd_get(srm->fs, srm->buffer_size)) == NULL)
+    srm->direct_align = 0;
+  if (aimd)
+    {
+      /* room for the largest request size */
+      unsigned long long size = (unsigned long long)srm->file_size + aimd->step - 1;
+      size -= size % aimd->step;
+      srm->buffer_size = size < aimd->max_io ? (unsigned)size : aimd->max_io;
+    }
+  if ((buffer = (unsigned char*)malloc(srm->buffer_size + BLOCKDEV_ALIGN)) == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+  srm->buffer = buffer + (BLOCKDEV_ALIGN - (size_t)buffer % BLOCKDEV_ALIGN) % BLOCKDEV_ALIGN;
+
+  if ((srm->options & SRM_OPT_V) > 1)
+    error("%s, %u byte writes, queue depth %u%s", scheme->name, aimd ? aimd->io : srm->buffer_size,
+	  aimd ? aimd->depth : blockdev_depth(srm->fs), aimd ? " to start with" : "");
+
+  /* with --resume a checkpoint may skip passes */
+  journal_begin(srm, &first, &from);
+
+  for (p = first; p < scheme->num_passes && ret == 0; p++)
+    {
+      const double start = plan_clock();
+      const my_off_t begin = p == first ? from : 0;
+      const int zero = offload && pass_is_zero(&scheme->passes[p]);
+      my_off_t i;
+
+      method = NULL;
+      if (!zero)
+	pass_fill(srm->buffer, srm->buffer_size, &scheme->passes[p]);
+      for (i = begin; i < srm->file_size && ret == 0; )
+	{
+	  my_off_t end = srm->file_size;
+	  if (srm->journal && (unsigned long long)(end - i) > journal_interval)
+	    end = i + journal_interval;
+	  if (zero && i == begin && (method = blockdev_zeroout(srm, i, end)) == NULL)
+	    {
+	      /* not supported by the device, the remaining passes are written */
+	      if (srm->options & SRM_OPT_V)
+		errorp("%s: zero offload not supported, writing pass %u", srm->file_name, p + 1);
+	      offload = 0;
+	      pass_fill(srm->buffer, srm->buffer_size, &scheme->passes[p]);
+	    }
+	  if (!method)
+	    ret = blockdev_segment(srm, aimd, i, end);
+	  else if (i > begin && blockdev_zeroout(srm, i, end) == NULL)
+	    ret = -1;
+	  else
+	    blockdev_sync(srm->fd);
+	  i = end;
+	  if (ret == 0 && i < srm->file_size)
+	    journal_checkpoint(srm, p, i);
+	}
+      if (ret < 0)
+	break;
+      /* offloaded passes say nothing about the write throughput */
+      if (!method)
+	{
+	  plan_record(srm->fs, (unsigned long long)(srm->file_size - begin), plan_clock() - start);
+	  written += srm->file_size - begin;
+	  seconds += plan_clock() - start;
+	}
+      else if (strlen(offloaded) + 8 < sizeof(offloaded))
+	sprintf(offloaded + strlen(offloaded), "%s%u", *offloaded ? ", " : "", p + 1);
+      journal_checkpoint(srm, p + 1, 0);
+      if ((srm->options & SRM_OPT_V) > 1)
+	error("%s: pass %u of %u done%s%s", srm->file_name, p + 1, scheme->num_passes,
+	      method ? " with " : "", method ? method : "");
+    }
+
+  if (ret == 0)
+    journal_end(srm);
+  if (ret == 0 && (srm->options & SRM_OPT_DISCARD))
+    blockdev_discard(srm);
+  if (*offloaded && (srm->options & SRM_OPT_V))
+    error("%s: offloaded zero passes %s of %u", srm->file_name, offloaded, scheme->num_passes);
+  if (ret == 0 && seconds > 0 && (srm->options & SRM_OPT_V))
+    {
+      unsigned depth = blockdev_depth(srm->fs), io = srm->buffer_size;
+      if (aimd)
+	{
+#ifdef HAVE_PTHREAD_H
+	  pthread_mutex_lock(&aimd_lock);
+#endif
+	  depth = aimd->depth;
+	  io = aimd->io;
+#ifdef HAVE_PTHREAD_H
+	  pthread_mutex_unlock(&aimd_lock);
+#endif
+	}
+      error("%s: queue depth %u%s, %u byte writes, %.1f MiB/s", srm->file_name, depth,
+	    aimd ? " at the end" : "", io, written / seconds / (1024 * 1024));
+    }
+  {
+    int e=errno;
+    free(buffer);
+    srm->buffer = NULL;
+    errno=e;
+  }
+  return ret;
+}
+
+/**
+   overwrite the block device, or with image the regular file, path
+   and keep it.
+   @return 0 upon success, negative upon error (see the errno variable for details).
+*/
+int blockdev_remove(const char *path, const my_stat_t *statbuf, const int options)
+{
+  struct srm_target srm;
+  unsigned long long dev;
+  unsigned sector = 512;
+  int ret;
+
+  memset(&srm, 0, sizeof(srm));
+  srm.file_name = path;
+  srm.options = options;
+
+  if ((srm.fd = open(path, O_WRONLY|_O_BINARY)) < 0)
+    return -1;
+
+#if defined(__linux__)
+  if (S_ISBLK(statbuf->st_mode))
+    {
+      int secsize = 512;
+      uint64_t u = 0;
+
+      if (ioctl(srm.fd, BLKSSZGET, &secsize) < 0 || ioctl(srm.fd, BLKGETSIZE64, &u) < 0)
+	{
+	  int e=errno;
+	  errorp("could not get the size of block device %s", path);
+	  close(srm.fd);
+	  errno=e;
+	  return -1;
+	}
+      sector = (unsigned)secsize;
+      srm.file_size = u;
+      dev = statbuf->st_rdev;
+      srm.fs = fs_info_lookup(srm.fd, dev, FS_INFO_BLOCKDEV, options);
+    }
+  else
+#endif
+    {
+      srm.file_size = statbuf->st_size;
+      dev = statbuf->st_dev;
+      srm.fs = fs_info_lookup(srm.fd, dev, 0, options);
+    }
+
+  if (srm.file_size == 0)
+    {
+      close(srm.fd);
+      if (options & SRM_OPT_V)
+	error("could not determine block device %s filesize", path);
+      errno = EIO;
+      return -1;
+    }
+  srm.buffer_size = blockdev_io_size(srm.fs, dev, sector);
+#if defined(O_DIRECT)
+  /* the depth adapts to writes that bypass the page cache, see blockdev_wipe() */
+  if (blockdev_queue_depth == 0)
+    srm.direct_align = S_ISBLK(statbuf->st_mode) ? sector : srm.fs ? srm.fs->dio_offset_align : 0;
+#endif
+  if ((options & SRM_OPT_V) > 1)
+    error("%s size: %llu bytes, sector size %u", path, (unsigned long long)srm.file_size, sector);
+
+  ret = blockdev_wipe(&srm);
+  {
+    int e=errno;
+    if (ret < 0 && (options & SRM_OPT_V))
+      errorp("could not overwrite device %s", path);
+    close(srm.fd);
+    errno=e;
+  }
+  return ret;
+}
+
+/**
+   print what the controller of each device settled on, for -v.
+*/
+void blockdev_report(const int options)
+{
+  const struct blockdev_aimd *a;
+
+  if (!(options & SRM_OPT_V))
+    return;
+  for (a = aimds; a; a = a->next)
+    {
+      char dev[32];
+#if defined(__linux__)
+      snprintf(dev, sizeof(dev), "%u:%u", major(a->dev), minor(a->dev));
+#else
+      snprintf(dev, sizeof(dev), "%llu", a->dev);
+#endif
+      if (a->peak > 0)
+	error("device %s: queue depth %u, %u byte writes, best %.1f MiB/s at queue depth %u with %u byte writes, %lu steps up, %lu down",
+	      dev, a->depth, a->io, a->peak / (1024 * 1024), a->peak_depth, a->peak_io, a->increases, a->decreases);
+    }
+}
+
+struct blockdev_job
+{
+  const char *path;
+  my_stat_t statbuf;
+  int options;
+  int ret;
+};
+
+static void *blockdev_thread(void *arg)
+{
+  struct blockdev_job *job = (struct blockdev_job*)arg;
+  job->ret = blockdev_remove(job->path, &job->statbuf, job->options);
+  if (job->ret < 0)
+    errorp("unable to remove %s", job->path);
+  return NULL;
+}
+
+/**
+   overwrite the num devices or images in paths at the same time.
+   @return 0 if all were overwritten; > 0 otherwise.
+*/
+int blockdev_wipe_all(char **paths, const unsigned num, const int options)
+{
+  struct blockdev_job *jobs;
+  unsigned i;
+  int ret = 0;
+#ifdef HAVE_PTHREAD_H
+  pthread_t *threads;
+  int *started;
+#endif
+
+  if ((jobs = (struct blockdev_job*)calloc(num, sizeof(*jobs))) == NULL)
+    {
+      errorp("could not allocate memory");
+      return 1;
+    }
+  for (i = 0; i < num; i++)
+    {
+      jobs[i].path = paths[i];
+      if (stat(paths[i], &jobs[i].statbuf) < 0)
+	{
+	  errorp("unable to stat %s", paths[i]);
+	  jobs[i].path = NULL;
+	  ret = 1;
+	  continue;
+	}
+      /* the --policy rule of the device selects its mode, as for files */
+      jobs[i].options = policy_apply(paths[i], options);
+      /* an image overwritten by an interrupted run is done */
+      if (journal_completed(paths[i]))
+	jobs[i].path = NULL;
+    }
+
+#ifdef HAVE_PTHREAD_H
+  threads = (pthread_t*)calloc(num, sizeof(*threads));
+  started = (int*)calloc(num, sizeof(*started));
+  for (i = 0; i < num && threads && started; i++)
+    if (jobs[i].path && pthread_create(&threads[i], NULL, blockdev_thread, &jobs[i]) == 0)
+      started[i] = 1;
+  for (i = 0; i < num; i++)
+    {
+      if (started && started[i])
+	pthread_join(threads[i], NULL);
+      else if (jobs[i].path)
+	blockdev_thread(&jobs[i]);
+      if (jobs[i].path && jobs[i].ret < 0)
+	ret = 1;
+    }
+  free(threads);
+  free(started);
+#else
+  for (i = 0; i < num; i++)
+    if (jobs[i].path)
+      {
+	blockdev_thread(&jobs[i]);
+	if (jobs[i].ret < 0)
+	  ret = 1;
+      }
+#endif
+
+  free(jobs);
+  return ret;
+}
+
+#else
+
+int blockdev_wipe(struct srm_target *srm)
+{
+  return overwrite_selector(srm);
+}
+
+int blockdev_remove(const char *path, const my_stat_t *statbuf, const int options)
+{
+  (void)path;
+  (void)statbuf;
+  (void)options;
+  errno = ENOSYS;
+  return -1;
+}
+
+void blockdev_report(const int options)
+{
+  (void)options;
+}
+
+int blockdev_wipe_all(char **paths, const unsigned num, const int options)
+{
+  (void)paths;
+  (void)num;
+  (void)options;
+  error("--image is not supported on this platform");
+  return 1;
+}
+
+#endif
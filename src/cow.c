@@ -0,0 +1,119 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(HAVE_LINUX_FS_H)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+/* An overwrite only destroys data if it lands on the blocks that hold
+   it. btrfs writes all data to new blocks unless the file has the
+   NOCOW attribute, XFS and btrfs write shared extents (reflink copies,
+   snapshots) to new blocks. For such bytes every pass only allocates
+   fresh blocks and the old ones stay as they are.
+
+   cow_check() counts the bytes of a file which would be copied on
+   write, from the file system type and the FIEMAP_EXTENT_SHARED flag of
+   its extents. If all of a file would be copied, --cow selects what
+   happens: warn and overwrite anyway (the default), overwrite only once
+   or skip the overwrite. A file with some bytes in place is always
+   overwritten normally. */
+
+#define BTRFS_SUPER_MAGIC 0x9123683E
+
+/** what to do with files that would only be copied on write, COW_* */
+int cow_policy = COW_WARN;
+
+static unsigned long cow_files = 0;
+static unsigned long long cow_in_place = 0, cow_copied = 0;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t cow_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+   @return true if overwriting the open file fd writes to new blocks on btrfs.
+*/
+static int cow_always(const struct srm_target *srm)
+{
+  if (!srm->fs || srm->fs->fs_type != (long)BTRFS_SUPER_MAGIC)
+    return 0;
+#if defined(FS_IOC_GETFLAGS) && defined(FS_NOCOW_FL)
+  {
+    int flags = 0;
+    if (ioctl(srm->fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_NOCOW_FL))
+      return 0;
+  }
+#endif
+  return 1;
+}
+
+/**
+   count the bytes of the open regular file of srm which an overwrite
+   would copy on write and apply --cow.
+   @return the options to overwrite srm with, or -1 to skip the overwrite.
+*/
+int cow_check(const struct srm_target *srm)
+{
+  unsigned long long copied = 0;
+
+  if (srm->file_size == 0)
+    return srm->options;
+  if (cow_always(srm))
+    copied = srm->file_size;
+  else if (fiemap_shared(srm->fd, srm->file_size, &copied) < 0 || copied == 0)
+    return srm->options;
+  if (copied > (unsigned long long)srm->file_size)
+    copied = srm->file_size;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&cow_lock);
+#endif
+  cow_files++;
+  cow_copied += copied;
+  cow_in_place += srm->file_size - copied;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&cow_lock);
+#endif
+
+  if (srm->options & SRM_OPT_V)
+    error("%s: %llu bytes overwritten in place, %llu bytes copy-on-write", srm->file_name,
+	  (unsigned long long)srm->file_size - copied, copied);
+
+  if (copied < (unsigned long long)srm->file_size || cow_policy == COW_WARN)
+    return srm->options;
+  if (cow_policy == COW_SKIP)
+    return -1;
+  return (srm->options & ~SRM_MODE_MASK) | SRM_MODE_SIMPLE;
+}
+
+/**
+   print the totals of cow_check(). The warning is printed even without
+   -v, once per run.
+*/
+void cow_report(const int options)
+{
+  if (cow_files == 0)
+    return;
+  if (cow_policy == COW_WARN)
+    error("warning: %llu bytes in %lu files were copy-on-write, the overwrite did not reach their old blocks",
+	  cow_copied, cow_files);
+  else if (options & SRM_OPT_V)
+    error("copy-on-write: %llu bytes of %lu files, %llu bytes overwritten in place",
+	  cow_copied, cow_files, cow_in_place);
+}
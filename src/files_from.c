@@ -0,0 +1,109 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "srm.h"
+#include "impl.h"
+
+/* With --files-from the paths are read one at a time while the
+   walkers remove the previous ones, so a list of any length needs
+   only the memory of its longest line. */
+
+/** separator of the paths read by next_tree(), '\n' or '\0' with -0. */
+int files_from_delim = '\n';
+
+static FILE *files_from_file = NULL;
+static char *files_from_buf = NULL;
+static size_t files_from_size = 0;
+
+/**
+   read the paths to remove from file, "-" is stdin.
+   @return 0 upon success, negative upon error (see the errno variable for details).
+*/
+int files_from_open(const char *file)
+{
+  if (!file)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (!strcmp(file, "-"))
+    files_from_file = stdin;
+  else if ((files_from_file = fopen(file, "r")) == NULL)
+    return -1;
+  return 0;
+}
+
+/**
+   @return the next path of the --files-from list, or NULL at the end.
+   The buffer is reused by the next call.
+*/
+static char *files_from_next(void)
+{
+  int c;
+
+  if (!files_from_file)
+    return NULL;
+
+  for (;;)
+    {
+      size_t len = 0;
+
+      while ((c = getc(files_from_file)) != EOF && c != files_from_delim)
+	{
+	  if (len + 1 >= files_from_size)
+	    {
+	      size_t n = files_from_size ? files_from_size * 2 : 256;
+	      char *b = (char*)realloc(files_from_buf, n);
+	      if (!b)
+		{
+		  errorp("could not allocate memory");
+		  c = EOF;
+		  len = 0;
+		  break;
+		}
+	      files_from_buf = b;
+	      files_from_size = n;
+	    }
+	  files_from_buf[len++] = (char)c;
+	}
+
+      if (len > 0)
+	{
+	  files_from_buf[len] = '\0';
+	  return files_from_buf;
+	}
+      if (c == EOF)
+	break;
+      /* skip empty lines */
+    }
+
+  if (ferror(files_from_file))
+    errorp("could not read the list of files");
+  if (files_from_file != stdin)
+    fclose(files_from_file);
+  files_from_file = NULL;
+  free(files_from_buf);
+  files_from_buf = NULL;
+  files_from_size = 0;
+  return NULL;
+}
+
+/**
+   @param trees NULL terminated list of paths from the command line
+   @param i index of the next path in trees, start with 0
+   @return the next path to remove: first the entries of trees, then
+   the paths of the --files-from list. NULL if there are no more.
+*/
+char *next_tree(char **trees, unsigned *i)
+{
+  if (trees && trees[*i] != NULL)
+    return trees[(*i)++];
+  return files_from_next();
+}
@@ -0,0 +1,275 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fnmatch.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+/* --include and --exclude select entries by name, --min-size,
+   --max-size, --older-than and --newer-than by their stat data. The
+   walkers check the name first, from the directory entry, and only
+   stat an entry if a stat predicate is set. An excluded directory is
+   not entered at all. The patterns are sorted into simple kinds when
+   they are added, so the common "*.ext" and literal names are matched
+   without fnmatch(). */
+
+enum { GLOB_LITERAL, GLOB_SUFFIX, GLOB_PREFIX, GLOB_FNMATCH };
+
+struct glob
+{
+  struct glob *next;
+  int kind;
+  /* the literal part for GLOB_LITERAL, GLOB_SUFFIX and GLOB_PREFIX */
+  const char *text;
+  size_t len;
+  const char *pattern;
+};
+
+static struct glob *includes = NULL, *excludes = NULL;
+static my_off_t min_size = -1, max_size = -1;
+static time_t older_than = 0, newer_than = 0;
+static int active = 0, need_stat = 0;
+
+static int has_magic(const char *s, const size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++)
+    if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+      return 1;
+  return 0;
+}
+
+/**
+   add pattern to list. pattern must stay valid as long as list is used.
+   @return 0 upon success, negative if pattern can not be used.
+*/
+int glob_add(struct glob **list, const char *pattern)
+{
+  struct glob *g;
+  const size_t len = strlen(pattern);
+
+  if (len == 0 || (g = (struct glob*)calloc(1, sizeof(*g))) == NULL)
+    return -1;
+  g->pattern = pattern;
+  g->kind = GLOB_FNMATCH;
+  if (!has_magic(pattern, len))
+    {
+      g->kind = GLOB_LITERAL;
+      g->text = pattern;
+      g->len = len;
+    }
+  else if (pattern[0] == '*' && !has_magic(pattern + 1, len - 1))
+    {
+      g->kind = GLOB_SUFFIX;
+      g->text = pattern + 1;
+      g->len = len - 1;
+    }
+  else if (pattern[len - 1] == '*' && !has_magic(pattern, len - 1))
+    {
+      g->kind = GLOB_PREFIX;
+      g->text = pattern;
+      g->len = len - 1;
+    }
+#if !defined(__unix__) && !defined(__APPLE__)
+  else
+    {
+      free(g);
+      errno = ENOSYS;
+      return -1;
+    }
+#endif
+
+  g->next = *list;
+  *list = g;
+  return 0;
+}
+
+/**
+   @return true if name matches any pattern of list g.
+*/
+int glob_match(const struct glob *g, const char *name)
+{
+  size_t len;
+
+  for (; g; g = g->next)
+    {
+      switch (g->kind)
+	{
+	case GLOB_LITERAL:
+	  if (!strcmp(name, g->text))
+	    return 1;
+	  break;
+	case GLOB_SUFFIX:
+	  len = strlen(name);
+	  if (len >= g->len && !memcmp(name + len - g->len, g->text, g->len))
+	    return 1;
+	  break;
+	case GLOB_PREFIX:
+	  if (!strncmp(name, g->text, g->len))
+	    return 1;
+	  break;
+	default:
+#if defined(__unix__) || defined(__APPLE__)
+	  if (fnmatch(g->pattern, name, 0) == 0)
+	    return 1;
+#endif
+	  break;
+	}
+    }
+  return 0;
+}
+
+/**
+   only remove files whose name matches pattern.
+   @return 0 upon success, negative if pattern can not be used.
+*/
+int filter_include(const char *pattern)
+{
+  if (glob_add(&includes, pattern) < 0)
+    return -1;
+  active = 1;
+  return 0;
+}
+
+/**
+   do not remove files or enter directories whose name matches pattern.
+   @return 0 upon success, negative if pattern can not be used.
+*/
+int filter_exclude(const char *pattern)
+{
+  if (glob_add(&excludes, pattern) < 0)
+    return -1;
+  active = 1;
+  return 0;
+}
+
+/**
+   parse arg, a number of bytes with an optional k, M or G suffix.
+   @return 0 upon success, negative if arg is invalid.
+*/
+int parse_size(const char *arg, my_off_t *result)
+{
+  char *end;
+  double size = strtod(arg, &end);
+
+  if (end == arg || size < 0)
+    return -1;
+  switch (*end)
+    {
+    case 'k': case 'K': size *= 1024; ++end; break;
+    case 'm': case 'M': size *= 1024 * 1024; ++end; break;
+    case 'g': case 'G': size *= 1024 * 1024 * 1024; ++end; break;
+    }
+  if (*end)
+    return -1;
+  *result = (my_off_t)size;
+  return 0;
+}
+
+/**
+   set a size predicate from arg, see parse_size().
+   @param max true for --max-size, false for --min-size
+   @return 0 upon success, negative if arg is invalid.
+*/
+int filter_size(const char *arg, const int max)
+{
+  if (parse_size(arg, max ? &max_size : &min_size) < 0)
+    return -1;
+  active = need_stat = 1;
+  return 0;
+}
+
+/**
+   set an mtime predicate from arg, an age in days or with an s, m, h or d suffix.
+   @param older true for --older-than, false for --newer-than
+   @return 0 upon success, negative if arg is invalid.
+*/
+int filter_age(const char *arg, const int older)
+{
+  char *end;
+  double age = strtod(arg, &end);
+
+  if (end == arg || age < 0)
+    return -1;
+  switch (*end)
+    {
+    case 's': ++end; break;
+    case 'm': age *= 60; ++end; break;
+    case 'h': age *= 3600; ++end; break;
+    case 'd': age *= 86400; ++end; break;
+    case '\0': age *= 86400; break;
+    }
+  if (*end)
+    return -1;
+
+  if (older)
+    older_than = time(NULL) - (time_t)age;
+  else
+    newer_than = time(NULL) - (time_t)age;
+  active = need_stat = 1;
+  return 0;
+}
+
+/**
+   @return true if any predicate is set.
+*/
+int filter_active(void)
+{
+  return active;
+}
+
+/**
+   @return true if filter_stat() has to be called for files.
+*/
+int filter_needs_stat(void)
+{
+  return need_stat;
+}
+
+/**
+   check the name predicates.
+   @param name the last component of the path
+   @param is_dir true for a directory, which is only checked against --exclude
+   @return true if the entry should be removed, or the directory entered.
+*/
+int filter_name(const char *name, const int is_dir)
+{
+  if (!active)
+    return 1;
+  if (excludes && glob_match(excludes, name))
+    return 0;
+  if (!is_dir && includes && !glob_match(includes, name))
+    return 0;
+  return 1;
+}
+
+/**
+   check the size and mtime predicates of a file.
+   @return true if the file should be removed.
+*/
+int filter_stat(const my_stat_t *statbuf)
+{
+  if (!need_stat || S_ISDIR(statbuf->st_mode))
+    return 1;
+  if (min_size >= 0 && statbuf->st_size < min_size)
+    return 0;
+  if (max_size >= 0 && statbuf->st_size > max_size)
+    return 0;
+  if (older_than && statbuf->st_mtime > older_than)
+    return 0;
+  if (newer_than && statbuf->st_mtime < newer_than)
+    return 0;
+  return 1;
+}
@@ -0,0 +1,477 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#if defined(__linux__)
+/* statx() */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#endif
+
+#if defined(HAVE_SYS_PARAM_H) && defined(HAVE_SYS_MOUNT_H)
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/sysmacros.h>
+#endif
+
+#if defined(HAVE_LINUX_FALLOC_H)
+#include <linux/falloc.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+/* Every file of a run is checked against the file system it lives
+   on. Instead of asking the kernel for each file we remember what we
+   learned per device in this list. There are only a handful of
+   devices in any run, so a linked list with a last-hit shortcut is
+   all we need. Entries are never freed and pointers stay valid for
+   the lifetime of the process. */
+static struct srm_fs_info *fs_info_list = NULL;
+static struct srm_fs_info *fs_info_last = NULL;
+#ifdef HAVE_PTHREAD_H
+/* the open stage of the pipeline may run in several threads */
+static pthread_mutex_t fs_info_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#if defined(__linux__)
+/**
+   read an unsigned number from a sysfs attribute of a block device.
+
+   @param dev device number
+   @param attr attribute path relative to /sys/dev/block/MAJ:MIN/
+
+   @return 0 upon success, negative if the attribute could not be read.
+*/
+int sysfs_read(const unsigned long long dev, const char *attr, unsigned long long *value)
+{
+  char path[256];
+  FILE *f;
+  int ret;
+
+  if(!attr || !value) return -1;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), attr);
+  if((f = fopen(path, "r")) == NULL)
+    {
+      /* partitions do not have a queue directory, look at the whole disk */
+      snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../%s", major(dev), minor(dev), attr);
+      if((f = fopen(path, "r")) == NULL)
+	return -1;
+    }
+  ret = fscanf(f, "%llu", value) == 1 ? 0 : -1;
+  fclose(f);
+  return ret;
+}
+
+#define XFS_SUPER_MAGIC 0x58465342
+
+/**
+   @return true if dev, or the disk of the partition dev, is an md or
+   device mapper device built on other block devices.
+*/
+static int sysfs_stacked(const unsigned long long dev)
+{
+  static const char *const dirs[] = { "slaves", "../slaves" };
+  char path[256];
+  unsigned i;
+  int ret = 0;
+
+  for (i = 0; i < sizeof(dirs)/sizeof(dirs[0]) && !ret; i++)
+    {
+      DIR *d;
+      struct dirent *e;
+      snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), dirs[i]);
+      if ((d = opendir(path)) == NULL)
+	continue;
+      while (!ret && (e = readdir(d)) != NULL)
+	ret = e->d_name[0] != '.';
+      closedir(d);
+    }
+  return ret;
+}
+
+/**
+   look up the full stripe width of the RAID below info. md and device
+   mapper report it as optimal_io_size, a multiple of the chunk in
+   minimum_io_size. Plain disks report all kinds of optimal_io_size,
+   like the maximum transfer size of a USB bridge, which is not taken.
+   Some devices only report the chunk as minimum_io_size. XFS created
+   with a stripe unit reports the stripe width as st_blksize.
+*/
+static void sysfs_stripe(struct srm_fs_info *info, const int fd)
+{
+  unsigned long long opt = 0, min = 0, phys = 0, offset = 0;
+  const int chunk = sysfs_read(info->dev, "queue/minimum_io_size", &min) == 0
+    && sysfs_read(info->dev, "queue/physical_block_size", &phys) == 0 && min > phys;
+
+  if(chunk && sysfs_read(info->dev, "queue/optimal_io_size", &opt) == 0 && opt > 0 && opt % min == 0
+     && sysfs_stacked(info->dev))
+    info->stripe = (unsigned)opt;
+  else if(chunk)
+    info->stripe = (unsigned)min;
+  else if(info->fs_type == (long)XFS_SUPER_MAGIC)
+    {
+      struct stat statbuf;
+      if(fstat(fd, &statbuf) == 0 && (unsigned)statbuf.st_blksize > info->io_size)
+	info->stripe = (unsigned)statbuf.st_blksize;
+    }
+
+  /* a partition which does not start at a stripe boundary */
+  if(info->stripe > 0 && (info->flags & FS_INFO_BLOCKDEV) && sysfs_read(info->dev, "alignment_offset", &offset) == 0)
+    info->stripe_offset = (unsigned)(offset % info->stripe);
+}
+
+/* the devices a file system is on may be stacked: a partition of a
+   disk, a device mapper or md device on top of other block devices, or
+   a loop device on a file of another file system. */
+#define SYSFS_MAX_STACK 8
+
+static void desc_append(char *desc, const size_t len, const char *s)
+{
+  size_t l = strlen(desc);
+  while (*s && l + 1 < len)
+    desc[l++] = *s++;
+  desc[l] = 0;
+}
+
+/**
+   find out whether the block device dev is rotational. Device mapper
+   and md devices are rotational if any device below them is, a loop
+   device is looked up through the file system of its backing file.
+
+   @param desc the names of the devices of the stack are appended to this, for -vv
+   @param disk set to the whole disk at the bottom of the stack which
+   makes it rotational, the disk of a partition rather than the partition
+   @return 1 for rotational disks, 0 for solid-state devices, -1 if unknown.
+*/
+static int sysfs_rotational(const unsigned long long dev, char *desc, const size_t len, const int depth,
+			    unsigned long long *disk)
+{
+  char path[320], link[256];
+  unsigned long long u;
+  const char *name;
+  ssize_t n;
+  int ret = -1;
+
+  if (major(dev) == 0 || depth > SYSFS_MAX_STACK)
+    return -1;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+  if ((n = readlink(path, link, sizeof(link) - 1)) < 0)
+    return -1;
+  link[n] = 0;
+  name = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+  desc_append(desc, len, name);
+
+  {
+    FILE *f;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/loop/backing_file", major(dev), minor(dev));
+    if ((f = fopen(path, "r")) != NULL)
+      {
+	char backing[256];
+	struct stat statbuf;
+	if (fgets(backing, sizeof(backing), f))
+	  {
+	    backing[strcspn(backing, "\n")] = 0;
+	    if (stat(backing, &statbuf) == 0)
+	      {
+		desc_append(desc, len, "(");
+		/* tmpfs, btrfs and others have no block device of their own */
+		if (major(statbuf.st_dev) == 0)
+		  desc_append(desc, len, backing);
+		else
+		  ret = sysfs_rotational(statbuf.st_dev, desc, len, depth + 1, disk);
+		desc_append(desc, len, ")");
+	      }
+	  }
+	fclose(f);
+	if (ret >= 0)
+	  return ret;
+      }
+  }
+
+  {
+    DIR *d;
+    struct dirent *e;
+    int first = 1;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves", major(dev), minor(dev));
+    if ((d = opendir(path)) != NULL)
+      {
+	while ((e = readdir(d)) != NULL)
+	  {
+	    unsigned long long slave_disk = 0;
+	    unsigned maj, min;
+	    FILE *f;
+	    int r = -1;
+	    if (e->d_name[0] == '.')
+	      continue;
+	    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves/%s/dev", major(dev), minor(dev), e->d_name);
+	    if ((f = fopen(path, "r")) == NULL)
+	      continue;
+	    if (fscanf(f, "%u:%u", &maj, &min) == 2)
+	      {
+		desc_append(desc, len, first ? "(" : ",");
+		first = 0;
+		r = sysfs_rotational(makedev(maj, min), desc, len, depth + 1, &slave_disk);
+	      }
+	    fclose(f);
+	    if (r > 0 && ret <= 0)
+	      *disk = slave_disk;
+	    if (r > 0 || (r == 0 && ret < 0))
+	      ret = r;
+	  }
+	closedir(d);
+	if (!first)
+	  desc_append(desc, len, ")");
+	if (ret >= 0)
+	  return ret;
+      }
+  }
+
+  if (sysfs_read(dev, "queue/rotational", &u) == 0)
+    ret = u ? 1 : 0;
+  *disk = dev;
+  /* a partition shares the head of its disk */
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", major(dev), minor(dev));
+  if (access(path, F_OK) == 0)
+    {
+      FILE *f;
+      unsigned maj, min;
+      snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", major(dev), minor(dev));
+      if ((f = fopen(path, "r")) != NULL)
+	{
+	  if (fscanf(f, "%u:%u", &maj, &min) == 2)
+	    *disk = makedev(maj, min);
+	  fclose(f);
+	}
+    }
+  return ret;
+}
+#endif
+
+#if defined(__linux__)
+/**
+   print how files or a device on info are written because of the kind
+   of device, for -vv.
+*/
+static void fs_info_print(const struct srm_fs_info *info, const char *desc, const int options)
+{
+  const struct srm_scheme *scheme = scheme_lookup(options);
+
+  if(info->rotational < 0)
+    error("device %u:%u%s%s: not known whether rotational, queue depth %u",
+	  major(info->dev), minor(info->dev), *desc ? " on " : "", desc, blockdev_depth(info));
+  else if(info->rotational)
+    error("device %u:%u on %s: rotational, queue depth %u, overwrites one file at a time%s",
+	  major(info->dev), minor(info->dev), desc, blockdev_depth(info),
+	  order_window > 0 ? ", removed in block order" : "");
+  else
+    error("device %u:%u on %s: solid-state, queue depth %u, overwrites files in parallel%s",
+	  major(info->dev), minor(info->dev), desc, blockdev_depth(info),
+	  scheme->num_passes > 1 ? ", the flash remaps overwrites and more passes only wear it" : "");
+}
+#endif
+
+static int fs_info_probe(struct srm_fs_info *info, const int fd, const int options)
+{
+#if defined(HAVE_SYS_VFS_H) || (defined(HAVE_SYS_PARAM_H) && defined(HAVE_SYS_MOUNT_H))
+  if(!(info->flags & FS_INFO_BLOCKDEV))
+    {
+      struct statfs fs_stats;
+      if (fstatfs(fd, &fs_stats) < 0)
+	{
+	  if (errno != ENOSYS)
+	    return -1;
+	}
+      else
+	{
+	  info->fs_type = (long)fs_stats.f_type;
+#if defined(__linux__)
+	  info->io_size = fs_stats.f_bsize;
+#elif defined(__FreeBSD__) || defined(__APPLE__)
+	  info->io_size = fs_stats.f_iosize;
+#else
+#error Please define your platform.
+#endif
+	}
+    }
+#endif
+
+#if defined(STATX_DIOALIGN)
+  {
+    struct statx stx;
+    if(statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN))
+      {
+	info->dio_mem_align = stx.stx_dio_mem_align;
+	info->dio_offset_align = stx.stx_dio_offset_align;
+      }
+  }
+#endif
+
+#if defined(__linux__)
+  {
+    unsigned long long u;
+    char desc[128] = "";
+    info->rotational = sysfs_rotational(info->dev, desc, sizeof(desc), 0, &info->disk);
+    sysfs_stripe(info, fd);
+    if(sysfs_read(info->dev, "queue/discard_max_bytes", &u) == 0)
+      info->discard = u ? 1 : 0;
+    if((options & SRM_OPT_V) > 1)
+      fs_info_print(info, desc, options);
+  }
+#endif
+
+  if(!(info->flags & FS_INFO_BLOCKDEV))
+    info->strategy = strategy_lookup(info->fs_type);
+
+  (void)fd;
+  if((options & SRM_OPT_V) > 2)
+    {
+      error("device %llu: fs type 0x%lx, io size %u, direct I/O alignment %u/%u, rotational %i, discard %i, stripe %u+%u",
+	    info->dev, info->fs_type, info->io_size, info->dio_mem_align, info->dio_offset_align, info->rotational, info->discard,
+	    info->stripe, info->stripe_offset);
+      if(info->strategy)
+	strategy_print(info->dev, info->strategy);
+    }
+  return 0;
+}
+
+static const struct srm_fs_info *fs_info_lookup_locked(const int fd, const unsigned long long dev, const int flags, const int options)
+{
+  struct srm_fs_info *info;
+
+  if(fs_info_last && fs_info_last->dev == dev && fs_info_last->flags == flags)
+    return fs_info_last;
+
+  for(info = fs_info_list; info; info = info->next)
+    if(info->dev == dev && info->flags == flags)
+      return fs_info_last = info;
+
+  if((info = (struct srm_fs_info*)calloc(1, sizeof(*info))) == NULL)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+  info->dev = dev;
+  info->flags = flags;
+  info->rotational = -1;
+  info->discard = -1;
+  info->punch_hole = -1;
+  if(fs_info_probe(info, fd, options) < 0)
+    {
+      int e=errno;
+      free(info);
+      errno=e;
+      return NULL;
+    }
+
+  info->next = fs_info_list;
+  fs_info_list = info;
+  return fs_info_last = info;
+}
+
+/**
+   look up the capabilities of the file system or block device that
+   fd lives on. The first call for a device probes the kernel, later
+   calls return the cached result.
+
+   @param fd open file descriptor on the device
+   @param dev st_dev of a file, or st_rdev of a block device
+   @param flags FS_INFO_* flags
+   @param options SRM_OPT_* bits, used for verbose output
+
+   @return the cached entry or NULL upon error (see the errno variable for details).
+*/
+const struct srm_fs_info *fs_info_lookup(const int fd, const unsigned long long dev, const int flags, const int options)
+{
+#ifdef HAVE_PTHREAD_H
+  const struct srm_fs_info *info;
+  int e;
+  pthread_mutex_lock(&fs_info_lock);
+  info = fs_info_lookup_locked(fd, dev, flags, options);
+  e = errno;
+  pthread_mutex_unlock(&fs_info_lock);
+  errno = e;
+  return info;
+#else
+  return fs_info_lookup_locked(fd, dev, flags, options);
+#endif
+}
+
+/**
+   find out once per file system whether holes can be punched into its
+   files. The first file asks the kernel to punch a hole behind its end,
+   which changes nothing, every later file gets the cached answer.
+
+   @param info entry of the file system, see fs_info_lookup()
+   @param fd file opened for writing on it
+
+   @return 1 if holes can be punched, 0 if not.
+*/
+int fs_info_punch_hole(const struct srm_fs_info *info, const int fd)
+{
+  struct srm_fs_info *i = (struct srm_fs_info*)info;
+  int ret;
+
+  if (!info)
+    return 0;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&fs_info_lock);
+#endif
+  if (i->punch_hole < 0)
+    {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+      struct stat statbuf;
+      if (fstat(fd, &statbuf) == 0)
+	i->punch_hole = fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, statbuf.st_size, 4096) == 0;
+#else
+      (void)fd;
+      i->punch_hole = 0;
+#endif
+    }
+  ret = i->punch_hole > 0;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&fs_info_lock);
+#endif
+  return ret;
+}
+
+/**
+   a write that does not start at a stripe boundary makes a RAID read
+   the rest of the stripe to recompute its parity. Writes are split so
+   that they start and end at stripe boundaries where possible.
+
+   @return the number of bytes from offset to the next stripe boundary,
+   0 if offset is at one or the stripe is not known.
+*/
+my_off_t fs_info_stripe_head(const struct srm_fs_info *info, const my_off_t offset)
+{
+  my_off_t mis;
+
+  if (!info || info->stripe == 0)
+    return 0;
+  mis = (offset % info->stripe + info->stripe - info->stripe_offset) % info->stripe;
+  return mis ? info->stripe - mis : 0;
+}
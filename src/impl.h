@@ -4,6 +4,9 @@
 #ifndef IMPL__H
 #define IMPL__H
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #ifndef FTS_F
 #define FTS_F 11111
 #endif
@@ -34,19 +37,247 @@
 #error no SRM_DIRSEP definition for your platform (yet)!
 #endif
 
+/** internal option bit: write the extents of the file in physical order, see order.c */
+#define SRM_OPT_EXTENT_ORDER (1 << 7)
+/** internal option bit: do not overwrite the file in a --batch group, see policy.c */
+#define SRM_OPT_NO_BATCH (1 << 8)
+
+/** fs_info_lookup() flag: dev is the st_rdev of a block device node. */
+#define FS_INFO_BLOCKDEV 1
+
+/** when the passes of a file are made durable, see strategy.c */
+enum { SYNC_WRITE, SYNC_PASS, SYNC_END, SYNC_NONE };
+
+/** how files on one type of file system are overwritten, see strategy_lookup(). */
+struct srm_strategy
+{
+  /** NULL for a type added by --fs-strategy */
+  const char *name;
+  /** statfs f_type, 0 for file systems not in the table */
+  long fs_type;
+  /** I/O size, 0 for the preferred I/O size of the file system */
+  unsigned io_size;
+  /** SYNC_WRITE: every write is synchronous, SYNC_PASS: one sync per pass,
+      SYNC_END: one sync after the last pass, SYNC_NONE: no sync at all */
+  int sync;
+  /** 1 to write with direct I/O where the file system supports it */
+  int direct;
+  /** 1 to punch out the overwritten blocks, 0 never, -1 as --discard says */
+  int discard;
+  /** maximum number of passes, 0 for all passes of the mode */
+  unsigned passes;
+};
+
+/** capabilities of a file system or block device, see fs_info_lookup(). */
+struct srm_fs_info
+{
+  struct srm_fs_info *next;
+  unsigned long long dev;
+  int flags;
+  /** statfs f_type, 0 if unknown */
+  long fs_type;
+  /** preferred I/O size, 0 if unknown */
+  unsigned io_size;
+  /** direct I/O memory and file offset alignment, 0 if direct I/O is not supported */
+  unsigned dio_mem_align, dio_offset_align;
+  /** 1 if the device supports discard, 0 if not, -1 if unknown */
+  int discard;
+  /** 1 for rotational disks, 0 for solid-state devices, -1 if unknown */
+  int rotational;
+  /** the whole disk below a partition, device mapper, md or loop device, 0 if unknown */
+  unsigned long long disk;
+  /** full stripe width of a RAID below, 0 if unknown, see fs_info_stripe() */
+  unsigned stripe;
+  /** offset of the first full stripe of a block device */
+  unsigned stripe_offset;
+  /** 1 if holes can be punched into files, 0 if not, -1 if not probed yet, see fs_info_punch_hole() */
+  int punch_hole;
+  /** how files are overwritten, NULL for block devices */
+  const struct srm_strategy *strategy;
+};
+
+#ifdef _MSC_VER
+typedef long long my_off_t;
+typedef struct __stat64 my_stat_t;
+#else
+typedef off_t my_off_t;
+typedef struct stat my_stat_t;
+#endif
+
+/** a file or device that is being overwritten. */
+struct srm_target
+{
+  int fd;
+  const char* file_name;
+  my_off_t file_size;
+  unsigned char *buffer;
+  unsigned buffer_size;
+  int options;
+  const struct srm_fs_info *fs;
+  /** if set the caller issues the barrier after each pass, see overwrite_group() */
+  int defer_sync;
+  /* extended attributes, see extattr_list() */
+  char *extattr_names;
+  size_t extattr_names_len;
+  struct srm_extattr *extattrs;
+  unsigned extattr_count;
+  unsigned char *extattr_value;
+  size_t extattr_value_size;
+  /** checkpoint record of --journal, see journal.c */
+  struct srm_journal *journal;
+  /** direct I/O alignment of the file offset, 0 if the file is not written with direct I/O */
+  unsigned direct_align;
+  /** progress requests already answered for this target, see sunlink_signals() */
+  int progress_seen;
+};
+
+/** a part of a file and where it is on disk, see fiemap_extents(). */
+struct srm_extent
+{
+  unsigned long long logical, length;
+  /** ~0 if the part has no known location */
+  unsigned long long physical;
+};
+
+/** a single overwrite pass. */
+struct srm_pass
+{
+  /** number of bytes in pattern, 0 for a pass of random data */
+  unsigned char len;
+  unsigned char pattern[4];
+};
+
+/** the passes of an SRM_MODE_* overwrite mode. */
+struct srm_scheme
+{
+  int mode;
+  const char *name;
+  const struct srm_pass *passes;
+  unsigned num_passes;
+};
+
+/** reference counted directory, see walker.c */
+struct walk_node;
+
+/** stages of the deletion pipeline, see pipeline.c */
+enum { PIPELINE_OPEN, PIPELINE_OVERWRITE, PIPELINE_UNLINK, PIPELINE_STAGES };
+
+/** what --cow does with files that would be copied on write, see cow.c */
+enum { COW_WARN, COW_ONCE, COW_SKIP };
+
+/** output formats of --plan, see plan.c */
+enum { PLAN_OFF, PLAN_TEXT, PLAN_JSON };
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 extern char *program_name;
+extern unsigned batch_files;
+extern unsigned pipeline_threads[PIPELINE_STAGES];
+extern unsigned pipeline_queue_depth;
+extern unsigned walk_threads;
+extern unsigned long walk_memory_limit;
+extern int files_from_delim;
+extern int plan_format;
+extern unsigned long long journal_interval;
+extern unsigned blockdev_queue_depth;
+extern unsigned order_window;
+extern int cow_policy;
+extern double throttle_rate, throttle_ops, throttle_dev_rate, throttle_dev_ops;
 void error(char *msg, ...);
 void errorp(char *msg, ...);
-int process_file(char *path, const int flag, const int options);
+int process_file(char *path, const int flag, struct walk_node *node, const int options);
 int tree_walker(char ** trees, const int options);
+int parallel_walker(char **trees, const int options);
+struct walk_node *walk_node_new(struct walk_node *parent, const char *path);
+void walk_node_hold(struct walk_node *node);
+void walk_node_fail(struct walk_node *node);
+void walk_node_keep(struct walk_node *node);
+void walk_node_prune(struct walk_node *node);
+int walk_node_pruned(const struct walk_node *node);
+void walk_node_release(struct walk_node *node, const int failed);
+int walk_node_failures(void);
+int rename_unlink_dir(const char *path);
+char *rename_random(const char *path);
+int files_from_open(const char *file);
+char *next_tree(char **trees, unsigned *i);
+int filter_include(const char *pattern);
+int filter_exclude(const char *pattern);
+int filter_size(const char *arg, const int max);
+int filter_age(const char *arg, const int older);
+int filter_active(void);
+int filter_needs_stat(void);
+int filter_name(const char *name, const int is_dir);
+int filter_stat(const my_stat_t *statbuf);
+struct glob;
+int glob_add(struct glob **list, const char *pattern);
+int glob_match(const struct glob *list, const char *name);
+int parse_size(const char *arg, my_off_t *size);
+int policy_load(const char *file);
+int policy_active(void);
+int policy_apply(const char *path, const int options);
+void policy_report(const int format);
+int journal_open(const char *file, const int resume);
+void journal_begin(struct srm_target *srm, unsigned *pass, my_off_t *offset);
+void journal_checkpoint(struct srm_target *srm, const unsigned pass, const my_off_t offset);
+void journal_end(struct srm_target *srm);
+void journal_done(const struct srm_target *srm);
+void journal_commit(void);
+int journal_completed(const char *path);
+void journal_close(const int failed, const int options);
+int plan_file(const char *path, const int options);
+void plan_report(const int options);
+void plan_record(const struct srm_fs_info *fs, const unsigned long long bytes, const double seconds);
+void plan_save(const int options);
+double plan_clock(void);
 void init_random(const unsigned int seed);
 unsigned char random_char(void);
 int randomize_buffer(unsigned char *buffer, int length);
 void fill(unsigned char *dst, unsigned dst_len, const unsigned char *src, const unsigned src_len);
+const struct srm_fs_info *fs_info_lookup(const int fd, const unsigned long long dev, const int flags, const int options);
+int fs_info_punch_hole(const struct srm_fs_info *info, const int fd);
+my_off_t fs_info_stripe_head(const struct srm_fs_info *info, const my_off_t offset);
+const struct srm_strategy *strategy_lookup(const long fs_type);
+int strategy_set(const char *spec);
+void strategy_print(const unsigned long long dev, const struct srm_strategy *s);
+int sysfs_read(const unsigned long long dev, const char *attr, unsigned long long *value);
+const struct srm_scheme *scheme_lookup(const int options);
+void pass_fill(unsigned char *buffer, const unsigned buffer_size, const struct srm_pass *pass);
+int pass_is_zero(const struct srm_pass *pass);
+void direct_io(const int fd, const int on);
+void sunlink_signals(void);
+int sunlink_open(struct srm_target *srm, const my_stat_t *statbuf, const int oflags);
+int sunlink_finish(struct srm_target *srm, const int oflags);
+int sunlink_finish_group(struct srm_target *targets, const unsigned num, const int oflags, int *failed);
+int overwrite_group(struct srm_target *targets, const unsigned num, const unsigned buffer_size, const int options);
+int batch_add(const char *path, struct walk_node *parent, const int options);
+int batch_flush(const int options);
+int overwrite_selector(struct srm_target *srm);
+int order_add(const char *path, struct walk_node *parent, const int options);
+int order_flush(const int options);
+void order_report(const int options);
+struct srm_extent *fiemap_extents(const int fd, const my_off_t size, unsigned *num);
+int fiemap_shared(const int fd, const my_off_t size, unsigned long long *shared);
+int cow_check(const struct srm_target *srm);
+void cow_report(const int options);
+unsigned blockdev_depth(const struct srm_fs_info *fs);
+unsigned blockdev_io_size(const struct srm_fs_info *fs, const unsigned long long dev, const unsigned sector);
+void blockdev_report(const int options);
+int throttle_parse(const char *arg, double *rate, double *ops);
+int throttle_file(const char *file);
+int throttle_ionice(const char *arg);
+void throttle(const struct srm_fs_info *fs, const size_t bytes);
+void throttle_report(const int options);
+int throttle_pressure(const double target, const int options);
+unsigned throttle_depth(const unsigned depth);
+int blockdev_wipe(struct srm_target *srm);
+int blockdev_remove(const char *path, const my_stat_t *statbuf, const int options);
+int blockdev_wipe_all(char **paths, const unsigned num, const int options);
+int pipeline_active(void);
+int pipeline_start(const int options);
+int pipeline_submit(const char *path, struct walk_node *parent, const int options);
+int pipeline_finish(const int options);
 
 #ifdef __cplusplus
 }
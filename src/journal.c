@@ -0,0 +1,613 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <stdint.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+/* With --journal every target of at least JOURNAL_MIN_SIZE bytes
+   gets a checkpoint record: its identity (device, inode, size and
+   mode) and how far the overwrite got, as the pass in progress and
+   the offset up to which that pass is durable. A record is only
+   written after a barrier, at the end of each pass and every
+   journal_interval bytes within a pass, and is removed once all
+   passes are done. --resume continues a target with a matching record
+   from its checkpoint instead of from the first pass. A block device
+   is recorded by its device number with inode 0: its node in /dev is
+   created anew at every boot, with another inode number.
+
+   The journal is a small text file which is replaced as a whole with
+   rename(), so a crash leaves either the old or the new version. It
+   must not be on the device that is overwritten, targets on the
+   journal's device are not checkpointed. */
+
+/* Next to it FILE.done collects the regular files whose overwrite
+   has completed, so a rerun of an interrupted srm -r does not shred
+   them again when the unlink had not happened yet. It is append only:
+   a header and then fixed size records of device, inode, size and
+   modification time, the last two telling a file from a new one that
+   got the inode number after the unlink. Records are collected in
+   memory and written with one fdatasync() per DONE_GROUP records or
+   DONE_DELAY seconds, a crash only loses the last group and those
+   files get overwritten again. With --resume the file is mapped and
+   indexed by a hash table of record numbers, so startup does not
+   parse anything and every entry of the walk is one lookup. */
+
+#define JOURNAL_MIN_SIZE (64 * 1024 * 1024)
+#define JOURNAL_HEADER "srm-journal 1\n"
+#define DONE_MAGIC "srm-done"
+#define DONE_VERSION 1
+#define DONE_GROUP 256
+#define DONE_DELAY 1.0
+
+struct srm_journal
+{
+  struct srm_journal *next;
+  unsigned long long dev, ino, size;
+  int mode;
+  unsigned pass;
+  unsigned long long offset;
+  /* set while a target of this run uses the record */
+  int active;
+};
+
+/** bytes of a pass between two checkpoints. */
+unsigned long long journal_interval = 1024ULL * 1024 * 1024;
+
+#if defined(__unix__) || defined(__APPLE__)
+
+struct done_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+struct done_record
+{
+  uint64_t dev, ino, size;
+  int64_t mtime_ns;
+};
+
+static int done_fd = -1;
+static struct done_record done_group[DONE_GROUP];
+static unsigned done_count = 0;
+static double done_flushed = 0;
+/* the records of the interrupted run, see done_load() */
+static const struct done_record *done_map = NULL;
+static size_t done_map_size = 0, done_records = 0;
+static uint32_t *done_index = NULL;
+static size_t done_index_mask = 0;
+static unsigned long done_skipped = 0;
+
+static const char *journal_file = NULL;
+static int journal_resume = 0;
+static unsigned long long journal_dev = 0;
+static struct srm_journal *records = NULL;
+#ifdef HAVE_PTHREAD_H
+/* the overwrite stage of the pipeline may run in several threads */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+#define JOURNAL_LOCK() pthread_mutex_lock(&journal_lock)
+#define JOURNAL_UNLOCK() pthread_mutex_unlock(&journal_lock)
+#else
+#define JOURNAL_LOCK()
+#define JOURNAL_UNLOCK()
+#endif
+
+static size_t done_hash(const uint64_t dev, const uint64_t ino)
+{
+  uint64_t h = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+  return (size_t)(h >> 17);
+}
+
+static void done_stat(const my_stat_t *statbuf, struct done_record *r)
+{
+  r->dev = statbuf->st_dev;
+  r->ino = statbuf->st_ino;
+  r->size = statbuf->st_size;
+#if defined(__APPLE__)
+  r->mtime_ns = (int64_t)statbuf->st_mtimespec.tv_sec * 1000000000 + statbuf->st_mtimespec.tv_nsec;
+#elif defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L
+  r->mtime_ns = (int64_t)statbuf->st_mtim.tv_sec * 1000000000 + statbuf->st_mtim.tv_nsec;
+#else
+  r->mtime_ns = (int64_t)statbuf->st_mtime * 1000000000;
+#endif
+}
+
+/* map the records of name and index them */
+static int done_load(const char *name)
+{
+  const struct done_header *h;
+  struct stat statbuf;
+  size_t i, size;
+  void *map;
+  int fd;
+
+  if ((fd = open(name, O_RDONLY)) < 0)
+    return errno == ENOENT ? 0 : -1;
+  if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t)sizeof(struct done_header))
+    {
+      close(fd);
+      return 0;
+    }
+  map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  h = (const struct done_header*)map;
+  if (memcmp(h->magic, DONE_MAGIC, sizeof(h->magic)) || h->version != DONE_VERSION ||
+      h->record_size != sizeof(struct done_record))
+    {
+      munmap(map, statbuf.st_size);
+      errno = EINVAL;
+      return -1;
+    }
+
+  done_map = (const struct done_record*)(h + 1);
+  done_map_size = statbuf.st_size;
+  /* a torn record at the end is ignored */
+  done_records = (statbuf.st_size - sizeof(*h)) / sizeof(struct done_record);
+  if (done_records == 0)
+    return 0;
+
+  for (size = 16; size < done_records * 2; size *= 2)
+    ;
+  if ((done_index = (uint32_t*)calloc(size, sizeof(uint32_t))) == NULL)
+    return -1;
+  done_index_mask = size - 1;
+  for (i = 0; i < done_records; i++)
+    {
+      size_t slot = done_hash(done_map[i].dev, done_map[i].ino) & done_index_mask;
+      while (done_index[slot])
+	slot = (slot + 1) & done_index_mask;
+      done_index[slot] = (uint32_t)(i + 1);
+    }
+  return 0;
+}
+
+/* open FILE.done, keeping its records with --resume */
+static int done_open(const char *file, const int resume)
+{
+  char name[1100];
+  struct done_header h;
+
+  snprintf(name, sizeof(name), "%s.done", file);
+  if (resume && done_load(name) < 0)
+    return -1;
+  if ((done_fd = open(name, O_WRONLY|O_CREAT|O_APPEND|(resume ? 0 : O_TRUNC), 0600)) < 0)
+    return -1;
+  if (lseek(done_fd, 0, SEEK_END) == 0)
+    {
+      memset(&h, 0, sizeof(h));
+      memcpy(h.magic, DONE_MAGIC, sizeof(h.magic));
+      h.version = DONE_VERSION;
+      h.record_size = sizeof(struct done_record);
+      if (write(done_fd, &h, sizeof(h)) != sizeof(h))
+	return -1;
+    }
+  done_flushed = plan_clock();
+  return 0;
+}
+
+/* write the collected records, must be called with journal_lock held */
+static void done_flush(void)
+{
+  const ssize_t len = done_count * sizeof(struct done_record);
+
+  if (done_count == 0)
+    return;
+  if (write(done_fd, done_group, len) != len)
+    errorp("could not write journal %s.done", journal_file);
+#if HAVE_FDATASYNC
+  fdatasync(done_fd);
+#else
+  fsync(done_fd);
+#endif
+  done_count = 0;
+  done_flushed = plan_clock();
+}
+
+/**
+   the overwrite of the regular file open in srm has completed, record
+   it in the FILE.done journal.
+*/
+void journal_done(const struct srm_target *srm)
+{
+  struct stat statbuf;
+
+  if (done_fd < 0 || fstat(srm->fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+    return;
+  JOURNAL_LOCK();
+  done_stat(&statbuf, &done_group[done_count++]);
+  if (done_count == DONE_GROUP || plan_clock() - done_flushed >= DONE_DELAY)
+    done_flush();
+  JOURNAL_UNLOCK();
+}
+
+/**
+   write the recorded files now, overwrite_group() calls it before the
+   files of a --batch group are unlinked.
+*/
+void journal_commit(void)
+{
+  if (done_fd < 0)
+    return;
+  JOURNAL_LOCK();
+  done_flush();
+  JOURNAL_UNLOCK();
+}
+
+/**
+   @return true if the file path was overwritten by the interrupted run.
+*/
+int journal_completed(const char *path)
+{
+  struct done_record r;
+  struct stat statbuf;
+  size_t slot;
+
+  if (!done_index || lstat(path, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+    return 0;
+  done_stat(&statbuf, &r);
+  for (slot = done_hash(r.dev, r.ino) & done_index_mask; done_index[slot]; slot = (slot + 1) & done_index_mask)
+    {
+      const struct done_record *d = done_map + done_index[slot] - 1;
+      if (d->dev == r.dev && d->ino == r.ino && d->size == r.size && d->mtime_ns == r.mtime_ns)
+	{
+	  JOURNAL_LOCK();
+	  done_skipped++;
+	  JOURNAL_UNLOCK();
+	  return 1;
+	}
+    }
+  return 0;
+}
+
+/**
+   write the last records at the end of the run. If the run succeeded
+   nothing is left to resume and the FILE.done journal is removed.
+   @param failed true if any file could not be removed
+*/
+void journal_close(const int failed, const int options)
+{
+  char name[1100];
+
+  if (done_fd < 0)
+    return;
+  JOURNAL_LOCK();
+  done_flush();
+  close(done_fd);
+  done_fd = -1;
+  JOURNAL_UNLOCK();
+
+  if (options & SRM_OPT_V)
+    {
+      if (done_index)
+	error("journal: %lu of %lu completed files were not overwritten again", done_skipped, (unsigned long)done_records);
+    }
+  if (done_map)
+    munmap((void*)((const struct done_header*)done_map - 1), done_map_size);
+  if (!failed)
+    {
+      snprintf(name, sizeof(name), "%s.done", journal_file);
+      unlink(name);
+    }
+}
+
+/**
+   keep checkpoints of large overwrites in file.
+   @param resume continue targets from the checkpoints already in file
+   @return 0 upon success, negative upon error (see the errno variable for details).
+*/
+int journal_open(const char *file, const int resume)
+{
+  char line[256], dir[1024];
+  struct stat statbuf;
+  char *slash;
+  FILE *f;
+
+  if (!file)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  /* the journal may not exist yet, its directory decides the device */
+  snprintf(dir, sizeof(dir), "%s", file);
+  if ((slash = strrchr(dir, SRM_DIRSEP)) != NULL)
+    *(slash == dir ? slash + 1 : slash) = '\0';
+  else
+    strcpy(dir, ".");
+  if (stat(file, &statbuf) < 0 && stat(dir, &statbuf) < 0)
+    return -1;
+  journal_dev = statbuf.st_dev;
+  journal_file = file;
+  journal_resume = resume;
+
+  if (done_open(file, resume) < 0)
+    return -1;
+
+  if ((f = fopen(file, "r")) == NULL)
+    return errno == ENOENT ? 0 : -1;
+  if (!fgets(line, sizeof(line), f) || strcmp(line, JOURNAL_HEADER))
+    {
+      fclose(f);
+      errno = EINVAL;
+      return -1;
+    }
+  while (fgets(line, sizeof(line), f))
+    {
+      struct srm_journal *j = (struct srm_journal*)calloc(1, sizeof(*j));
+      if (!j)
+	{
+	  fclose(f);
+	  errno = ENOMEM;
+	  return -1;
+	}
+      if (sscanf(line, "%llu %llu %llu %i %u %llu", &j->dev, &j->ino, &j->size, &j->mode, &j->pass, &j->offset) != 6)
+	{
+	  free(j);
+	  continue;
+	}
+      j->next = records;
+      records = j;
+    }
+  fclose(f);
+  return 0;
+}
+
+/* replace the journal with the current records, must be called with journal_lock held */
+static int journal_write(void)
+{
+  char tmp[1100], dir[1024];
+  struct srm_journal *j;
+  char *slash;
+  FILE *f;
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.%i", journal_file, (int)getpid());
+  if ((f = fopen(tmp, "w")) == NULL)
+    return -1;
+  fputs(JOURNAL_HEADER, f);
+  for (j = records; j; j = j->next)
+    fprintf(f, "%llu %llu %llu %i %u %llu\n", j->dev, j->ino, j->size, j->mode, j->pass, j->offset);
+  if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+    {
+      int e = errno;
+      fclose(f);
+      unlink(tmp);
+      errno = e;
+      return -1;
+    }
+  if (fclose(f) != 0 || rename(tmp, journal_file) < 0)
+    {
+      int e = errno;
+      unlink(tmp);
+      errno = e;
+      return -1;
+    }
+
+  /* make the rename durable */
+  snprintf(dir, sizeof(dir), "%s", journal_file);
+  if ((slash = strrchr(dir, SRM_DIRSEP)) != NULL)
+    *(slash == dir ? slash + 1 : slash) = '\0';
+  else
+    strcpy(dir, ".");
+  if ((fd = open(dir, O_RDONLY)) >= 0)
+    {
+      fsync(fd);
+      close(fd);
+    }
+  return 0;
+}
+
+/* true if the journal is on dev or on a partition of dev */
+static int journal_on_device(const unsigned long long dev)
+{
+#if defined(__linux__)
+  char path[256];
+  unsigned maj, min;
+  FILE *f;
+  int ret = 0;
+#endif
+
+  if (journal_dev == dev)
+    return 1;
+#if defined(__linux__)
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", major(journal_dev), minor(journal_dev));
+  if ((f = fopen(path, "r")) != NULL)
+    {
+      if (fscanf(f, "%u:%u", &maj, &min) == 2)
+	ret = makedev(maj, min) == dev;
+      fclose(f);
+    }
+  return ret;
+#else
+  return 0;
+#endif
+}
+
+/**
+   start checkpointing srm if the journal is open and the target is
+   large enough. With --resume a matching record sets the pass and
+   offset to start from.
+   @param pass set to the first pass to write
+   @param offset set to the offset at which to start that pass
+*/
+void journal_begin(struct srm_target *srm, unsigned *pass, my_off_t *offset)
+{
+  struct srm_journal *j;
+  struct stat statbuf;
+  unsigned long long dev, ino;
+  const int mode = srm->options & SRM_MODE_MASK;
+
+  *pass = 0;
+  *offset = 0;
+  srm->journal = NULL;
+  if (!journal_file || srm->file_size < JOURNAL_MIN_SIZE || fstat(srm->fd, &statbuf) < 0)
+    return;
+
+  /* the size of a block device is its BLKGETSIZE64, see blockdev_remove() */
+  dev = S_ISBLK(statbuf.st_mode) ? statbuf.st_rdev : statbuf.st_dev;
+  ino = S_ISBLK(statbuf.st_mode) ? 0 : statbuf.st_ino;
+  if (journal_on_device(dev))
+    {
+      error("%s is on the same device as the journal %s, not checkpointing it", srm->file_name, journal_file);
+      return;
+    }
+
+  JOURNAL_LOCK();
+  for (j = records; j; j = j->next)
+    if (j->dev == dev && j->ino == ino)
+      break;
+  if (j && journal_resume && !j->active && j->size == (unsigned long long)srm->file_size && j->mode == mode)
+    {
+      *pass = j->pass;
+      *offset = j->offset;
+      if (srm->options & SRM_OPT_V)
+	error("resuming %s at pass %u, offset %llu", srm->file_name, j->pass + 1, j->offset);
+    }
+  else
+    {
+      if (!j && (j = (struct srm_journal*)calloc(1, sizeof(*j))) != NULL)
+	{
+	  j->next = records;
+	  records = j;
+	}
+      if (j)
+	{
+	  j->dev = dev;
+	  j->ino = ino;
+	  j->size = srm->file_size;
+	  j->mode = mode;
+	  j->pass = 0;
+	  j->offset = 0;
+	}
+    }
+  if (j)
+    {
+      j->active = 1;
+      srm->journal = j;
+    }
+  JOURNAL_UNLOCK();
+}
+
+/**
+   record that pass of srm is durable up to offset. The caller must
+   have issued the barrier.
+*/
+void journal_checkpoint(struct srm_target *srm, const unsigned pass, const my_off_t offset)
+{
+  if (!srm->journal)
+    return;
+  JOURNAL_LOCK();
+  srm->journal->pass = pass;
+  srm->journal->offset = offset;
+  if (journal_write() < 0)
+    {
+      errorp("could not write journal %s", journal_file);
+      /* do not pretend to checkpoint */
+      srm->journal->active = 0;
+      srm->journal = NULL;
+    }
+  JOURNAL_UNLOCK();
+}
+
+/**
+   all passes of srm are done, drop its record.
+*/
+void journal_end(struct srm_target *srm)
+{
+  struct srm_journal **p;
+
+  if (!srm->journal)
+    return;
+  JOURNAL_LOCK();
+  for (p = &records; *p; p = &(*p)->next)
+    if (*p == srm->journal)
+      {
+	*p = srm->journal->next;
+	free(srm->journal);
+	break;
+      }
+  srm->journal = NULL;
+  if (journal_write() < 0)
+    errorp("could not write journal %s", journal_file);
+  JOURNAL_UNLOCK();
+}
+
+#else
+
+int journal_open(const char *file, const int resume)
+{
+  (void)file;
+  (void)resume;
+  errno = ENOSYS;
+  return -1;
+}
+
+void journal_begin(struct srm_target *srm, unsigned *pass, my_off_t *offset)
+{
+  srm->journal = NULL;
+  *pass = 0;
+  *offset = 0;
+}
+
+void journal_checkpoint(struct srm_target *srm, const unsigned pass, const my_off_t offset)
+{
+  (void)srm;
+  (void)pass;
+  (void)offset;
+}
+
+void journal_end(struct srm_target *srm)
+{
+  (void)srm;
+}
+
+void journal_done(const struct srm_target *srm)
+{
+  (void)srm;
+}
+
+void journal_commit(void)
+{
+}
+
+int journal_completed(const char *path)
+{
+  (void)path;
+  return 0;
+}
+
+void journal_close(const int failed, const int options)
+{
+  (void)failed;
+  (void)options;
+}
+
+#endif
@@ -23,6 +23,50 @@ char *program_name;
 /* variables used by getopt() */
 static int show_help = 0;
 static int show_version = 0;
+static const char *files_from = NULL;
+static const char *journal = NULL;
+static int resume = 0;
+static struct srm_range *ranges = NULL;
+static unsigned num_ranges = 0;
+static int image = 0;
+static const char *limit_file = NULL;
+static const char *ionice = NULL;
+static double pressure = 0;
+
+/* long options without a short option */
+enum {
+  OPT_BATCH = 256,
+  OPT_PIPELINE,
+  OPT_PIPELINE_QUEUE,
+  OPT_WALK_THREADS,
+  OPT_WALK_MEMORY,
+  OPT_FILES_FROM,
+  OPT_INCLUDE,
+  OPT_EXCLUDE,
+  OPT_MIN_SIZE,
+  OPT_MAX_SIZE,
+  OPT_OLDER_THAN,
+  OPT_NEWER_THAN,
+  OPT_PLAN,
+  OPT_POLICY,
+  OPT_JOURNAL,
+  OPT_RESUME,
+  OPT_ERASE,
+  OPT_PUNCH_HOLE,
+  OPT_COLLAPSE,
+  OPT_QUEUE_DEPTH,
+  OPT_IMAGE,
+  OPT_ZERO_OFFLOAD,
+  OPT_DISCARD,
+  OPT_ORDER,
+  OPT_COW,
+  OPT_FS_STRATEGY,
+  OPT_RATE_LIMIT,
+  OPT_DEVICE_RATE_LIMIT,
+  OPT_LIMIT_FILE,
+  OPT_IONICE,
+  OPT_PRESSURE
+};
 
 static struct option longopts[] = {
   { "directory", no_argument, NULL, 'd' },
@@ -36,12 +80,104 @@ static struct option longopts[] = {
   { "doe", no_argument, NULL, 'E'},
   { "gutmann", no_argument, NULL, 'G'},
   { "rcmp", no_argument, NULL, 'C'},
+  { "batch", optional_argument, NULL, OPT_BATCH },
+  { "pipeline", optional_argument, NULL, OPT_PIPELINE },
+  { "pipeline-queue", required_argument, NULL, OPT_PIPELINE_QUEUE },
+  { "walk-threads", required_argument, NULL, OPT_WALK_THREADS },
+  { "walk-memory", required_argument, NULL, OPT_WALK_MEMORY },
+  { "files-from", required_argument, NULL, OPT_FILES_FROM },
+  { "null", no_argument, NULL, '0' },
+  { "include", required_argument, NULL, OPT_INCLUDE },
+  { "exclude", required_argument, NULL, OPT_EXCLUDE },
+  { "min-size", required_argument, NULL, OPT_MIN_SIZE },
+  { "max-size", required_argument, NULL, OPT_MAX_SIZE },
+  { "older-than", required_argument, NULL, OPT_OLDER_THAN },
+  { "newer-than", required_argument, NULL, OPT_NEWER_THAN },
+  { "plan", optional_argument, NULL, OPT_PLAN },
+  { "policy", required_argument, NULL, OPT_POLICY },
+  { "journal", required_argument, NULL, OPT_JOURNAL },
+  { "resume", no_argument, NULL, OPT_RESUME },
+  { "erase", required_argument, NULL, OPT_ERASE },
+  { "punch-hole", no_argument, NULL, OPT_PUNCH_HOLE },
+  { "collapse", no_argument, NULL, OPT_COLLAPSE },
+  { "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+  { "image", no_argument, NULL, OPT_IMAGE },
+  { "zero-offload", no_argument, NULL, OPT_ZERO_OFFLOAD },
+  { "discard", optional_argument, NULL, OPT_DISCARD },
+  { "order", optional_argument, NULL, OPT_ORDER },
+  { "cow", required_argument, NULL, OPT_COW },
+  { "fs-strategy", required_argument, NULL, OPT_FS_STRATEGY },
+  { "rate-limit", required_argument, NULL, OPT_RATE_LIMIT },
+  { "device-rate-limit", required_argument, NULL, OPT_DEVICE_RATE_LIMIT },
+  { "limit-file", required_argument, NULL, OPT_LIMIT_FILE },
+  { "ionice", required_argument, NULL, OPT_IONICE },
+  { "pressure", required_argument, NULL, OPT_PRESSURE },
   { "verbose", no_argument, NULL, 'v' },
   { "help", no_argument, &show_help, 'h' },
   { "version", no_argument, &show_version, 'V' },
   { NULL, no_argument, NULL, 0 }
 };
 
+/**
+   parse the argument of --pipeline, either the number of overwrite
+   threads or the thread counts of the open, overwrite and unlink stages.
+   @return 0 upon success, negative if arg is invalid.
+*/
+static int parse_pipeline(const char *arg)
+{
+  unsigned o, w, u;
+  char c;
+
+  if (!arg) {
+    pipeline_threads[PIPELINE_OPEN] = pipeline_threads[PIPELINE_OVERWRITE] = pipeline_threads[PIPELINE_UNLINK] = 1;
+    return 0;
+  }
+  if (sscanf(arg, "%u,%u,%u%c", &o, &w, &u, &c) == 3) {
+    if (o < 1 || w < 1 || u < 1)
+      return -1;
+    pipeline_threads[PIPELINE_OPEN] = o;
+    pipeline_threads[PIPELINE_OVERWRITE] = w;
+    pipeline_threads[PIPELINE_UNLINK] = u;
+    return 0;
+  }
+  if (sscanf(arg, "%u%c", &w, &c) == 1 && w >= 1) {
+    pipeline_threads[PIPELINE_OPEN] = pipeline_threads[PIPELINE_UNLINK] = 1;
+    pipeline_threads[PIPELINE_OVERWRITE] = w;
+    return 0;
+  }
+  return -1;
+}
+
+/**
+   parse the OFFSET[:LENGTH] argument of --erase and append it to ranges.
+   @return 0 upon success, negative if arg is invalid.
+*/
+static int parse_range(const char *arg)
+{
+  char buf[64], *colon;
+  my_off_t offset, length = 0;
+  struct srm_range *r;
+
+  if (strlen(arg) >= sizeof(buf))
+    return -1;
+  strcpy(buf, arg);
+  if ((colon = strchr(buf, ':')) != NULL)
+    {
+      *colon++ = '\0';
+      if (*colon && (parse_size(colon, &length) < 0 || length < 1))
+	return -1;
+    }
+  if (parse_size(buf, &offset) < 0)
+    return -1;
+  if ((r = (struct srm_range*)realloc(ranges, (num_ranges + 1) * sizeof(*r))) == NULL)
+    return -1;
+  ranges = r;
+  ranges[num_ranges].offset = offset;
+  ranges[num_ranges].length = length;
+  num_ranges++;
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   int opt, q;
   char* *trees;
@@ -52,7 +188,7 @@ int main(int argc, char *argv[]) {
   else
     program_name = argv[0];
 
-  while ((opt = getopt_long(argc, argv, "CdDEfGhirRPsvVx", longopts, NULL)) != -1)
+  while ((opt = getopt_long(argc, argv, "0CdDEfGhirRPsvVx", longopts, NULL)) != -1)
     {
       switch (opt)
 	{
@@ -76,6 +212,170 @@ int main(int argc, char *argv[]) {
 	case 'G': options &= ~SRM_MODE_MASK; options |= SRM_MODE_35; break;
 	case 'C': options &= ~SRM_MODE_MASK; options |= SRM_MODE_RCMP; break;
 	case 'V': show_version=1; break;
+	case OPT_BATCH:
+	  batch_files = optarg ? (unsigned)atoi(optarg) : 256;
+	  if (batch_files < 1)
+	    {
+	      error("invalid --batch value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_PIPELINE:
+	  if (parse_pipeline(optarg) < 0)
+	    {
+	      error("invalid --pipeline value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_PIPELINE_QUEUE:
+	  pipeline_queue_depth = (unsigned)atoi(optarg);
+	  if (pipeline_queue_depth < 1)
+	    {
+	      error("invalid --pipeline-queue value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_WALK_THREADS:
+	  walk_threads = (unsigned)atoi(optarg);
+	  if (walk_threads < 1)
+	    {
+	      error("invalid --walk-threads value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_WALK_MEMORY:
+	  if (atoi(optarg) < 1)
+	    {
+	      error("invalid --walk-memory value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  walk_memory_limit = (unsigned long)atoi(optarg) * 1024 * 1024;
+	  break;
+	case OPT_FILES_FROM:
+	  files_from = optarg;
+	  break;
+	case '0': files_from_delim = '\0'; break;
+	case OPT_INCLUDE:
+	case OPT_EXCLUDE:
+	  if ((opt == OPT_INCLUDE ? filter_include(optarg) : filter_exclude(optarg)) < 0)
+	    {
+	      error("invalid pattern %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_MIN_SIZE:
+	case OPT_MAX_SIZE:
+	  if (filter_size(optarg, opt == OPT_MAX_SIZE) < 0)
+	    {
+	      error("invalid size %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_OLDER_THAN:
+	case OPT_NEWER_THAN:
+	  if (filter_age(optarg, opt == OPT_OLDER_THAN) < 0)
+	    {
+	      error("invalid age %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_PLAN:
+	  if (!optarg || !strcmp(optarg, "text"))
+	    plan_format = PLAN_TEXT;
+	  else if (!strcmp(optarg, "json"))
+	    plan_format = PLAN_JSON;
+	  else
+	    {
+	      error("invalid --plan value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_POLICY:
+	  if (policy_load(optarg) < 0)
+	    exit(EXIT_FAILURE);
+	  break;
+	case OPT_JOURNAL: journal = optarg; break;
+	case OPT_RESUME: resume = 1; break;
+	case OPT_ERASE:
+	  if (parse_range(optarg) < 0)
+	    {
+	      error("invalid range %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_PUNCH_HOLE: options |= SRM_OPT_PUNCH; break;
+	case OPT_COLLAPSE: options |= SRM_OPT_COLLAPSE; break;
+	case OPT_QUEUE_DEPTH:
+	  blockdev_queue_depth = (unsigned)atoi(optarg);
+	  if (blockdev_queue_depth < 1)
+	    {
+	      error("invalid --queue-depth value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_IMAGE: image = 1; break;
+	case OPT_ZERO_OFFLOAD: options |= SRM_OPT_ZERO_OFFLOAD; break;
+	case OPT_ORDER:
+	  order_window = optarg ? (unsigned)atoi(optarg) : 1024;
+	  if (order_window < 1)
+	    {
+	      error("invalid --order value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_COW:
+	  if (!strcmp(optarg, "warn"))
+	    cow_policy = COW_WARN;
+	  else if (!strcmp(optarg, "once"))
+	    cow_policy = COW_ONCE;
+	  else if (!strcmp(optarg, "skip"))
+	    cow_policy = COW_SKIP;
+	  else
+	    {
+	      error("invalid --cow value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_FS_STRATEGY:
+	  if (strategy_set(optarg) < 0)
+	    {
+	      error("invalid --fs-strategy value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_RATE_LIMIT:
+	case OPT_DEVICE_RATE_LIMIT:
+	  if (opt == OPT_RATE_LIMIT ? throttle_parse(optarg, &throttle_rate, &throttle_ops) < 0
+	      : throttle_parse(optarg, &throttle_dev_rate, &throttle_dev_ops) < 0)
+	    {
+	      error("invalid --%s value %s", opt == OPT_RATE_LIMIT ? "rate-limit" : "device-rate-limit", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_LIMIT_FILE: limit_file = optarg; break;
+	case OPT_IONICE: ionice = optarg; break;
+	case OPT_PRESSURE:
+	  {
+	    char *end;
+	    pressure = strtod(optarg, &end);
+	    if (end == optarg || (*end && strcmp(end, "%")) || pressure <= 0 || pressure >= 100)
+	      {
+		error("invalid --pressure value %s", optarg);
+		exit(EXIT_FAILURE);
+	      }
+	  }
+	  break;
+	case OPT_DISCARD:
+	  if (!optarg)
+	    options |= SRM_OPT_DISCARD;
+	  else if (!strcmp(optarg, "secure"))
+	    options |= SRM_OPT_DISCARD|SRM_OPT_SECURE_DISCARD;
+	  else
+	    {
+	      error("invalid --discard value %s", optarg);
+	      exit(EXIT_FAILURE);
+	    }
+	  break;
 	case 'v':
 	  if((options & SRM_OPT_V) < SRM_OPT_V)
 	    ++options;
@@ -104,6 +404,62 @@ int main(int argc, char *argv[]) {
 	   "  -G, --gutmann         overwrite with 35-pass Gutmann method\n"
 	   "  -C, --rcmp            overwrite with Royal Canadian Mounted Police passes\n"
 	   "  -r, -R, --recursive   remove the contents of directories\n"
+	   "      --batch[=N]       overwrite up to N (256) small files together with one\n"
+	   "                        sync per pass\n"
+	   "      --pipeline[=[O,]W[,U]]\n"
+	   "                        open, overwrite and unlink files in parallel stages\n"
+	   "                        with O, W and U (1) threads\n"
+	   "      --pipeline-queue=N\n"
+	   "                        let up to N (64) files wait in front of each stage\n"
+	   "      --walk-threads=N  scan N directories at once when recursing\n"
+	   "      --walk-memory=M   scan fewer directories at once while the directory\n"
+	   "                        records use more than M MiB\n"
+	   "      --files-from=FILE also remove the paths listed in FILE, one per line,\n"
+	   "                        - reads stdin\n"
+	   "  -0, --null            paths in the --files-from list end with a NUL byte\n"
+	   "      --include=GLOB    only remove files whose name matches GLOB\n"
+	   "      --exclude=GLOB    do not remove files or enter directories whose name\n"
+	   "                        matches GLOB\n"
+	   "      --min-size=N      only remove files of at least N bytes (k, M, G)\n"
+	   "      --max-size=N      only remove files of at most N bytes (k, M, G)\n"
+	   "      --older-than=T    only remove files modified more than T days ago\n"
+	   "                        (or T with an s, m, h or d suffix)\n"
+	   "      --newer-than=T    only remove files modified less than T days ago\n"
+	   "      --plan[=FORMAT]   do not remove anything, print the files, bytes and\n"
+	   "                        estimated time per device as text or json\n"
+	   "      --policy=FILE     select the overwrite mode of each file with the rules\n"
+	   "                        in FILE\n"
+	   "      --journal=FILE    record the progress of large overwrites in FILE\n"
+	   "      --resume          continue overwrites from the checkpoints in the\n"
+	   "                        --journal file\n"
+	   "      --erase=OFFSET[:LENGTH]\n"
+	   "                        overwrite LENGTH bytes (up to the end) from OFFSET\n"
+	   "                        and keep the files, may be given several times\n"
+	   "      --punch-hole      release the space of the --erase ranges\n"
+	   "      --collapse        remove the --erase ranges from the files\n"
+	   "      --queue-depth=N   keep N writes in flight per block device, by default\n"
+	   "                        the depth adapts to the device\n"
+	   "      --image           overwrite the files like block devices and keep them\n"
+	   "      --zero-offload    let block devices write the 0x00 passes themselves\n"
+	   "      --order[=N]       remove up to N (1024) files at a time in the order of\n"
+	   "                        their blocks on rotational disks\n"
+	   "      --cow=POLICY      overwrite files which would only be copied on write\n"
+	   "                        anyway (warn), with one pass (once) or not (skip)\n"
+	   "      --fs-strategy=TYPE:KEY=VALUE[,KEY=VALUE...]\n"
+	   "                        change how files on file systems of TYPE are\n"
+	   "                        overwritten: io, sync, direct, discard, passes\n"
+	   "      --rate-limit=BYTES[,OPS]\n"
+	   "                        write at most BYTES and OPS writes per second\n"
+	   "      --device-rate-limit=BYTES[,OPS]\n"
+	   "                        the same limit for every device\n"
+	   "      --limit-file=FILE read the limits from FILE, again on SIGHUP\n"
+	   "      --ionice=CLASS    I/O priority, idle or best-effort[:0-7]\n"
+	   "      --pressure=PERCENT\n"
+	   "                        slow down while tasks wait for I/O more than\n"
+	   "                        PERCENT of the time\n"
+	   "      --discard[=secure]\n"
+	   "                        discard block devices and punch holes into files\n"
+	   "                        after the overwrite\n"
 	   "  -v, --verbose         explain what is being done\n"
 	   "  -h, --help            display this help and exit\n"
 	   "  -V, --version         display version information and exit\n",
@@ -116,7 +472,75 @@ int main(int argc, char *argv[]) {
     exit(EXIT_SUCCESS);
   }
 
-  if (optind == argc) {
+  if (batch_files > 0 && (pipeline_threads[PIPELINE_OVERWRITE] > 0 || walk_threads > 0)) {
+    fprintf(stderr, "%s: --batch can not be combined with --pipeline or --walk-threads\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((options & (SRM_OPT_PUNCH|SRM_OPT_COLLAPSE)) && !ranges) {
+    fprintf(stderr, "%s: --punch-hole and --collapse need --erase\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((options & SRM_OPT_PUNCH) && (options & SRM_OPT_COLLAPSE)) {
+    fprintf(stderr, "%s: --punch-hole can not be combined with --collapse\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if (ranges && ((options & SRM_OPT_R) || files_from || plan_format != PLAN_OFF || journal)) {
+    fprintf(stderr, "%s: --erase only works on the files given on the command line\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if (image && ((options & SRM_OPT_R) || files_from || plan_format != PLAN_OFF || ranges)) {
+    fprintf(stderr, "%s: --image only works on the files given on the command line\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if (order_window > 0 && (batch_files > 0 || pipeline_threads[PIPELINE_OVERWRITE] > 0 || walk_threads > 0)) {
+    fprintf(stderr, "%s: --order can not be combined with --batch, --pipeline or --walk-threads\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((options & SRM_OPT_I) && files_from && !strcmp(files_from, "-")) {
+    fprintf(stderr, "%s: -i reads its answers from stdin and can not be combined with --files-from=-\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  /* before --pressure, the walker and the writers start their threads */
+  sunlink_signals();
+
+  if (limit_file && throttle_file(limit_file) < 0) {
+    fprintf(stderr, "%s: could not read limit file %s: %s\n", program_name, limit_file, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (ionice && throttle_ionice(ionice) < 0) {
+    fprintf(stderr, "%s: could not set I/O priority %s: %s\n", program_name, ionice, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (pressure > 0 && throttle_pressure(pressure / 100, options) < 0) {
+    fprintf(stderr, "%s: --pressure needs the I/O pressure stall information of Linux 4.20 or later\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if (resume && !journal) {
+    fprintf(stderr, "%s: --resume needs --journal\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if (journal && journal_open(journal, resume) < 0) {
+    fprintf(stderr, "%s: could not open journal %s: %s\n", program_name, journal, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (files_from && files_from_open(files_from) < 0) {
+    fprintf(stderr, "%s: could not open %s: %s\n", program_name, files_from, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (optind == argc && !files_from) {
     fprintf(stderr, "%s: too few arguments\n", program_name);
     fprintf(stderr, "Try `%s --help' for more information.\n", program_name);
     exit(EXIT_FAILURE);
@@ -134,5 +558,58 @@ int main(int argc, char *argv[]) {
     trees[q] = argv[optind];
   trees[q] = NULL;
 
-  return tree_walker(trees, options);
+  if (ranges) {
+    /* the files stay, only their ranges are overwritten */
+    int ret = 0;
+    for (q = 0; trees[q]; q++)
+      if (serase(trees[q], ranges, num_ranges, options) < 0) {
+	errorp("could not erase ranges of %s", trees[q]);
+	ret = 1;
+      }
+    return ret;
+  }
+
+#if defined(__unix__) || defined(__APPLE__)
+  if (image || (!(options & SRM_OPT_I) && plan_format == PLAN_OFF)) {
+    /* block devices, and with --image all files, are wiped side by side */
+    char **devices = (char**) alloca((q + 1) * sizeof(char*));
+    unsigned num_devices = 0, n = 0;
+    int ret = 0;
+    for (q = 0; trees[q]; q++) {
+      struct stat statbuf;
+      if (lstat(trees[q], &statbuf) == 0 && (S_ISBLK(statbuf.st_mode) || (image && S_ISREG(statbuf.st_mode)))) {
+	/* the filters select devices as they select the files of the walker */
+	const char *name = strrchr(trees[q], SRM_DIRSEP);
+	if (filter_name(name ? name + 1 : trees[q], 0) && filter_stat(&statbuf))
+	  devices[num_devices++] = trees[q];
+      }
+      else if (image) {
+	error("%s is not a regular file or block device", trees[q]);
+	ret = 1;
+      }
+      else
+	trees[n++] = trees[q];
+    }
+    trees[n] = NULL;
+    if (num_devices > 0 && blockdev_wipe_all(devices, num_devices, options) > 0)
+      ret = 1;
+    if (image || (num_devices > 0 && n == 0 && !files_from)) {
+      throttle_report(options);
+      blockdev_report(options);
+      if (options & SRM_OPT_V)
+	policy_report(PLAN_OFF);
+      journal_close(ret, options);
+      plan_save(options);
+      return ret;
+    }
+    if (parallel_walker(trees, options) > 0)
+      ret = 1;
+    return ret;
+  }
+#else
+  if (image)
+    return blockdev_wipe_all(trees, q, options);
+#endif
+
+  return parallel_walker(trees, options);
 }
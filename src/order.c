@@ -0,0 +1,386 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(HAVE_LINUX_FIEMAP_H)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+#ifndef _O_BINARY
+#define _O_BINARY 0
+#endif
+
+/* On a rotational disk every file that is removed in directory order
+   may cost a seek across the platter. With --order order_add()
+   collects a window of up to order_window files, looks up where the
+   first extent of each starts with FIEMAP, and order_flush() removes
+   them in ascending physical order. Files on a device that is not
+   rotational, or without FIEMAP, are not queued and are removed right
+   away.
+
+   The extents of a large file are written in physical order as well:
+   fiemap_extents() returns them sorted by their physical offset and
+   overwrite_passes() writes one extent after the other, see
+   SRM_OPT_EXTENT_ORDER. */
+
+/** number of files in the window, 0 disables ordering. */
+unsigned order_window = 0;
+
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(FS_IOC_FIEMAP)
+
+struct order_entry
+{
+  unsigned long long physical;
+  /* directory of the file, released once it is removed */
+  struct walk_node *parent;
+  int options;
+  char *path;
+};
+
+static struct order_entry *order = NULL;
+static unsigned order_count = 0;
+static unsigned long order_files = 0, order_windows = 0;
+/* files of the windows flushed by order_add() that could not be removed */
+static int order_failed = 0;
+
+static int order_remove(const int options);
+
+#define FIEMAP_BATCH 64
+
+/**
+   look up the extents of the open file fd with FIEMAP.
+   @param count in: maximum number of extents, out: number of extents
+   @return the mapping, to be freed by the caller, or NULL upon error.
+*/
+static struct fiemap *fiemap_get(const int fd, const unsigned long long start, unsigned *count)
+{
+  struct fiemap *fm;
+
+  if ((fm = (struct fiemap*)calloc(1, sizeof(*fm) + *count * sizeof(struct fiemap_extent))) == NULL)
+    return NULL;
+  fm->fm_start = start;
+  fm->fm_length = FIEMAP_MAX_OFFSET - start;
+  fm->fm_flags = FIEMAP_FLAG_SYNC;
+  fm->fm_extent_count = *count;
+  if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+    {
+      free(fm);
+      return NULL;
+    }
+  *count = fm->fm_mapped_extents;
+  return fm;
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+  const struct srm_extent *x = (const struct srm_extent*)a, *y = (const struct srm_extent*)b;
+  if (x->physical != y->physical)
+    return x->physical < y->physical ? -1 : 1;
+  return x->logical < y->logical ? -1 : x->logical > y->logical;
+}
+
+/**
+   @return the extents of the open file fd of size bytes in ascending
+   physical order, parts of the file that have no extent (holes, data
+   not allocated yet) follow at the end in logical order. NULL if the
+   file has less than two extents or FIEMAP is not supported.
+*/
+struct srm_extent *fiemap_extents(const int fd, const my_off_t size, unsigned *num)
+{
+  struct srm_extent *ext = NULL;
+  unsigned n = 0, alloc = 0, i, count;
+  unsigned long long logical = 0;
+  int last = 0;
+
+  *num = 0;
+  while (!last && logical < (unsigned long long)size)
+    {
+      struct fiemap *fm;
+      count = FIEMAP_BATCH;
+      if ((fm = fiemap_get(fd, logical, &count)) == NULL || count == 0)
+	{
+	  free(fm);
+	  break;
+	}
+      for (i = 0; i < count; i++)
+	{
+	  const struct fiemap_extent *fe = &fm->fm_extents[i];
+	  /* one extent for a gap before it, one for itself */
+	  if (n + 2 > alloc)
+	    {
+	      struct srm_extent *e;
+	      alloc = alloc ? alloc * 2 : 64;
+	      if ((e = (struct srm_extent*)realloc(ext, alloc * sizeof(*e))) == NULL)
+		{
+		  free(fm);
+		  free(ext);
+		  return NULL;
+		}
+	      ext = e;
+	    }
+	  if (fe->fe_logical >= (unsigned long long)size)
+	    {
+	      last = 1;
+	      break;
+	    }
+	  if (fe->fe_logical > logical)
+	    {
+	      ext[n].logical = logical;
+	      ext[n].length = fe->fe_logical - logical;
+	      ext[n].physical = ~0ULL;
+	      n++;
+	    }
+	  ext[n].logical = fe->fe_logical;
+	  ext[n].length = fe->fe_length;
+	  if (fe->fe_logical + fe->fe_length > (unsigned long long)size)
+	    ext[n].length = size - fe->fe_logical;
+	  /* data which is not on disk yet can not be placed */
+	  ext[n].physical = fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DELALLOC) ? ~0ULL : fe->fe_physical;
+	  logical = fe->fe_logical + fe->fe_length;
+	  n++;
+	  if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+	    last = 1;
+	}
+      free(fm);
+    }
+  if (ext && logical < (unsigned long long)size)
+    {
+      if (n + 1 > alloc)
+	{
+	  struct srm_extent *e;
+	  if ((e = (struct srm_extent*)realloc(ext, (n + 1) * sizeof(*e))) == NULL)
+	    {
+	      free(ext);
+	      return NULL;
+	    }
+	  ext = e;
+	}
+      ext[n].logical = logical;
+      ext[n].length = size - logical;
+      ext[n].physical = ~0ULL;
+      n++;
+    }
+  if (n < 2)
+    {
+      free(ext);
+      return NULL;
+    }
+  qsort(ext, n, sizeof(*ext), extent_cmp);
+  *num = n;
+  return ext;
+}
+
+/**
+   count the bytes of the open file fd of size bytes in extents which
+   are shared with other files or snapshots.
+   @return 0 upon success, negative if FIEMAP is not supported.
+*/
+int fiemap_shared(const int fd, const my_off_t size, unsigned long long *shared)
+{
+  unsigned long long logical = 0;
+  int last = 0;
+
+  *shared = 0;
+  while (!last && logical < (unsigned long long)size)
+    {
+      struct fiemap *fm;
+      unsigned i, count = FIEMAP_BATCH;
+      if ((fm = fiemap_get(fd, logical, &count)) == NULL)
+	return logical == 0 ? -1 : 0;
+      if (count == 0)
+	last = 1;
+      for (i = 0; i < count; i++)
+	{
+	  const struct fiemap_extent *fe = &fm->fm_extents[i];
+	  if (fe->fe_flags & FIEMAP_EXTENT_SHARED)
+	    *shared += fe->fe_length;
+	  logical = fe->fe_logical + fe->fe_length;
+	  if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+	    last = 1;
+	}
+      free(fm);
+    }
+  return 0;
+}
+
+static int order_cmp(const void *a, const void *b)
+{
+  const struct order_entry *x = (const struct order_entry*)a, *y = (const struct order_entry*)b;
+  return x->physical < y->physical ? -1 : x->physical > y->physical;
+}
+
+/**
+   queue path for removal in physical order if it is a regular file on
+   a rotational disk.
+
+   @param parent directory of path, held until the file is removed
+   @param options bitfield of SRM_* bits
+   @return 1 if path was queued; 0 if the caller should remove path with sunlink().
+*/
+int order_add(const char *path, struct walk_node *parent, const int options)
+{
+  const struct srm_fs_info *fs;
+  struct fiemap *fm;
+  struct stat statbuf;
+  unsigned count = 1;
+  int fd;
+
+  if (order_window == 0 || !path)
+    return 0;
+  if (lstat(path, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_size == 0)
+    return 0;
+  if ((fd = open(path, O_RDONLY|_O_BINARY)) < 0)
+    return 0;
+  /* a solid-state device does not seek */
+  if ((fs = fs_info_lookup(fd, statbuf.st_dev, 0, options)) == NULL || fs->rotational == 0)
+    {
+      close(fd);
+      return 0;
+    }
+  fm = fiemap_get(fd, 0, &count);
+  close(fd);
+  if (!fm)
+    return 0;
+
+  if (!order && (order = (struct order_entry*)calloc(order_window, sizeof(*order))) == NULL)
+    {
+      free(fm);
+      return 0;
+    }
+  if ((order[order_count].path = strdup(path)) == NULL)
+    {
+      free(fm);
+      return 0;
+    }
+  order[order_count].physical = count > 0 ? fm->fm_extents[0].fe_physical : ~0ULL;
+  order[order_count].parent = parent;
+  order[order_count].options = options | SRM_OPT_EXTENT_ORDER;
+  free(fm);
+  walk_node_hold(parent);
+  if (++order_count == order_window)
+    order_failed += order_remove(options);
+  return 1;
+}
+
+/**
+   remove all queued files in ascending physical order.
+
+   @param options bitfield of SRM_* bits, used for verbose output
+   @return the number of files that could not be removed.
+*/
+static int order_remove(const int options)
+{
+  unsigned i;
+  int failed = 0;
+
+  if (order_count == 0)
+    return 0;
+
+  qsort(order, order_count, sizeof(*order), order_cmp);
+  for (i = 0; i < order_count; i++)
+    {
+      struct order_entry *e = order + i;
+      int f = 0;
+      if (sunlink(e->path, e->options) < 0)
+	{
+	  if (errno == EMLINK)
+	    {
+	      if (options & SRM_OPT_V)
+		error("%s has multiple links, this one has been unlinked but not overwritten", e->path);
+	    }
+	  else
+	    {
+	      errorp("unable to remove %s", e->path);
+	      ++failed;
+	      f = 1;
+	    }
+	}
+      free(e->path);
+      walk_node_release(e->parent, f);
+    }
+
+  order_files += order_count;
+  order_windows++;
+  order_count = 0;
+  return failed;
+}
+
+/**
+   remove the files of the last window.
+
+   @param options bitfield of SRM_* bits, used for verbose output
+   @return the number of files that could not be removed, with those of
+   the windows that were full before.
+*/
+int order_flush(const int options)
+{
+  int failed = order_failed + order_remove(options);
+
+  order_failed = 0;
+  return failed;
+}
+
+/**
+   print how many files were ordered, for -v.
+*/
+void order_report(const int options)
+{
+  if ((options & SRM_OPT_V) && order_files > 0)
+    error("order: %lu files removed in physical order in %lu windows", order_files, order_windows);
+}
+
+#else
+
+int fiemap_shared(const int fd, const my_off_t size, unsigned long long *shared)
+{
+  (void)fd;
+  (void)size;
+  *shared = 0;
+  errno = ENOSYS;
+  return -1;
+}
+
+struct srm_extent *fiemap_extents(const int fd, const my_off_t size, unsigned *num)
+{
+  (void)fd;
+  (void)size;
+  *num = 0;
+  return NULL;
+}
+
+int order_add(const char *path, struct walk_node *parent, const int options)
+{
+  (void)path;
+  (void)parent;
+  (void)options;
+  return 0;
+}
+
+int order_flush(const int options)
+{
+  (void)options;
+  return 0;
+}
+
+void order_report(const int options)
+{
+  if (order_window > 0 && (options & SRM_OPT_V))
+    error("--order is not supported on this platform");
+}
+
+#endif
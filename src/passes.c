@@ -0,0 +1,100 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "srm.h"
+#include "impl.h"
+
+#define RANDOM { 0, { 0 } }
+#define BYTE(a) { 1, { a } }
+#define BYTES(a, b, c) { 3, { a, b, c } }
+
+static const struct srm_pass passes_simple[] = {
+  BYTE(0x00)
+};
+
+static const struct srm_pass passes_openbsd[] = {
+  BYTE(0xFF), BYTE(0x00), BYTE(0xFF)
+};
+
+static const struct srm_pass passes_dod[] = {
+  BYTE(0xF6), BYTE(0x00), BYTE(0xFF), RANDOM, BYTE(0x00), BYTE(0xFF), RANDOM
+};
+
+static const struct srm_pass passes_doe[] = {
+  RANDOM, RANDOM, BYTES('D', 'o', 'E')
+};
+
+static const struct srm_pass passes_rcmp[] = {
+  BYTE(0x00), BYTE(0xFF), { 4, { 'R', 'C', 'M', 'P' } }
+};
+
+static const struct srm_pass passes_35[] = {
+  RANDOM, RANDOM, RANDOM, RANDOM,
+  BYTE(0x55), BYTE(0xAA),
+  BYTES(0x92, 0x49, 0x24), BYTES(0x49, 0x24, 0x92), BYTES(0x24, 0x92, 0x49),
+  BYTE(0x00), BYTE(0x11), BYTE(0x22), BYTE(0x33), BYTE(0x44), BYTE(0x55), BYTE(0x66), BYTE(0x77),
+  BYTE(0x88), BYTE(0x99), BYTE(0xAA), BYTE(0xBB), BYTE(0xCC), BYTE(0xDD), BYTE(0xEE), BYTE(0xFF),
+  BYTES(0x92, 0x49, 0x24), BYTES(0x49, 0x24, 0x92), BYTES(0x24, 0x92, 0x49),
+  BYTES(0x6D, 0xB6, 0xDB), BYTES(0xB6, 0xDB, 0x6D), BYTES(0xDB, 0x6D, 0xB6),
+  RANDOM, RANDOM, RANDOM, RANDOM,
+  /* if you want to backup your partition or shrink your vmware image having the file zero-ed gives best compression results. */
+  BYTE(0x00)
+};
+
+#define SCHEME(mode, name, passes) { mode, name, passes, sizeof(passes)/sizeof(passes[0]) }
+
+static const struct srm_scheme schemes[] = {
+  SCHEME(SRM_MODE_DOD, "US DoD mode", passes_dod),
+  SCHEME(SRM_MODE_DOE, "US DoE mode", passes_doe),
+  SCHEME(SRM_MODE_OPENBSD, "OpenBSD mode", passes_openbsd),
+  SCHEME(SRM_MODE_SIMPLE, "Simple mode", passes_simple),
+  SCHEME(SRM_MODE_RCMP, "RCMP mode", passes_rcmp),
+  SCHEME(SRM_MODE_35, "Full 35-pass mode (Gutmann method)", passes_35)
+};
+
+/**
+   @param options a combination of SRM_* flags
+   @return the pass scheme selected by the SRM_MODE_* bits of options.
+*/
+const struct srm_scheme *scheme_lookup(const int options)
+{
+  unsigned i;
+  for (i = 0; i < sizeof(schemes)/sizeof(schemes[0]); i++)
+    {
+      if (options & schemes[i].mode)
+	return &schemes[i];
+    }
+  error("something is strange, did not have mode_35 bit");
+  return &schemes[sizeof(schemes)/sizeof(schemes[0]) - 1];
+}
+
+/**
+   fill buffer with the pattern of pass, or with random data for a random pass.
+*/
+void pass_fill(unsigned char *buffer, const unsigned buffer_size, const struct srm_pass *pass)
+{
+  if (pass->len == 0)
+    randomize_buffer(buffer, buffer_size);
+  else if (pass->len == 1)
+    memset(buffer, pass->pattern[0], buffer_size);
+  else
+    fill(buffer, buffer_size, pass->pattern, pass->len);
+}
+
+/**
+   @return true if pass writes only 0x00 bytes, which the kernel can write without the data, see blockdev.c.
+*/
+int pass_is_zero(const struct srm_pass *pass)
+{
+  unsigned i;
+  if (pass->len == 0)
+    return 0;
+  for (i = 0; i < pass->len; i++)
+    if (pass->pattern[i] != 0)
+      return 0;
+  return 1;
+}
@@ -0,0 +1,554 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+#ifndef O_SYNC
+#define O_SYNC 0
+#endif
+#ifndef _O_BINARY
+#define _O_BINARY 0
+#endif
+
+/* The pipeline splits the removal of a file into stages which run in
+   their own threads and are connected by bounded queues:
+
+   walker -> open -> overwrite -> unlink
+
+   The walker does the prompting and submits every path. The open
+   stage stats, opens and locks files, so this work overlaps with the
+   writes of the files ahead of it. The overwrite stage runs the
+   passes. The unlink stage truncates, renames and unlinks in the
+   background. Once a file is gone its directory is released, see
+   walk_node_release().
+
+   Several overwrite threads writing to one rotational disk make it
+   seek between the files, so only one of them writes to such a disk
+   at a time while the others take files on other devices or wait,
+   see disk_claim(). Solid-state devices get all threads at once. */
+
+/** number of threads per stage, all 0 disables the pipeline. */
+unsigned pipeline_threads[PIPELINE_STAGES] = { 0, 0, 0 };
+/** maximum number of entries waiting in front of a stage. */
+unsigned pipeline_queue_depth = 64;
+
+#ifdef HAVE_PTHREAD_H
+
+/* what the later stages have to do with an item */
+enum {
+  ITEM_OVERWRITE,	/* regular file, opened by the open stage */
+  ITEM_SUNLINK,		/* block device, handled by sunlink() in the overwrite stage */
+  ITEM_UNLINK,		/* nothing to overwrite, only rename and unlink */
+  ITEM_MLINK,		/* file with multiple hard links, only rename and unlink */
+  ITEM_DONE,		/* removed by the overwrite stage */
+  ITEM_FAILED		/* error stored in err */
+};
+
+struct pipeline_item
+{
+  struct pipeline_item *next;
+  /* directory of the file, released when the item is finished */
+  struct walk_node *parent;
+  int kind;
+  int err;
+  int options;
+  struct srm_target srm;
+  char path[1];
+};
+
+struct pipeline_queue
+{
+  const char *name;
+  struct pipeline_item *head, *tail;
+  unsigned depth, peak, threads;
+  int closed;
+  pthread_cond_t not_empty, not_full;
+  /* statistics for verbose mode */
+  unsigned long items;
+  double depth_sum, stall, idle;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pipeline_queue queues[PIPELINE_STAGES];
+static pthread_t *threads = NULL;
+static unsigned num_threads = 0;
+static int failures = 0;
+static int active = 0;
+/* the rotational disk each overwrite thread writes to, see disk_claim() */
+static unsigned long long *disks = NULL;
+static pthread_cond_t disk_free = PTHREAD_COND_INITIALIZER;
+static unsigned long disk_waits = 0;
+
+static double now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+   append item to queue q, waiting while the queue is full. Must be called with lock held.
+*/
+static void queue_push(struct pipeline_queue *q, struct pipeline_item *item)
+{
+  if (q->depth >= pipeline_queue_depth)
+    {
+      double start = now();
+      while (q->depth >= pipeline_queue_depth)
+	pthread_cond_wait(&q->not_full, &lock);
+      q->stall += now() - start;
+    }
+
+  item->next = NULL;
+  if (q->tail)
+    q->tail->next = item;
+  else
+    q->head = item;
+  q->tail = item;
+
+  ++q->items;
+  ++q->depth;
+  q->depth_sum += q->depth;
+  if (q->depth > q->peak)
+    q->peak = q->depth;
+  pthread_cond_signal(&q->not_empty);
+}
+
+/**
+   take the first item of queue q, waiting while the queue is empty. Must be called with lock held.
+   @return the item or NULL if the queue was closed and is empty.
+*/
+static struct pipeline_item *queue_pop(struct pipeline_queue *q)
+{
+  struct pipeline_item *item;
+
+  if (!q->head && !q->closed)
+    {
+      double start = now();
+      while (!q->head && !q->closed)
+	pthread_cond_wait(&q->not_empty, &lock);
+      q->idle += now() - start;
+    }
+
+  if ((item = q->head) == NULL)
+    return NULL;
+  if ((q->head = item->next) == NULL)
+    q->tail = NULL;
+  --q->depth;
+  pthread_cond_signal(&q->not_full);
+  return item;
+}
+
+static void push(const int stage, struct pipeline_item *item)
+{
+  pthread_mutex_lock(&lock);
+  queue_push(&queues[stage], item);
+  pthread_mutex_unlock(&lock);
+}
+
+static void report_failure(struct pipeline_item *item)
+{
+  errno = item->err;
+  errorp("unable to remove %s", item->path);
+}
+
+/**
+   free item and release its directory.
+*/
+static void complete(struct pipeline_item *item)
+{
+  const int failed = item->kind == ITEM_FAILED;
+  struct walk_node *parent = item->parent;
+
+  if (failed)
+    {
+      pthread_mutex_lock(&lock);
+      ++failures;
+      pthread_mutex_unlock(&lock);
+    }
+  free(item);
+  walk_node_release(parent, failed);
+}
+
+static void open_stage(struct pipeline_item *item)
+{
+  struct stat statbuf;
+  struct srm_target *srm = &item->srm;
+
+  if (lstat(item->path, &statbuf) < 0)
+    {
+      item->kind = ITEM_FAILED;
+      item->err = errno;
+      push(PIPELINE_UNLINK, item);
+      return;
+    }
+
+#if defined(__linux__)
+  if (S_ISBLK(statbuf.st_mode))
+    {
+      item->kind = ITEM_SUNLINK;
+      push(PIPELINE_OVERWRITE, item);
+      return;
+    }
+#endif
+
+  if (!S_ISREG(statbuf.st_mode) || statbuf.st_size == 0)
+    {
+      item->kind = ITEM_UNLINK;
+      push(PIPELINE_UNLINK, item);
+      return;
+    }
+
+  if (statbuf.st_nlink > 1)
+    {
+      item->kind = ITEM_MLINK;
+      push(PIPELINE_UNLINK, item);
+      return;
+    }
+
+  srm->file_name = item->path;
+  srm->file_size = statbuf.st_size;
+  srm->buffer_size = statbuf.st_blksize;
+  if (srm->buffer_size < 16)
+    srm->buffer_size = 512;
+  srm->options = item->options;
+  if (sunlink_open(srm, &statbuf, O_WRONLY|O_SYNC|_O_BINARY) < 0)
+    {
+      item->kind = ITEM_FAILED;
+      item->err = errno;
+      push(PIPELINE_UNLINK, item);
+      return;
+    }
+
+  item->kind = ITEM_OVERWRITE;
+  push(PIPELINE_OVERWRITE, item);
+}
+
+/**
+   wait until no other overwrite thread writes to the rotational disk of
+   fs and claim it. File systems on partitions of one disk, or on
+   devices stacked on it, share the claim of the whole disk.
+   @return the slot to pass to disk_release(), or -1 if fs is not a rotational disk.
+*/
+static int disk_claim(const struct srm_fs_info *fs)
+{
+  const unsigned num = queues[PIPELINE_OVERWRITE].threads;
+  unsigned long long disk;
+  unsigned i;
+  int waited = 0;
+
+  if (!disks || !fs || fs->rotational != 1)
+    return -1;
+  disk = fs->disk ? fs->disk : fs->dev;
+
+  pthread_mutex_lock(&lock);
+  for (;;)
+    {
+      for (i = 0; i < num && disks[i] != disk; i++)
+	;
+      if (i == num)
+	break;
+      waited = 1;
+      pthread_cond_wait(&disk_free, &lock);
+    }
+  disk_waits += waited;
+  /* every thread holds at most one slot, so there is a free one */
+  for (i = 0; disks[i]; i++)
+    ;
+  disks[i] = disk;
+  pthread_mutex_unlock(&lock);
+  return (int)i;
+}
+
+static void disk_release(const int slot)
+{
+  if (slot < 0)
+    return;
+  pthread_mutex_lock(&lock);
+  disks[slot] = 0;
+  pthread_cond_broadcast(&disk_free);
+  pthread_mutex_unlock(&lock);
+}
+
+static void overwrite_stage(struct pipeline_item *item)
+{
+  int slot;
+
+  if (item->kind == ITEM_SUNLINK)
+    {
+      if (sunlink(item->path, item->options) < 0)
+	{
+	  item->kind = ITEM_FAILED;
+	  item->err = errno;
+	}
+      else
+	item->kind = ITEM_DONE;
+    }
+  else
+    {
+      slot = disk_claim(item->srm.fs);
+      if (overwrite_selector(&item->srm) < 0)
+	{
+	  item->kind = ITEM_FAILED;
+	  item->err = errno;
+	  if (item->options & SRM_OPT_V)
+	    errorp("could not overwrite file %s", item->path);
+	  close(item->srm.fd);
+	}
+      disk_release(slot);
+    }
+  push(PIPELINE_UNLINK, item);
+}
+
+static void unlink_stage(struct pipeline_item *item)
+{
+  switch (item->kind)
+    {
+    case ITEM_OVERWRITE:
+      if (sunlink_finish(&item->srm, O_WRONLY|O_SYNC|_O_BINARY) < 0)
+	{
+	  item->kind = ITEM_FAILED;
+	  item->err = errno;
+	}
+      break;
+
+    case ITEM_UNLINK:
+    case ITEM_MLINK:
+      if (rename_unlink(item->path) < 0)
+	{
+	  item->kind = ITEM_FAILED;
+	  item->err = errno;
+	}
+      else if (item->kind == ITEM_MLINK && (item->options & SRM_OPT_V))
+	error("%s has multiple links, this one has been unlinked but not overwritten", item->path);
+      break;
+    }
+
+  if (item->kind == ITEM_FAILED)
+    report_failure(item);
+  complete(item);
+}
+
+static void *stage_thread(void *arg)
+{
+  struct pipeline_queue *q = (struct pipeline_queue*)arg;
+  const int stage = (int)(q - queues);
+
+  for (;;)
+    {
+      struct pipeline_item *item;
+
+      pthread_mutex_lock(&lock);
+      item = queue_pop(q);
+      pthread_mutex_unlock(&lock);
+      if (!item)
+	break;
+
+      switch (stage)
+	{
+	case PIPELINE_OPEN: open_stage(item); break;
+	case PIPELINE_OVERWRITE: overwrite_stage(item); break;
+	default: unlink_stage(item); break;
+	}
+    }
+  return NULL;
+}
+
+/**
+   @return true if pipeline_start() has been called and the pipeline accepts items.
+*/
+int pipeline_active(void)
+{
+  return active;
+}
+
+/**
+   start the stage threads if the pipeline is enabled.
+   @return 0 upon success, negative upon error.
+*/
+int pipeline_start(const int options)
+{
+  static const char *names[PIPELINE_STAGES] = { "open", "overwrite", "unlink" };
+  unsigned s, t, total = 0;
+
+  (void)options;
+  for (s = 0; s < PIPELINE_STAGES; s++)
+    total += pipeline_threads[s];
+  if (total == 0)
+    return 0;
+
+  if ((threads = (pthread_t*)calloc(total, sizeof(pthread_t))) == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  failures = 0;
+  num_threads = 0;
+  disk_waits = 0;
+  if (pipeline_threads[PIPELINE_OVERWRITE] > 1)
+    disks = (unsigned long long*)calloc(pipeline_threads[PIPELINE_OVERWRITE], sizeof(*disks));
+  for (s = 0; s < PIPELINE_STAGES; s++)
+    {
+      struct pipeline_queue *q = &queues[s];
+      memset(q, 0, sizeof(*q));
+      q->name = names[s];
+      q->threads = pipeline_threads[s] ? pipeline_threads[s] : 1;
+      pthread_cond_init(&q->not_empty, NULL);
+      pthread_cond_init(&q->not_full, NULL);
+    }
+  active = 1;
+  for (s = 0; s < PIPELINE_STAGES; s++)
+    {
+      for (t = 0; t < queues[s].threads; t++)
+	{
+	  if (pthread_create(&threads[num_threads], NULL, stage_thread, &queues[s]) != 0)
+	    {
+	      errorp("could not start pipeline thread, continuing without pipeline");
+	      queues[s].threads = t;
+	      for (++s; s < PIPELINE_STAGES; s++)
+		queues[s].threads = 0;
+	      pipeline_finish(0);
+	      return -1;
+	    }
+	  ++num_threads;
+	}
+    }
+  return 0;
+}
+
+/**
+   submit path to the pipeline. Ownership of path stays with the caller.
+
+   @param parent directory of path, held until the file is removed
+   @param options bitfield of SRM_* bits
+   @return 1 if path was submitted; 0 if it could not be queued.
+*/
+int pipeline_submit(const char *path, struct walk_node *parent, const int options)
+{
+  struct pipeline_item *item;
+  const size_t len = strlen(path);
+
+  if ((item = (struct pipeline_item*)calloc(1, sizeof(*item) + len)) == NULL)
+    {
+      errno = ENOMEM;
+      return 0;
+    }
+  memcpy(item->path, path, len + 1);
+  item->options = options;
+  item->kind = ITEM_OVERWRITE;
+  item->srm.fd = -1;
+  item->parent = parent;
+  walk_node_hold(parent);
+
+  pthread_mutex_lock(&lock);
+  queue_push(&queues[PIPELINE_OPEN], item);
+  pthread_mutex_unlock(&lock);
+  return 1;
+}
+
+/**
+   wait until all submitted items are finished and stop the stage threads.
+
+   @param options bitfield of SRM_* bits
+   @return the number of items that could not be removed.
+*/
+int pipeline_finish(const int options)
+{
+  unsigned s, t = 0;
+
+  if (!active)
+    return 0;
+
+  /* close the stages front to back, so every stage drains into the next one */
+  for (s = 0; s < PIPELINE_STAGES; s++)
+    {
+      unsigned n;
+      pthread_mutex_lock(&lock);
+      queues[s].closed = 1;
+      pthread_cond_broadcast(&queues[s].not_empty);
+      pthread_mutex_unlock(&lock);
+      for (n = 0; n < queues[s].threads && t < num_threads; n++)
+	pthread_join(threads[t++], NULL);
+    }
+
+  if (options & SRM_OPT_V)
+    {
+      for (s = 0; s < PIPELINE_STAGES; s++)
+	{
+	  const struct pipeline_queue *q = &queues[s];
+	  error("%s stage: %u threads, %lu items, queue depth avg %.1f peak %u/%u, producers stalled %.2fs, workers idle %.2fs",
+		q->name, q->threads, q->items, q->items ? q->depth_sum / q->items : 0.0,
+		q->peak, pipeline_queue_depth, q->stall, q->idle);
+	}
+      if (disk_waits > 0)
+	error("overwrite stage: %lu files waited for a rotational disk", disk_waits);
+    }
+
+  for (s = 0; s < PIPELINE_STAGES; s++)
+    {
+      pthread_cond_destroy(&queues[s].not_empty);
+      pthread_cond_destroy(&queues[s].not_full);
+    }
+  free(threads);
+  threads = NULL;
+  free(disks);
+  disks = NULL;
+  active = 0;
+  return failures;
+}
+
+#else
+
+int pipeline_active(void)
+{
+  return 0;
+}
+
+int pipeline_start(const int options)
+{
+  unsigned s;
+  (void)options;
+  for (s = 0; s < PIPELINE_STAGES; s++)
+    {
+      if (pipeline_threads[s] > 0)
+	{
+	  error("pipeline not supported on this platform, continuing without it");
+	  break;
+	}
+    }
+  return 0;
+}
+
+int pipeline_submit(const char *path, struct walk_node *parent, const int options)
+{
+  (void)path;
+  (void)parent;
+  (void)options;
+  return 0;
+}
+
+int pipeline_finish(const int options)
+{
+  (void)options;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,572 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#endif
+
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+/* --plan walks the trees like a real run but only counts what would
+   be done, per device: the entries, their logical and allocated
+   bytes, the bytes and write() calls of one pass and the barriers.
+   The time estimate uses a linear model of one pass over one file,
+   seconds = bytes / throughput + latency, where latency covers the
+   open, the barrier and the seeks. Real runs fit the model per device
+   from the passes they write and keep it in a small cache file, so
+   the next plan for that device uses measured numbers. Devices which
+   were never measured get conservative defaults. */
+
+/** output format of --plan, PLAN_OFF for a real run. */
+int plan_format = PLAN_OFF;
+
+/* defaults if no measurement is cached, in bytes/s and seconds */
+#define DEFAULT_HDD_THROUGHPUT (100.0 * 1024 * 1024)
+#define DEFAULT_HDD_LATENCY 0.010
+#define DEFAULT_SSD_THROUGHPUT (400.0 * 1024 * 1024)
+#define DEFAULT_SSD_LATENCY 0.001
+/* only runs that spent this long overwriting update the cache */
+#define MIN_SAMPLE_SECONDS 0.5
+#define MIN_SAMPLES 1
+
+/* approximate system calls besides write() and the barrier: lstat,
+   open, lock, ftruncate, close, rename and unlink per overwritten
+   file plus two seeks per pass; lstat, rename and unlink for an entry
+   that is only unlinked; open, read, close, rename and rmdir per
+   directory. */
+#define SYSCALLS_OVERWRITE 7
+#define SYSCALLS_OVERWRITE_PASS 2
+#define SYSCALLS_UNLINK 3
+#define SYSCALLS_DIR 5
+
+struct plan_dev
+{
+  struct plan_dev *next;
+  unsigned long long dev;
+  const struct srm_fs_info *fs;
+  /* the plan */
+  unsigned long files, dirs, others, linked, empty;
+  unsigned long long logical, allocated, pass_bytes;
+  /* sums over the files of size, write() calls and barriers times
+     the passes of each file, which may differ with --policy and the
+     strategy of the file system */
+  unsigned long long written, writes, passes, batch_passes;
+  /* barriers of the files outside of --batch groups, see strategy.c */
+  unsigned long long syncs;
+  /* the model, see plan_model() */
+  double throughput, latency;
+  int cached, measured;
+  /* passes measured in this run, sums for a least squares fit */
+  unsigned long samples;
+  double sum_x, sum_y, sum_xx, sum_xy;
+};
+
+static struct plan_dev *plan_devs = NULL;
+#ifdef HAVE_PTHREAD_H
+/* the walker and pipeline threads count and measure concurrently */
+static pthread_mutex_t plan_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PLAN_LOCK() pthread_mutex_lock(&plan_lock)
+#define PLAN_UNLOCK() pthread_mutex_unlock(&plan_lock)
+#else
+#define PLAN_LOCK()
+#define PLAN_UNLOCK()
+#endif
+
+/**
+   @return a wall clock time in seconds, for measuring intervals.
+*/
+double plan_clock(void)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* must be called with plan_lock held */
+static struct plan_dev *plan_dev(const unsigned long long dev)
+{
+  struct plan_dev *d;
+
+  for (d = plan_devs; d; d = d->next)
+    if (d->dev == dev)
+      return d;
+  if ((d = (struct plan_dev*)calloc(1, sizeof(*d))) == NULL)
+    return NULL;
+  d->dev = dev;
+  d->next = plan_devs;
+  plan_devs = d;
+  return d;
+}
+
+static void plan_dev_name(const unsigned long long dev, char *buf, const size_t size)
+{
+#if defined(__linux__)
+  snprintf(buf, size, "%u:%u", major(dev), minor(dev));
+#else
+  snprintf(buf, size, "%llu", dev);
+#endif
+}
+
+/**
+   count path for the plan instead of removing it.
+   @param options bitfield of SRM_* bits
+   @return 0 upon success, negative if path could not be examined.
+*/
+int plan_file(const char *path, const int options)
+{
+  my_stat_t statbuf;
+  struct plan_dev *d;
+  unsigned long long dev, size;
+  unsigned buffer_size, sector = 512, passes = scheme_lookup(options)->num_passes;
+  int fd = -1, flags = 0;
+
+  if (!path) return -1;
+
+#if defined(_MSC_VER)
+  if (_stat64(path, &statbuf) < 0)
+#else
+  if (lstat(path, &statbuf) < 0)
+#endif
+    return -1;
+
+  dev = statbuf.st_dev;
+  size = statbuf.st_size;
+#if defined(__linux__)
+  if (S_ISBLK(statbuf.st_mode))
+    {
+      uint64_t u = 0;
+      int secsize = 512;
+      dev = statbuf.st_rdev;
+      flags = FS_INFO_BLOCKDEV;
+      if ((fd = open(path, O_RDONLY)) < 0 || ioctl(fd, BLKGETSIZE64, &u) < 0 || ioctl(fd, BLKSSZGET, &secsize) < 0)
+	{
+	  int e = errno;
+	  if (fd >= 0)
+	    close(fd);
+	  errno = e;
+	  return -1;
+	}
+      size = u;
+      sector = (unsigned)secsize;
+    }
+#endif
+
+  PLAN_LOCK();
+  if ((d = plan_dev(dev)) == NULL)
+    {
+      PLAN_UNLOCK();
+      if (fd >= 0)
+	close(fd);
+      errno = ENOMEM;
+      return -1;
+    }
+
+  /* the device is probed with the first regular file, directory or block device on it */
+  if (!d->fs && (fd >= 0 || S_ISREG(statbuf.st_mode) || S_ISDIR(statbuf.st_mode)))
+    {
+      if (fd < 0)
+	fd = open(path, O_RDONLY);
+      if (fd >= 0)
+	d->fs = fs_info_lookup(fd, dev, flags, options);
+    }
+  if (fd >= 0)
+    close(fd);
+
+  if (S_ISDIR(statbuf.st_mode))
+    d->dirs++;
+  else if (!S_ISREG(statbuf.st_mode) && !flags)
+    d->others++;
+  else if (statbuf.st_nlink > 1 && !flags)
+    d->linked++;
+  else if (size == 0)
+    d->empty++;
+  else
+    {
+      /* the strategy does not apply to --batch groups, see overwrite_group() */
+      const int batched = !flags && batch_files > 0 && size <= (unsigned long long)statbuf.st_blksize && !(options & SRM_OPT_NO_BATCH);
+      const struct srm_strategy *strategy = d->fs && !flags && !batched ? d->fs->strategy : NULL;
+      int sync = strategy ? strategy->sync : SYNC_WRITE;
+
+#ifdef _MSC_VER
+      buffer_size = 4096;
+#else
+      buffer_size = statbuf.st_blksize;
+#endif
+      if (buffer_size < 16)
+	buffer_size = 512;
+      /* as sunlink_open() and blockdev_remove() choose it */
+      if (flags)
+	{
+#if defined(__linux__)
+	  buffer_size = blockdev_io_size(d->fs, dev, sector);
+#endif
+	}
+      else if (d->fs)
+	{
+	  if (strategy && strategy->io_size > 0)
+	    buffer_size = strategy->io_size;
+	  else if (d->fs->io_size > 0)
+	    buffer_size = d->fs->io_size;
+	  if (d->fs->stripe > 0 && buffer_size % d->fs->stripe)
+	    buffer_size = buffer_size < d->fs->stripe ? d->fs->stripe : buffer_size - buffer_size % d->fs->stripe;
+	}
+      /* as overwrite_passes() runs them */
+      if (strategy && strategy->passes > 0 && strategy->passes < passes)
+	passes = strategy->passes;
+
+      d->files++;
+      d->logical += size;
+#if defined(_MSC_VER)
+      d->allocated += size;
+#else
+      d->allocated += flags ? size : (unsigned long long)statbuf.st_blocks * 512;
+#endif
+      d->pass_bytes += size;
+      d->written += size * passes;
+      d->writes += (size + buffer_size - 1) / buffer_size * passes;
+      if (batched)
+	d->batch_passes += passes;
+      else
+	{
+	  d->passes += passes;
+	  d->syncs += sync == SYNC_NONE ? 0 : sync == SYNC_END ? 1 : passes;
+	}
+    }
+  PLAN_UNLOCK();
+  return 0;
+}
+
+/**
+   add the pass of a real run to the throughput model of its device.
+   @param fs device the pass was written to, may be NULL
+   @param bytes number of bytes written
+   @param seconds time of the pass including its barrier
+*/
+void plan_record(const struct srm_fs_info *fs, const unsigned long long bytes, const double seconds)
+{
+  struct plan_dev *d;
+  const double x = (double)bytes;
+
+  if (!fs || plan_format != PLAN_OFF) return;
+
+  PLAN_LOCK();
+  if ((d = plan_dev(fs->dev)) != NULL)
+    {
+      d->samples++;
+      d->sum_x += x;
+      d->sum_y += seconds;
+      d->sum_xx += x * x;
+      d->sum_xy += x * seconds;
+    }
+  PLAN_UNLOCK();
+}
+
+/**
+   fit seconds = bytes / throughput + latency to the passes measured for d.
+   @return 0 upon success, 1 if the samples only give the throughput,
+   negative if there are not enough samples.
+*/
+static int plan_fit(const struct plan_dev *d, double *throughput, double *latency)
+{
+  const double n = (double)d->samples;
+  double var, a, b;
+
+  if (d->samples < MIN_SAMPLES || d->sum_y < MIN_SAMPLE_SECONDS || d->sum_x <= 0)
+    return -1;
+
+  var = n * d->sum_xx - d->sum_x * d->sum_x;
+  a = var > 0 ? (n * d->sum_xy - d->sum_x * d->sum_y) / var : 0;
+  b = (d->sum_y - a * d->sum_x) / n;
+  if (a <= 0 || b < 0)
+    {
+      /* all files had the same size, or the noise won: no latency term */
+      *throughput = d->sum_x / d->sum_y;
+      *latency = 0;
+      return 1;
+    }
+  *throughput = 1.0 / a;
+  *latency = b;
+  return 0;
+}
+
+static const char *plan_cache_file(char *buf, const size_t size)
+{
+  const char *dir = getenv("XDG_CACHE_HOME");
+
+  if (dir && *dir)
+    snprintf(buf, size, "%s%csrm-throughput", dir, SRM_DIRSEP);
+  else if ((dir = getenv("HOME")) != NULL && *dir)
+    snprintf(buf, size, "%s%c.cache%csrm-throughput", dir, SRM_DIRSEP, SRM_DIRSEP);
+  else
+    return NULL;
+  return buf;
+}
+
+/* fill in the cached models, must be called with plan_lock held */
+static void plan_cache_load(void)
+{
+  char name[1024], line[128];
+  unsigned long long dev;
+  double throughput, latency;
+  struct plan_dev *d;
+  FILE *f;
+
+  if (!plan_cache_file(name, sizeof(name)) || (f = fopen(name, "r")) == NULL)
+    return;
+  while (fgets(line, sizeof(line), f))
+    {
+      if (sscanf(line, "%llu %lf %lf", &dev, &throughput, &latency) != 3 || throughput <= 0 || latency < 0)
+	continue;
+      for (d = plan_devs; d; d = d->next)
+	if (d->dev == dev)
+	  {
+	    d->throughput = throughput;
+	    d->latency = latency;
+	    d->cached = 1;
+	  }
+    }
+  fclose(f);
+}
+
+/**
+   store the throughput measured in this run in the cache file, which
+   keeps one line "device bytes/s latency" per device.
+*/
+void plan_save(const int options)
+{
+  char name[1024], tmp[1100], line[128];
+  struct plan_dev *d;
+  double throughput, latency;
+  unsigned long long dev;
+  int fitted = 0, ret;
+  FILE *in, *out;
+
+  if (plan_format != PLAN_OFF) return;
+
+  PLAN_LOCK();
+  plan_cache_load();
+  for (d = plan_devs; d; d = d->next)
+    {
+      if ((ret = plan_fit(d, &throughput, &latency)) < 0)
+	continue;
+      d->throughput = throughput;
+      /* a run without a latency term keeps the cached one */
+      if (ret == 0 || !d->cached)
+	d->latency = latency;
+      d->cached = d->measured = fitted = 1;
+      if ((options & SRM_OPT_V) > 1)
+	{
+	  plan_dev_name(d->dev, line, sizeof(line));
+	  error("device %s: measured %.1f MiB/s, %.1f ms per pass", line, d->throughput / (1024 * 1024), d->latency * 1000);
+	}
+    }
+  if (!fitted || !plan_cache_file(name, sizeof(name)))
+    {
+      PLAN_UNLOCK();
+      return;
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+  /* the cache directory may not exist yet */
+  snprintf(tmp, sizeof(tmp), "%s", name);
+  *strrchr(tmp, SRM_DIRSEP) = '\0';
+  (void)mkdir(tmp, 0700);
+#endif
+  snprintf(tmp, sizeof(tmp), "%s.%i", name, (int)getpid());
+  if ((out = fopen(tmp, "w")) == NULL)
+    {
+      PLAN_UNLOCK();
+      if (options & SRM_OPT_V)
+	errorp("could not write %s", tmp);
+      return;
+    }
+  /* keep the entries of the devices not used in this run */
+  if ((in = fopen(name, "r")) != NULL)
+    {
+      while (fgets(line, sizeof(line), in))
+	{
+	  if (sscanf(line, "%llu %lf %lf", &dev, &throughput, &latency) != 3)
+	    continue;
+	  for (d = plan_devs; d; d = d->next)
+	    if (d->dev == dev && d->measured)
+	      break;
+	  if (!d)
+	    fputs(line, out);
+	}
+      fclose(in);
+    }
+  for (d = plan_devs; d; d = d->next)
+    if (d->measured)
+      fprintf(out, "%llu %.0f %.6f\n", d->dev, d->throughput, d->latency);
+  PLAN_UNLOCK();
+
+  if (fclose(out) != 0 || rename(tmp, name) < 0)
+    {
+      if (options & SRM_OPT_V)
+	errorp("could not write %s", name);
+      unlink(tmp);
+    }
+}
+
+/* the model of d, cached or a default; sets d->throughput and d->latency */
+static void plan_model(struct plan_dev *d)
+{
+  if (d->cached)
+    return;
+  if (d->fs && d->fs->rotational == 0)
+    {
+      d->throughput = DEFAULT_SSD_THROUGHPUT;
+      d->latency = DEFAULT_SSD_LATENCY;
+    }
+  else
+    {
+      d->throughput = DEFAULT_HDD_THROUGHPUT;
+      d->latency = DEFAULT_HDD_LATENCY;
+    }
+}
+
+/* barriers of all passes over the files of d */
+static unsigned long long plan_syncs(const struct plan_dev *d)
+{
+  if (batch_files > 0)
+    return d->syncs + (d->batch_passes + batch_files - 1) / batch_files;
+  return d->syncs;
+}
+
+static double plan_seconds(const struct plan_dev *d)
+{
+  return (double)d->written / d->throughput + plan_syncs(d) * d->latency;
+}
+
+static void print_size(const char *label, const unsigned long long bytes)
+{
+  if (bytes >= 1024ULL * 1024 * 1024)
+    printf("%s %.1f GiB", label, bytes / (1024.0 * 1024 * 1024));
+  else if (bytes >= 1024 * 1024)
+    printf("%s %.1f MiB", label, bytes / (1024.0 * 1024));
+  else if (bytes >= 1024)
+    printf("%s %.1f KiB", label, bytes / 1024.0);
+  else
+    printf("%s %llu bytes", label, bytes);
+}
+
+/**
+   print the plan collected by plan_file() in plan_format.
+   @param options bitfield of SRM_* bits, selects the pass scheme
+*/
+void plan_report(const int options)
+{
+  const struct srm_scheme *scheme = scheme_lookup(options);
+  unsigned long long writes = 0, syncs = 0, other = 0, total = 0, written = 0;
+  double seconds = 0;
+  struct plan_dev *d;
+  char name[64];
+  int mode, first;
+
+  PLAN_LOCK();
+  plan_cache_load();
+  for (d = plan_devs; d; d = d->next)
+    {
+      plan_model(d);
+      total += d->pass_bytes;
+      written += d->written;
+      seconds += plan_seconds(d);
+      writes += d->writes;
+      syncs += plan_syncs(d);
+      other += d->files * SYSCALLS_OVERWRITE + (d->passes + d->batch_passes) * SYSCALLS_OVERWRITE_PASS
+	+ (d->others + d->linked + d->empty) * SYSCALLS_UNLINK + d->dirs * SYSCALLS_DIR;
+    }
+
+  if (plan_format == PLAN_JSON)
+    {
+      printf("{\"scheme\":\"%s\",\"passes\":%u,\"devices\":[", scheme->name, scheme->num_passes);
+      for (d = plan_devs, first = 1; d; d = d->next, first = 0)
+	{
+	  plan_dev_name(d->dev, name, sizeof(name));
+	  printf("%s{\"device\":\"%s\",\"fs_type\":%ld,\"rotational\":%i,"
+		 "\"files\":%lu,\"directories\":%lu,\"other\":%lu,\"hard_linked\":%lu,\"empty\":%lu,"
+		 "\"logical_bytes\":%llu,\"allocated_bytes\":%llu,\"bytes_per_pass\":%llu,\"bytes_written\":%llu,"
+		 "\"throughput\":%.0f,\"latency\":%.6f,\"measured\":%s,\"seconds\":%.3f}",
+		 first ? "" : ",", name, d->fs ? d->fs->fs_type : 0L, d->fs ? d->fs->rotational : -1,
+		 d->files, d->dirs, d->others, d->linked, d->empty,
+		 d->logical, d->allocated, d->pass_bytes, d->written,
+		 d->throughput, d->latency, d->cached ? "true" : "false", plan_seconds(d));
+	}
+      printf("],\"schemes\":[");
+      for (mode = SRM_MODE_SIMPLE, first = 1; mode & SRM_MODE_MASK; mode <<= 1, first = 0)
+	{
+	  const struct srm_scheme *s = scheme_lookup(mode);
+	  printf("%s{\"name\":\"%s\",\"passes\":%u,\"bytes\":%llu}", first ? "" : ",", s->name, s->num_passes, total * s->num_passes);
+	}
+      printf("],\"rules\":[");
+      policy_report(PLAN_JSON);
+      printf("],\"bytes_written\":%llu,\"syscalls\":{\"write\":%llu,\"sync\":%llu,\"other\":%llu},\"seconds\":%.3f}\n",
+	     written, writes, syncs, other, seconds);
+    }
+  else
+    {
+      printf("plan: %s, %u pass%s\n", scheme->name, scheme->num_passes, scheme->num_passes == 1 ? "" : "es");
+      for (d = plan_devs; d; d = d->next)
+	{
+	  plan_dev_name(d->dev, name, sizeof(name));
+	  printf("device %s", name);
+	  if (d->fs)
+	    printf(", fs type 0x%lx, %s", d->fs->fs_type,
+		   d->fs->rotational < 0 ? "rotational unknown" : d->fs->rotational ? "rotational" : "non-rotational");
+	  printf("\n  %lu files, %lu directories, %lu other, %lu hard linked, %lu empty\n",
+		 d->files, d->dirs, d->others, d->linked, d->empty);
+	  print_size(" ", d->logical);
+	  print_size(" logical,", d->allocated);
+	  print_size(" allocated,", d->written);
+	  printf(" written\n  %.1f MiB/s, %.1f ms per file and pass (%s), estimated %.1fs\n",
+		 d->throughput / (1024 * 1024), d->latency * 1000, d->cached ? "measured" : "assumed",
+		 plan_seconds(d));
+	}
+      for (mode = SRM_MODE_SIMPLE; mode & SRM_MODE_MASK; mode <<= 1)
+	{
+	  const struct srm_scheme *s = scheme_lookup(mode);
+	  printf("%c %-36s %2u %-6s", s == scheme && !policy_active() ? '*' : ' ', s->name, s->num_passes, s->num_passes == 1 ? "pass" : "passes");
+	  print_size("", total * s->num_passes);
+	  putchar('\n');
+	}
+      if (policy_active())
+	{
+	  printf("* %-36s %9s", "policy", "");
+	  print_size("", written);
+	  putchar('\n');
+	  policy_report(PLAN_TEXT);
+	}
+      printf("system calls: %llu write, %llu sync, about %llu other\n", writes, syncs, other);
+      printf("estimated time: %.1fs\n", seconds);
+    }
+  fflush(stdout);
+  PLAN_UNLOCK();
+}
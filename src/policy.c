@@ -0,0 +1,328 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+/* A --policy file selects the overwrite mode per file. Each line is
+   a rule of key=value words, the first rule whose conditions all
+   match a file decides, files without a matching rule use the mode of
+   the command line:
+
+     # credentials get the full treatment
+     name=*.key scheme=gutmann
+     path=/var/cache/media* min-size=1G scheme=simple batch=no
+     type=device scheme=dod
+
+   name= matches the last component of the path, path= the whole
+   path; both may be given several times and then match if any of
+   their patterns does. min-size= and max-size= take the same values
+   as --min-size, type= is file, link, device or other. scheme= takes
+   the long option name of a mode, batch=no keeps the file out of
+   --batch groups. Every rule counts the files it selected and their
+   bytes for --plan and the -v statistics. */
+
+enum { TYPE_ANY, TYPE_FILE, TYPE_LINK, TYPE_DEVICE, TYPE_OTHER };
+
+struct policy_rule
+{
+  struct policy_rule *next;
+  /* line in the policy file, 0 for the command line mode */
+  unsigned line;
+  char *text;
+  struct glob *names, *paths;
+  my_off_t min_size, max_size;
+  int type;
+  int mode;
+  int no_batch;
+  /* statistics */
+  unsigned long files;
+  unsigned long long bytes, written;
+};
+
+static struct policy_rule *rules = NULL, *rules_tail = NULL;
+static struct policy_rule default_rule;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static const struct
+{
+  const char *name;
+  int mode;
+} scheme_names[] = {
+  { "simple", SRM_MODE_SIMPLE },
+  { "openbsd", SRM_MODE_OPENBSD },
+  { "dod", SRM_MODE_DOD },
+  { "doe", SRM_MODE_DOE },
+  { "gutmann", SRM_MODE_35 },
+  { "rcmp", SRM_MODE_RCMP }
+};
+
+static int policy_word(struct policy_rule *rule, char *word)
+{
+  char *value = strchr(word, '=');
+  unsigned i;
+
+  if (!value)
+    return -1;
+  *value++ = '\0';
+
+  if (!strcmp(word, "name"))
+    return glob_add(&rule->names, value);
+  if (!strcmp(word, "path"))
+    return glob_add(&rule->paths, value);
+  if (!strcmp(word, "min-size"))
+    return parse_size(value, &rule->min_size);
+  if (!strcmp(word, "max-size"))
+    return parse_size(value, &rule->max_size);
+  if (!strcmp(word, "type"))
+    {
+      if (!strcmp(value, "file"))
+	rule->type = TYPE_FILE;
+      else if (!strcmp(value, "link"))
+	rule->type = TYPE_LINK;
+      else if (!strcmp(value, "device"))
+	rule->type = TYPE_DEVICE;
+      else if (!strcmp(value, "other"))
+	rule->type = TYPE_OTHER;
+      else
+	return -1;
+      return 0;
+    }
+  if (!strcmp(word, "scheme"))
+    {
+      for (i = 0; i < sizeof(scheme_names)/sizeof(scheme_names[0]); i++)
+	if (!strcmp(value, scheme_names[i].name))
+	  {
+	    rule->mode = scheme_names[i].mode;
+	    return 0;
+	  }
+      return -1;
+    }
+  if (!strcmp(word, "batch"))
+    {
+      if (!strcmp(value, "no"))
+	rule->no_batch = 1;
+      else if (strcmp(value, "yes"))
+	return -1;
+      return 0;
+    }
+  return -1;
+}
+
+/**
+   read the rules of a --policy file.
+   @return 0 upon success, negative upon error. Errors in the file are reported with their line.
+*/
+int policy_load(const char *file)
+{
+  char line[4096];
+  unsigned num = 0;
+  FILE *f;
+
+  if (!file)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if ((f = fopen(file, "r")) == NULL)
+    {
+      errorp("could not open %s", file);
+      return -1;
+    }
+
+  while (fgets(line, sizeof(line), f))
+    {
+      struct policy_rule *rule;
+      char *p, *word;
+      size_t len = strlen(line);
+
+      ++num;
+      while (len > 0 && isspace((unsigned char)line[len - 1]))
+	line[--len] = '\0';
+      for (p = line; isspace((unsigned char)*p); p++)
+	;
+      if (*p == '\0' || *p == '#')
+	continue;
+
+      if ((rule = (struct policy_rule*)calloc(1, sizeof(*rule))) == NULL ||
+	  (rule->text = strdup(p)) == NULL || (p = strdup(p)) == NULL)
+	{
+	  errorp("could not allocate memory");
+	  fclose(f);
+	  return -1;
+	}
+      rule->line = num;
+      rule->min_size = rule->max_size = -1;
+
+      /* the patterns point into p, which is never freed */
+      for (word = strtok(p, " \t"); word; word = strtok(NULL, " \t"))
+	if (policy_word(rule, word) < 0)
+	  {
+	    error("%s:%u: invalid rule %s", file, num, word);
+	    fclose(f);
+	    return -1;
+	  }
+      if (rule->mode == 0)
+	{
+	  error("%s:%u: rule without scheme=", file, num);
+	  fclose(f);
+	  return -1;
+	}
+
+      if (rules_tail)
+	rules_tail->next = rule;
+      else
+	rules = rule;
+      rules_tail = rule;
+    }
+
+  if (ferror(f))
+    {
+      errorp("could not read %s", file);
+      fclose(f);
+      return -1;
+    }
+  fclose(f);
+  return 0;
+}
+
+/**
+   @return true if a --policy file was loaded.
+*/
+int policy_active(void)
+{
+  return rules != NULL;
+}
+
+static int rule_matches(const struct policy_rule *rule, const char *path, const my_stat_t *statbuf)
+{
+  if (rule->names)
+    {
+      const char *name = strrchr(path, SRM_DIRSEP);
+      if (!glob_match(rule->names, name ? name + 1 : path))
+	return 0;
+    }
+  if (rule->paths && !glob_match(rule->paths, path))
+    return 0;
+  if (rule->min_size >= 0 || rule->max_size >= 0 || rule->type != TYPE_ANY)
+    {
+      int type = TYPE_OTHER;
+      if (!statbuf)
+	return 0;
+      if (rule->min_size >= 0 && statbuf->st_size < rule->min_size)
+	return 0;
+      if (rule->max_size >= 0 && statbuf->st_size > rule->max_size)
+	return 0;
+      if (S_ISREG(statbuf->st_mode))
+	type = TYPE_FILE;
+#ifdef S_ISLNK
+      else if (S_ISLNK(statbuf->st_mode))
+	type = TYPE_LINK;
+#endif
+#ifdef S_ISBLK
+      else if (S_ISBLK(statbuf->st_mode))
+	type = TYPE_DEVICE;
+#endif
+      if (rule->type != TYPE_ANY && rule->type != type)
+	return 0;
+    }
+  return 1;
+}
+
+/**
+   select the rule for the file path and count it.
+   @param options bitfield of SRM_* bits of the command line
+   @return options with the SRM_MODE_* bits of the matching rule and
+   SRM_OPT_NO_BATCH if the rule asks for it.
+*/
+int policy_apply(const char *path, const int options)
+{
+  struct policy_rule *rule;
+  my_stat_t statbuf;
+  int have_stat;
+
+  if (!rules || !path)
+    return options;
+
+#if defined(_MSC_VER)
+  have_stat = _stat64(path, &statbuf) == 0;
+#else
+  have_stat = lstat(path, &statbuf) == 0;
+#endif
+
+  for (rule = rules; rule; rule = rule->next)
+    if (rule_matches(rule, path, have_stat ? &statbuf : NULL))
+      break;
+  if (!rule)
+    {
+      rule = &default_rule;
+      rule->mode = options & SRM_MODE_MASK;
+    }
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&policy_lock);
+#endif
+  rule->files++;
+  if (have_stat && S_ISREG(statbuf.st_mode))
+    {
+      rule->bytes += statbuf.st_size;
+      if (statbuf.st_nlink == 1)
+	rule->written += (unsigned long long)statbuf.st_size * scheme_lookup(rule->mode)->num_passes;
+    }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&policy_lock);
+#endif
+
+  if (rule->no_batch)
+    return (options & ~SRM_MODE_MASK) | rule->mode | SRM_OPT_NO_BATCH;
+  return (options & ~SRM_MODE_MASK) | rule->mode;
+}
+
+static void rule_report(const struct policy_rule *rule, const int format, const int first)
+{
+  const char *scheme = scheme_lookup(rule->mode)->name;
+
+  if (format == PLAN_JSON)
+    printf("%s{\"line\":%u,\"scheme\":\"%s\",\"files\":%lu,\"bytes\":%llu,\"written\":%llu}",
+	   first ? "" : ",", rule->line, scheme, rule->files, rule->bytes, rule->written);
+  else if (format == PLAN_TEXT)
+    printf("  %s\n    %s, %lu files, %llu bytes, %llu bytes written\n",
+	   rule->line ? rule->text : "(command line)", scheme, rule->files, rule->bytes, rule->written);
+  else
+    error("policy %s: %s, %lu files, %llu bytes, %llu bytes written",
+	  rule->line ? rule->text : "(command line)", scheme, rule->files, rule->bytes, rule->written);
+}
+
+/**
+   print the statistics of the rules, for --plan in its format or with
+   error() for -v after a real run.
+   @param format PLAN_TEXT, PLAN_JSON (the elements of an array) or PLAN_OFF
+*/
+void policy_report(const int format)
+{
+  const struct policy_rule *rule;
+  int first = 1;
+
+  if (!rules)
+    return;
+  for (rule = rules; rule; rule = rule->next, first = 0)
+    rule_report(rule, format, first);
+  if (default_rule.files > 0)
+    rule_report(&default_rule, format, first);
+}
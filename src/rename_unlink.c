@@ -45,38 +45,24 @@ static int empty_directory(const char *path)
 }
 #endif
 
-int rename_unlink(const char *path) {
+/**
+   rename path to a random name of 14 alphanumeric characters in the
+   same directory, so the directory entry no longer tells the old name.
+   @return the new name, which the caller frees; NULL upon error (see
+   the errno variable for details).
+*/
+char *rename_random(const char *path) {
   char *new_name, *p;
   struct stat statbuf;
   size_t new_name_size;
   int i = 0;
 
-  if(!path)
-    {
-      errno = EINVAL;
-      return -1;
-    }
-
-  /* does path exist? */
-  if (lstat(path, &statbuf) < 0)
-    return -1;
-
-#if defined(__unix__)
-  /* is path is a directory it should be empty */
-  if (S_ISDIR(statbuf.st_mode) && (empty_directory(path) < 0))
-    {
-      /* Directory isn't empty (e.g. because it contains an immutable file). Attempting to remove it will fail, so avoid renaming it. */
-      errno = ENOTEMPTY;
-      return -1;
-    }
-#endif
-
   /* construct the new random name */
   new_name_size = strlen(path) + 15;
 
-  if ( (new_name = (char *)alloca(new_name_size)) == NULL ) {
+  if ( (new_name = (char *)malloc(new_name_size)) == NULL ) {
     errno = ENOMEM;
-    return -1;
+    return NULL;
   }
 
   strncpy(new_name, path, new_name_size);
@@ -102,7 +88,42 @@ int rename_unlink(const char *path) {
   } while (lstat(new_name, &statbuf) == 0);
 
   /* rename */
-  if (rename(path, new_name) < 0)
+  if (rename(path, new_name) < 0) {
+    int e = errno;
+    free(new_name);
+    errno = e;
+    return NULL;
+  }
+  return new_name;
+}
+
+static int do_rename_unlink(const char *path, const int check_empty) {
+  char *new_name;
+  struct stat statbuf;
+  int ret, e;
+
+  if(!path)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  /* does path exist? */
+  if (lstat(path, &statbuf) < 0)
+    return -1;
+
+  (void)check_empty;
+#if defined(__unix__)
+  /* is path is a directory it should be empty */
+  if (check_empty && S_ISDIR(statbuf.st_mode) && (empty_directory(path) < 0))
+    {
+      /* Directory isn't empty (e.g. because it contains an immutable file). Attempting to remove it will fail, so avoid renaming it. */
+      errno = ENOTEMPTY;
+      return -1;
+    }
+#endif
+
+  if ((new_name = rename_random(path)) == NULL)
     return -1;
 
   sync();
@@ -116,8 +137,21 @@ int rename_unlink(const char *path) {
   }
 
   /* remove */
-  if (S_ISDIR(statbuf.st_mode))
-    return rmdir(new_name);
+  ret = S_ISDIR(statbuf.st_mode) ? rmdir(new_name) : unlink(new_name);
+  e = errno;
+  free(new_name);
+  errno = e;
+  return ret;
+}
+
+int rename_unlink(const char *path) {
+  return do_rename_unlink(path, 1);
+}
 
-  return unlink(new_name);
+/**
+   like rename_unlink(), for a directory whose entries are known to be
+   removed already, see walk_node_release().
+*/
+int rename_unlink_dir(const char *path) {
+  return do_rename_unlink(path, 0);
 }
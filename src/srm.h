@@ -14,6 +14,16 @@
 #define SRM_OPT_R (1 << 5)
 /** do not cross file system boundaries */
 #define SRM_OPT_X (1 << 6)
+/** serase(): punch holes into the erased ranges */
+#define SRM_OPT_PUNCH (1 << 9)
+/** serase(): remove the erased ranges from the file */
+#define SRM_OPT_COLLAPSE (1 << 10)
+/** let the kernel write the 0x00 passes to block devices */
+#define SRM_OPT_ZERO_OFFLOAD (1 << 11)
+/** discard the blocks of block devices and punch holes into files after the overwrite */
+#define SRM_OPT_DISCARD (1 << 12)
+/** with SRM_OPT_DISCARD, use secure discard on block devices */
+#define SRM_OPT_SECURE_DISCARD (1 << 13)
 /** simple overwrite mode */
 #define SRM_MODE_SIMPLE (1 << 16)
 /** OpenBSD overwrite mode */
@@ -34,6 +44,14 @@
 extern "C" {
 #endif
 
+/** a byte range of a file, see serase(). */
+struct srm_range
+{
+  long long offset;
+  /** number of bytes, 0 for up to the end of the file */
+  long long length;
+};
+
 /** unlink a file/directory in a secure way.
 
     Before the file/directory is unlinked it's name is renamed to a
@@ -64,6 +82,28 @@ int rename_unlink(const char *path);
 */
 int sunlink(const char *path, const int options);
 
+/** overwrite byte ranges of a file in a secure way.
+
+    The file is not removed. Every pass of the selected mode is
+    written to all ranges, then synced. Ranges are clipped to the size
+    of the file and must not overlap. With SRM_OPT_PUNCH the space of
+    the ranges is released afterwards by punching holes, with
+    SRM_OPT_COLLAPSE the ranges are removed from the file and the data
+    after them moves down; this needs ranges aligned to the block size
+    of the file system, except for a range up to the end of the file,
+    which is truncated.
+
+    This function sets errno.
+
+    @param path (absolute) path to a regular file
+    @param ranges the byte ranges to erase
+    @param num number of ranges
+    @param options a combination of SRM_* flags
+
+    @return 0 upon success, negative upon error
+*/
+int serase(const char *path, const struct srm_range *ranges, const unsigned num, const int options);
+
 #ifdef __cplusplus
 }
 #endif
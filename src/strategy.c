@@ -0,0 +1,201 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "srm.h"
+#include "impl.h"
+
+/* Files are overwritten the same way everywhere unless the file
+   system they live on asks for something else. strategy_lookup()
+   picks an entry of the table below by the statfs f_type of the file
+   system, fs_info_lookup() remembers it per device.
+
+   On tmpfs and ramfs the data only lives in memory: a single pass is
+   written and never synced. NFS writes large unstable chunks, sends
+   every pass to the server with sync_file_range() and commits them
+   once after the last pass; a synchronous write of every block would
+   wait for a round trip each. Local file
+   systems write in large chunks and sync once per pass, which keeps
+   the passes ordered on disk like O_SYNC did.
+
+   --fs-strategy changes an entry or adds one, see strategy_set(). */
+
+#define MAX_STRATEGIES 32
+
+#define TMPFS_MAGIC 0x01021994
+#define RAMFS_MAGIC 0x858458F6
+#define EXT4_SUPER_MAGIC 0xEF53
+#define XFS_SUPER_MAGIC 0x58465342
+#define BTRFS_SUPER_MAGIC 0x9123683E
+#define OVERLAYFS_SUPER_MAGIC 0x794C7630
+#define NFS_SUPER_MAGIC 0x6969
+#define SMB_SUPER_MAGIC 0x517B
+#define CIFS_MAGIC_NUMBER 0xFF534D42
+#define SMB2_MAGIC_NUMBER 0xFE534D42
+
+/* the first entry is used for file systems that are not in the table */
+static struct srm_strategy strategies[MAX_STRATEGIES] = {
+  /* name       f_type                       io_size    sync        direct discard passes */
+  { "default",  0,                           0,         SYNC_WRITE, 0,     -1,     0 },
+  { "tmpfs",    (long)TMPFS_MAGIC,           1024*1024, SYNC_NONE,  0,     -1,     1 },
+  { "ramfs",    (long)RAMFS_MAGIC,           1024*1024, SYNC_NONE,  0,     -1,     1 },
+  { "ext4",     (long)EXT4_SUPER_MAGIC,      1024*1024, SYNC_PASS,  0,     -1,     0 },
+  { "xfs",      (long)XFS_SUPER_MAGIC,       1024*1024, SYNC_PASS,  0,     -1,     0 },
+  /* data is copied on write, see cow.c */
+  { "btrfs",    (long)BTRFS_SUPER_MAGIC,     1024*1024, SYNC_PASS,  0,     -1,     0 },
+  /* writes go to the upper layer, which may be any file system */
+  { "overlayfs",(long)OVERLAYFS_SUPER_MAGIC, 0,         SYNC_WRITE, 0,     -1,     0 },
+  { "nfs",      (long)NFS_SUPER_MAGIC,       1024*1024, SYNC_END,   0,     -1,     0 },
+  { "smb",      (long)SMB_SUPER_MAGIC,       1024*1024, SYNC_PASS,  0,     -1,     0 },
+  { "cifs",     (long)CIFS_MAGIC_NUMBER,     1024*1024, SYNC_PASS,  0,     -1,     0 },
+  { "smb2",     (long)SMB2_MAGIC_NUMBER,     1024*1024, SYNC_PASS,  0,     -1,     0 },
+};
+static unsigned num_strategies = 11;
+
+static const char *sync_names[] = { "write", "pass", "end", "none" };
+
+/**
+   @return the strategy for files on a file system of statfs f_type fs_type.
+*/
+const struct srm_strategy *strategy_lookup(const long fs_type)
+{
+  unsigned i;
+  for (i = 1; i < num_strategies; i++)
+    if (strategies[i].fs_type == fs_type)
+      return strategies + i;
+  return strategies;
+}
+
+static const char *strategy_sync_name(const int sync)
+{
+  if (sync < 0 || sync >= (int)(sizeof(sync_names)/sizeof(sync_names[0])))
+    return "?";
+  return sync_names[sync];
+}
+
+static struct srm_strategy *strategy_find(const char *type, const size_t len)
+{
+  struct srm_strategy *s;
+  char buf[32], *end;
+  long fs_type;
+  unsigned i;
+
+  if (len == 0 || len >= sizeof(buf))
+    return NULL;
+  memcpy(buf, type, len);
+  buf[len] = 0;
+
+  for (i = 0; i < num_strategies; i++)
+    if (strategies[i].name && !strcmp(strategies[i].name, buf))
+      return strategies + i;
+
+  /* a file system which is not in the table by its f_type */
+  errno = 0;
+  fs_type = (long)strtoul(buf, &end, 0);
+  if (errno || *end || fs_type == 0)
+    return NULL;
+  for (i = 1; i < num_strategies; i++)
+    if (strategies[i].fs_type == fs_type)
+      return strategies + i;
+  if (num_strategies == MAX_STRATEGIES)
+    return NULL;
+  s = strategies + num_strategies++;
+  *s = strategies[0];
+  s->name = NULL;
+  s->fs_type = fs_type;
+  return s;
+}
+
+/**
+   change the strategy of one file system type.
+
+   @param spec TYPE:KEY=VALUE[,KEY=VALUE...] where TYPE is a name of
+   the table or a statfs f_type number and KEY is one of io, sync,
+   direct, discard or passes.
+
+   @return 0 upon success, negative if spec is invalid.
+*/
+int strategy_set(const char *spec)
+{
+  struct srm_strategy *s, tmp;
+  const char *p;
+
+  if (!spec || (p = strchr(spec, ':')) == NULL)
+    return -1;
+  if ((s = strategy_find(spec, p - spec)) == NULL)
+    return -1;
+
+  /* the entry only changes if all of spec is valid */
+  tmp = *s;
+  while (*p++)
+    {
+      const char *value = strchr(p, '=');
+      size_t key_len, value_len;
+      char buf[32];
+      int i;
+
+      if (!value)
+	return -1;
+      key_len = value++ - p;
+      value_len = strcspn(value, ",");
+      if (value_len == 0 || value_len >= sizeof(buf))
+	return -1;
+      memcpy(buf, value, value_len);
+      buf[value_len] = 0;
+
+      if (key_len == 2 && !strncmp(p, "io", 2))
+	{
+	  my_off_t size;
+	  if (parse_size(buf, &size) < 0 || size < 512 || size > 64*1024*1024 || size % 512)
+	    return -1;
+	  tmp.io_size = (unsigned)size;
+	}
+      else if (key_len == 4 && !strncmp(p, "sync", 4))
+	{
+	  for (i = 0; i < (int)(sizeof(sync_names)/sizeof(sync_names[0])); i++)
+	    if (!strcmp(buf, sync_names[i]))
+	      break;
+	  if (i == (int)(sizeof(sync_names)/sizeof(sync_names[0])))
+	    return -1;
+	  tmp.sync = i;
+	}
+      else if (key_len == 6 && !strncmp(p, "direct", 6) && (!strcmp(buf, "0") || !strcmp(buf, "1")))
+	tmp.direct = buf[0] - '0';
+      else if (key_len == 7 && !strncmp(p, "discard", 7) && (!strcmp(buf, "0") || !strcmp(buf, "1")))
+	tmp.discard = buf[0] - '0';
+      else if (key_len == 6 && !strncmp(p, "passes", 6))
+	{
+	  char *end;
+	  tmp.passes = (unsigned)strtoul(buf, &end, 10);
+	  if (*end)
+	    return -1;
+	}
+      else
+	return -1;
+      p = value + value_len;
+    }
+
+  *s = tmp;
+  return 0;
+}
+
+/**
+   print the strategy of a file system, for -vvv.
+*/
+void strategy_print(const unsigned long long dev, const struct srm_strategy *s)
+{
+  char name[32];
+
+  if (s->name)
+    snprintf(name, sizeof(name), "%s", s->name);
+  else
+    snprintf(name, sizeof(name), "0x%lx", s->fs_type);
+  error("device %llu: strategy %s, io size %u, sync %s, direct I/O %i, discard %i, passes %u",
+	dev, name, s->io_size, strategy_sync_name(s->sync), s->direct, s->discard, s->passes);
+}
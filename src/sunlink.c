@@ -3,6 +3,11 @@
 
 #include "config.h"
 
+#if defined(__linux__)
+/* syncfs() */
+#define _GNU_SOURCE
+#endif
+
 #ifdef _MSC_VER
 #include "AltStreams.h"
 #endif
@@ -57,6 +62,10 @@
 #include <linux/ext2_fs.h>
 #endif
 
+#if defined(HAVE_LINUX_FALLOC_H)
+#include <linux/falloc.h>
+#endif
+
 #if defined(HAVE_ATTR_XATTR_H)
 #include <attr/xattr.h>
 #undef HAVE_SYS_XATTR_H
@@ -83,68 +92,49 @@
 #define MiB (KiB*KiB)
 #define GiB (KiB*KiB*KiB)
 
-#ifdef _MSC_VER
-typedef long long my_off_t;
-#else
-typedef off_t my_off_t;
-#endif
+#include <signal.h>
 
-struct srm_target
-{
-  int fd;
-  const char* file_name;
-  my_off_t file_size;
-  unsigned char *buffer;
-  unsigned buffer_size;
-  int options;
-};
+/* counts the progress requests; every target compares it against the
+   count it has answered, so with --walk-threads or --pipeline each file
+   in flight reports once instead of the first thread to look taking it */
+static volatile sig_atomic_t progress_requests = 0;
 
-static volatile int SIGINT_received = 0;
 #if defined(__unix__)
-#include <signal.h>
-#if defined(__linux__) && !defined(__USE_GNU)
-typedef __sighandler_t sighandler_t;
-#endif
-#if defined(__FreeBSD__) || defined(__OpenBSD__)
-typedef sig_t sighandler_t;
-#endif
-
 static void sigint_handler(int signo)
 {
-  SIGINT_received = signo;
+  (void)signo;
+  progress_requests++;
 }
-int sunlink_impl(const char *path, const int options);
+#endif
 
-int sunlink(const char *path, const int options)
+/**
+   install the progress report on SIGUSR2/SIGINFO and ignore SIGPIPE.
+   Called once by main() before any file is opened or any thread is
+   started, so the handlers stay in place for the walker, --pipeline,
+   --batch, --erase and block device writers alike.
+*/
+void sunlink_signals(void)
 {
+#if defined(__unix__)
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = sigint_handler;
 #ifdef SIGUSR2
-  sighandler_t usr2=signal(SIGUSR2, sigint_handler);
+  sigaction(SIGUSR2, &sa, NULL);
 #endif
 #ifdef SIGINFO
-  sighandler_t info=signal(SIGINFO, sigint_handler);
-#endif
-#ifdef SIGPIPE
-  sighandler_t pipe=signal(SIGPIPE, SIG_IGN);
+  sigaction(SIGINFO, &sa, NULL);
 #endif
-
-  int ret=sunlink_impl(path, options);
-
 #ifdef SIGPIPE
-  signal(SIGPIPE, pipe);
-#endif
-#ifdef SIGINFO
-  signal(SIGINFO, info);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
 #endif
-#ifdef SIGUSR2
-  signal(SIGUSR2, usr2);
 #endif
-  return ret;
 }
 
-#else /* __unix__ */
-#define sunlink_impl sunlink
-#endif
-
 /**
    writes a buffer to a file descriptor. Ensures that the complete
    buffer is written.
@@ -192,149 +182,304 @@ static void flush(int fd)
 #endif
 }
 
+/**
+   send the buffered writes of fd to the device, or to the server
+   without a COMMIT, and wait for them, but do not make them durable.
+   Otherwise the next pass would only overwrite the same dirty pages in
+   the page cache.
+*/
+static void writeback(int fd)
+{
+#if defined(HAVE_SYNC_FILE_RANGE) && defined(SYNC_FILE_RANGE_WRITE)
+  if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+    return;
+#endif
+  flush(fd);
+}
+
+/**
+   write count bytes of the pattern buffer of srm, within the rate
+   limits, see throttle().
+*/
+static ssize_t write_pass(struct srm_target *srm, const size_t count)
+{
+  throttle(srm->fs, count);
+  return writen(srm->fd, srm->buffer, count);
+}
+
+/**
+   switch direct I/O on or off for the open file fd.
+*/
+void direct_io(const int fd, const int on)
+{
+#if defined(O_DIRECT)
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0 && (flags & O_DIRECT) != (on ? O_DIRECT : 0))
+    fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT);
+#else
+  (void)fd;
+  (void)on;
+#endif
+}
+
 #if defined(HAVE_ATTR_XATTR_H) || defined(HAVE_SYS_XATTR_H) || defined(HAVE_SYS_EXTATTR_H)
-static int extattr_overwrite(struct srm_target *srm, const int pass, const int attrnamespace)
+#define HAVE_EXTATTR 1
+
+/* the extended attributes of a target are listed once by
+   extattr_list() and then overwritten for every pass from the same
+   heap buffers. */
+struct srm_extattr
 {
-  char *list = NULL;
-  unsigned char *value = NULL;
-  size_t list_size = 256, value_size = 0, key_len = 0;
-  ssize_t len = 0, i = 0;
-  /* get list of atrributes */
-  for(;;) {
-    list = alloca(list_size);
-    if (! list) {
-      errno = ENOMEM;
-      return -1;
-    }
-    errno = 0;
-#if defined(HAVE_ATTR_XATTR_H) || defined(HAVE_SYS_XATTR_H)
-#if defined(HAVE_ATTR_XATTR_H)
-    len = flistxattr(srm->fd, list, list_size);
+  size_t name_off;
+  size_t value_len;
+  int attrnamespace;
+};
+
+static void extattr_free(struct srm_target *srm)
+{
+  free(srm->extattr_names);
+  free(srm->extattrs);
+  free(srm->extattr_value);
+  srm->extattr_names = NULL;
+  srm->extattrs = NULL;
+  srm->extattr_value = NULL;
+  srm->extattr_count = 0;
+  srm->extattr_names_len = 0;
+  srm->extattr_value_size = 0;
+}
+
+/**
+   append the extended attributes of one namespace to srm->extattrs.
+
+   @return 0 upon success, negative upon error (see the errno variable for details).
+*/
+static int extattr_list_ns(struct srm_target *srm, const int attrnamespace)
+{
+  char *names;
+  ssize_t len, i;
+  size_t key_len = 0;
+
+  /* a single size probe tells us if there is anything to do */
+#if defined(HAVE_ATTR_XATTR_H) || (defined(HAVE_SYS_XATTR_H) && !defined(__APPLE__))
+  len = flistxattr(srm->fd, NULL, 0);
 #elif defined(HAVE_SYS_XATTR_H) && defined(__APPLE__)
-    len = flistxattr(srm->fd, list, list_size, 0);
+  len = flistxattr(srm->fd, NULL, 0, 0);
+#elif defined(HAVE_SYS_EXTATTR_H)
+  len = extattr_list_fd(srm->fd, attrnamespace, NULL, 0);
 #endif
-    if (len < 0 && errno == ERANGE) {
-      list_size *= 2;
-      if (list_size > 1024*1024) {
-	error("file has very large extended attribute list, giving up.");
-	break;
-      }
-      continue;
-    }
+  if (len <= 0) {
+    /* no attributes, or the file system does not support them */
+    return 0;
+  }
+  if (len > 1024*1024) {
+    error("file has very large extended attribute list, giving up.");
+    return 0;
+  }
+
+  names = (char*)realloc(srm->extattr_names, srm->extattr_names_len + len + 1);
+  if (! names) {
+    errno = ENOMEM;
+    return -1;
+  }
+  srm->extattr_names = names;
+  names += srm->extattr_names_len;
+
+#if defined(HAVE_ATTR_XATTR_H) || (defined(HAVE_SYS_XATTR_H) && !defined(__APPLE__))
+  len = flistxattr(srm->fd, names, len);
+#elif defined(HAVE_SYS_XATTR_H) && defined(__APPLE__)
+  len = flistxattr(srm->fd, names, len, 0);
 #elif defined(HAVE_SYS_EXTATTR_H)
-    len = extattr_list_fd(srm->fd, attrnamespace, NULL, 0);
-    if (len > list_size) {
-      list_size = len;
-      continue;
-    }
-    len = extattr_list_fd(srm->fd, attrnamespace, list, list_size);
+  len = extattr_list_fd(srm->fd, attrnamespace, names, len);
 #endif
-    if (len < 0) {
-      break;
-    }
-    break;
+  if (len <= 0) {
+    /* the list changed between the two calls, ignore it like the file had none */
+    return 0;
   }
+  names[len] = 0;
 
-  /* iterate list of attributes */
   for(i = 0; i < len; i += key_len + 1) {
-    int ret = 0;
+    struct srm_extattr *attr;
     ssize_t val_len = 0;
-    char *key = NULL;
+    char *key;
 #if defined(HAVE_ATTR_XATTR_H) || defined(HAVE_SYS_XATTR_H)
-    key = list + i;
+    key = names + i;
     key_len = strlen(key);
-#if defined(HAVE_ATTR_XATTR_H)
+#if defined(__linux__)
+    /* only user data lives in the user namespace; security, system
+       and trusted attributes are managed by the kernel and reject
+       arbitrary values. */
+    if (strncmp(key, "user.", 5) != 0) {
+      continue;
+    }
+#endif
+#if defined(HAVE_ATTR_XATTR_H) || !defined(__APPLE__)
     val_len = fgetxattr(srm->fd, key, NULL, 0);
-#elif defined(HAVE_SYS_XATTR_H) && defined(__APPLE__)
+#else
     val_len = fgetxattr(srm->fd, key, NULL, 0, 0, 0);
 #endif
 #elif defined(HAVE_SYS_EXTATTR_H)
-    char keybuf[257];
-    key_len = *((unsigned char*)(list + i));
-    memcpy(keybuf, list+i+1, key_len);
-    keybuf[key_len] = 0;
-    key = keybuf;
+    /* convert the length prefixed name into a C string in place */
+    key_len = *((unsigned char*)(names + i));
+    memmove(names + i, names + i + 1, key_len);
+    names[i + key_len] = 0;
+    key = names + i;
     val_len = extattr_get_fd(srm->fd, attrnamespace, key, NULL, 0);
 #endif
-    if ( ((srm->options & SRM_OPT_V) > 1) && pass == 1) {
+    if (val_len < 0) {
+      errorp("could not get extended attribute %s", key);
+      continue;
+    }
+
+    if ((srm->options & SRM_OPT_V) > 1) {
       char *name_space="";
 #if defined(HAVE_SYS_EXTATTR_H)
-      extattr_namespace_to_string(attrnamespace, &namespace);
+      extattr_namespace_to_string(attrnamespace, &name_space);
 #endif
       error("found extended attribute %s %s of %i bytes", name_space, key, (int)val_len);
     }
-    if (val_len > (ssize_t)value_size) {
-      value_size = val_len;
-      value = alloca(value_size);
-      if (! value) {
-	errno = ENOMEM;
-	return -1;
-      }
-      fill(value, value_size, srm->buffer, srm->buffer_size);
+
+    attr = (struct srm_extattr*)realloc(srm->extattrs, (srm->extattr_count + 1) * sizeof(struct srm_extattr));
+    if (! attr) {
+      errno = ENOMEM;
+      return -1;
     }
-#if defined(HAVE_ATTR_XATTR_H)
-    ret = fsetxattr(srm->fd, key, value, val_len, XATTR_REPLACE);
+    srm->extattrs = attr;
+    attr += srm->extattr_count++;
+    attr->name_off = srm->extattr_names_len + i;
+    attr->value_len = val_len;
+    attr->attrnamespace = attrnamespace;
+    if ((size_t)val_len > srm->extattr_value_size) {
+      srm->extattr_value_size = val_len;
+    }
+  }
+
+  srm->extattr_names_len += len + 1;
+  (void)attrnamespace;
+  return 0;
+}
+
+/**
+   list the extended attributes of srm->fd once, before the first pass.
+
+   @return 0 upon success, negative upon error (see the errno variable for details).
+*/
+static int extattr_list(struct srm_target *srm)
+{
+#if defined(HAVE_ATTR_XATTR_H) || defined(HAVE_SYS_XATTR_H)
+  if (extattr_list_ns(srm, 0) < 0) {
+    return -1;
+  }
+#elif defined(HAVE_SYS_EXTATTR_H)
+  if (extattr_list_ns(srm, EXTATTR_NAMESPACE_USER) < 0) {
+    return -1;
+  }
+  if (extattr_list_ns(srm, EXTATTR_NAMESPACE_SYSTEM) < 0) {
+    return -1;
+  }
+#endif
+  if (srm->extattr_value_size > 0) {
+    srm->extattr_value = (unsigned char*)malloc(srm->extattr_value_size);
+    if (! srm->extattr_value) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+   overwrite the values of all attributes found by extattr_list() with
+   the current pass pattern.
+*/
+static void extattr_overwrite(struct srm_target *srm)
+{
+  unsigned i;
+
+  if (srm->extattr_count == 0) {
+    return;
+  }
+
+  fill(srm->extattr_value, srm->extattr_value_size, srm->buffer, srm->buffer_size);
+  for(i = 0; i < srm->extattr_count; i++) {
+    const struct srm_extattr *attr = srm->extattrs + i;
+    const char *key = srm->extattr_names + attr->name_off;
+    int ret = 0;
+#if defined(HAVE_ATTR_XATTR_H) || (defined(HAVE_SYS_XATTR_H) && !defined(__APPLE__))
+    ret = fsetxattr(srm->fd, key, srm->extattr_value, attr->value_len, XATTR_REPLACE);
 #elif defined(HAVE_SYS_XATTR_H) && defined(__APPLE__)
-    ret = fsetxattr(srm->fd, key, value, val_len, 0, XATTR_REPLACE);
+    ret = fsetxattr(srm->fd, key, srm->extattr_value, attr->value_len, 0, XATTR_REPLACE);
 #elif defined(HAVE_SYS_EXTATTR_H)
-    ret = extattr_set_fd(srm->fd, attrnamespace, key, value, val_len);
+    ret = extattr_set_fd(srm->fd, attr->attrnamespace, key, srm->extattr_value, attr->value_len);
 #endif
     if (ret < 0) {
       errorp("could not overwrite extended attribute %s", key);
     }
   }
-
-  (void)attrnamespace;
-  return 0;
 }
 #endif
 
-static int overwrite(struct srm_target *srm, const int pass)
+static int overwrite(struct srm_target *srm, const int pass, const my_off_t from)
 {
   unsigned last_val = ~0u;
-  my_off_t i = 0;
+  my_off_t i = from, checkpoint = from;
   ssize_t w;
+  double start;
 
   if(!srm) return -1;
   if(!srm->buffer) return -1;
   if(srm->buffer_size < 1) return -1;
 
-  /* check for extended attributes */
-#if defined(HAVE_ATTR_XATTR_H) || defined(HAVE_SYS_XATTR_H)
-  if (extattr_overwrite(srm, pass, 0) < 0) {
-    return -1;
-  }
-#elif defined(HAVE_SYS_EXTATTR_H)
-  if (extattr_overwrite(srm, pass, EXTATTR_NAMESPACE_USER) < 0) {
-    return -1;
-  }
-  if (extattr_overwrite(srm, pass, EXTATTR_NAMESPACE_SYSTEM) < 0) {
-    return -1;
-  }
+#ifdef HAVE_EXTATTR
+  extattr_overwrite(srm);
 #endif
 
-  if(lseek(srm->fd, 0, SEEK_SET) != 0)
+  if(lseek(srm->fd, from, SEEK_SET) != from)
     {
       perror("could not seek");
       return -1;
     }
+  start = plan_clock();
+  /* direct I/O needs aligned offsets and lengths, an unaligned tail
+     of the file is written through the page cache */
+  if(srm->direct_align)
+    direct_io(srm->fd, from % srm->direct_align == 0);
 
-  if(srm->file_size < (my_off_t)(srm->buffer_size))
+  if(srm->file_size - from < (my_off_t)(srm->buffer_size))
     {
-      w=writen(srm->fd, srm->buffer, srm->file_size);
-      if(w != srm->file_size)
+      if(srm->direct_align && (srm->file_size - from) % srm->direct_align)
+	direct_io(srm->fd, 0);
+      w=write_pass(srm, srm->file_size - from);
+      if(w != srm->file_size - from)
 	return -1;
     }
   else
     {
+      /* a write from within a stripe ends at its boundary, the
+	 following writes cover whole stripes */
+      const my_off_t head = fs_info_stripe_head(srm->fs, from);
+      if(head > 0)
+	{
+	  w=write_pass(srm, head);
+	  if(w != head)
+	    return -1;
+	  i += w;
+	}
+
       while (i < srm->file_size - (my_off_t)srm->buffer_size)
 	{
-	  w=writen(srm->fd, srm->buffer, srm->buffer_size);
+	  w=write_pass(srm, srm->buffer_size);
 	  if(w != (ssize_t)(srm->buffer_size))
 	    return -1;
 	  i += w;
 
-	  if ((srm->options & SRM_OPT_V) > 1 || SIGINT_received) {
+	  if (srm->journal && (unsigned long long)(i - checkpoint) >= journal_interval)
+	    {
+	      flush(srm->fd);
+	      journal_checkpoint(srm, pass - 1, i);
+	      checkpoint = i;
+	    }
+
+	  if ((srm->options & SRM_OPT_V) > 1 || progress_requests != srm->progress_seen) {
 	      unsigned val = 0, file_size = 0;
 	      char c = '.';
 	      if (srm->file_size < MiB) {
@@ -356,22 +501,27 @@ static int overwrite(struct srm_target *srm, const int pass)
 		  last_val = val;
 	      }
 
-	      if(SIGINT_received)
+	      if(progress_requests != srm->progress_seen)
 		{
 		  if(srm->file_name)
 		    printf("%s\n", srm->file_name);
 		  else
 		    putchar('\n');
-		  SIGINT_received=0;
+		  srm->progress_seen = progress_requests;
 		  fflush(stdout);
 		}
 	    }
 	}
-      w=writen(srm->fd, srm->buffer, srm->file_size - i);
+      if(srm->direct_align && (srm->file_size - i) % srm->direct_align)
+	direct_io(srm->fd, 0);
+      w=write_pass(srm, srm->file_size - i);
       if(w != srm->file_size-i)
 	return -1;
     }
 
+  if(srm->defer_sync)
+    return 0;
+
   if((srm->options & SRM_OPT_V) > 1)
     {
       printf("\rpass %i sync                        ", pass);
@@ -379,6 +529,10 @@ static int overwrite(struct srm_target *srm, const int pass)
     }
 
   flush(srm->fd);
+  /* the time of a durable pass feeds the estimates of --plan */
+  plan_record(srm->fs, (unsigned long long)(srm->file_size - from), plan_clock() - start);
+  /* the next pass starts from the beginning */
+  journal_checkpoint(srm, pass, 0);
 
   if(lseek(srm->fd, 0, SEEK_SET) != 0)
     {
@@ -389,158 +543,500 @@ static int overwrite(struct srm_target *srm, const int pass)
   return 0;
 }
 
-static int overwrite_random(struct srm_target *srm, const int pass, const int num_passes)
+/**
+   write one pass to the extents of a file in the order of ext, with
+   one barrier at the end.
+*/
+static int overwrite_extents(struct srm_target *srm, const int pass, const struct srm_extent *ext, const unsigned num)
 {
-  int i;
-
-  if(!srm) return -1;
-  if(!srm->buffer) return -1;
-  if(srm->buffer_size < 1) return -1;
+  const my_off_t size = srm->file_size;
+  const int defer_sync = srm->defer_sync;
+  const double start = plan_clock();
+  unsigned i;
+  int ret = 0;
+#ifdef HAVE_EXTATTR
+  const unsigned extattr_count = srm->extattr_count;
+#endif
 
-  for (i = 0; i < num_passes; i++)
+  srm->defer_sync = 1;
+  for (i = 0; i < num && ret == 0; i++)
     {
-      randomize_buffer(srm->buffer, srm->buffer_size);
-      if(overwrite(srm, pass+i) < 0)
-	return -1;
+      srm->file_size = ext[i].logical + ext[i].length;
+      ret = overwrite(srm, pass, ext[i].logical);
+#ifdef HAVE_EXTATTR
+      /* the extended attributes are overwritten with the first extent */
+      srm->extattr_count = 0;
+#endif
     }
+#ifdef HAVE_EXTATTR
+  srm->extattr_count = extattr_count;
+#endif
+  srm->file_size = size;
+  srm->defer_sync = defer_sync;
+  if (ret < 0 || defer_sync)
+    return ret;
 
+  flush(srm->fd);
+  plan_record(srm->fs, (unsigned long long)size, plan_clock() - start);
   return 0;
 }
 
-static int overwrite_byte(struct srm_target *srm, const int pass, const int byte)
-{
-  if(!srm) return -1;
-  if(!srm->buffer) return -1;
-  if(srm->buffer_size < 1) return -1;
-  memset(srm->buffer, byte, srm->buffer_size);
-  return overwrite(srm, pass);
-}
-
-static int overwrite_bytes(struct srm_target *srm, const int pass, const unsigned char byte1, const unsigned char byte2, const unsigned char byte3)
+static int overwrite_passes(struct srm_target *srm)
 {
-  unsigned char buf[3];
-
-  if(!srm) return -1;
-  if(!srm->buffer) return -1;
-  if(srm->buffer_size < 1) return -1;
+  const struct srm_scheme *scheme = scheme_lookup(srm->options);
+  const struct srm_strategy *strategy = srm->fs ? srm->fs->strategy : NULL;
+  const int defer_sync = srm->defer_sync;
+  struct srm_extent *ext = NULL;
+  unsigned i, first, num_ext = 0;
+  int sync = strategy ? strategy->sync : SYNC_WRITE;
+  my_off_t from;
+
+  if((srm->options&SRM_OPT_V) > 1)
+    error("%s", scheme->name);
+
+  /* with --resume a checkpoint may skip passes */
+  journal_begin(srm, &first, &from);
+
+  /* the strategy of the file system may only write the last passes */
+  if (strategy && strategy->passes > 0 && first + strategy->passes < scheme->num_passes)
+    {
+      first = scheme->num_passes - strategy->passes;
+      from = 0;
+      if((srm->options&SRM_OPT_V) > 1)
+	error("%u of %u passes", strategy->passes, scheme->num_passes);
+    }
+  /* a checkpoint is only worth something once its pass is on disk */
+  if (srm->journal && sync > SYNC_PASS)
+    sync = SYNC_PASS;
+
+  /* --order writes large files extent by extent in physical order,
+     journal checkpoints need the passes to go from start to end */
+  if ((srm->options & SRM_OPT_EXTENT_ORDER) && !srm->journal && srm->file_size > (my_off_t)srm->buffer_size)
+    ext = fiemap_extents(srm->fd, srm->file_size, &num_ext);
+  if (ext && (srm->options & SRM_OPT_V) > 2)
+    error("%u extents in physical order", num_ext);
+
+  for (i = first; i < scheme->num_passes; i++)
+    {
+      /* with SYNC_END the passes before the last are written back, not synced */
+      const int written_back = !defer_sync && sync == SYNC_END && i + 1 < scheme->num_passes;
+      pass_fill(srm->buffer, srm->buffer_size, &scheme->passes[i]);
+      srm->defer_sync = defer_sync || sync == SYNC_NONE || written_back;
+      if((ext ? overwrite_extents(srm, i+1, ext, num_ext) : overwrite(srm, i+1, i == first ? from : 0)) < 0)
+	{
+	  srm->defer_sync = defer_sync;
+	  free(ext);
+	  return -1;
+	}
+      if (written_back)
+	{
+	  if((srm->options & SRM_OPT_V) > 1)
+	    {
+	      printf("\rpass %u write back                  ", i+1);
+	      fflush(stdout);
+	    }
+	  writeback(srm->fd);
+	}
+    }
 
-  buf[0] = byte1;
-  buf[1] = byte2;
-  buf[2] = byte3;
-  fill(srm->buffer, srm->buffer_size, buf, sizeof(buf));
-  return overwrite(srm, pass);
+  srm->defer_sync = defer_sync;
+  free(ext);
+  journal_end(srm);
+  return 0;
 }
 
-static int overwrite_string(struct srm_target *srm, const int pass, const char *str)
+/**
+   overwrite the open file of srm with all passes of the selected mode.
+   @return 0 upon success, negative upon error.
+*/
+int overwrite_selector(struct srm_target *srm)
 {
-  if(!srm) return -1;
-  if(!srm->buffer) return -1;
-  if(srm->buffer_size < 1) return -1;
-  if (!str) return -1;
-
-  fill(srm->buffer, srm->buffer_size, (const unsigned char*)str, strlen(str));
-  return overwrite(srm, pass);
-}
+  unsigned char *buffer;
+  unsigned mem_align = 0;
+  int ret, options;
 
-static int overwrite_selector(struct srm_target *srm)
-{
   if(!srm) return -1;
 
+  /* the passes do not reach copy-on-write blocks, --cow may skip or shorten them */
+  if ((options = cow_check(srm)) < 0)
+    return 0;
+  srm->options = options;
+
 #if defined(F_NOCACHE)
   /* before performing file I/O, set F_NOCACHE to prevent caching */
   (void)fcntl(srm->fd, F_NOCACHE, 1);
 #endif
 
-  if( (srm->buffer = (unsigned char *)alloca(srm->buffer_size)) == NULL )
+  /* direct I/O needs a buffer aligned in memory and a multiple of the
+     offset alignment long */
+  srm->direct_align = 0;
+  if (srm->fs && srm->fs->strategy && srm->fs->strategy->direct && srm->fs->dio_offset_align > 0
+      && srm->buffer_size % srm->fs->dio_offset_align == 0)
+    {
+      srm->direct_align = srm->fs->dio_offset_align;
+      mem_align = srm->fs->dio_mem_align;
+    }
+
+  if( (buffer = (unsigned char *)malloc(srm->buffer_size + mem_align)) == NULL )
     {
       errno = ENOMEM;
       return -1;
     }
+  srm->buffer = mem_align ? buffer + (mem_align - (size_t)buffer % mem_align) % mem_align : buffer;
 
-  if(srm->options & SRM_MODE_DOD)
+#ifdef HAVE_EXTATTR
+  if(extattr_list(srm) < 0)
     {
-      if((srm->options&SRM_OPT_V) > 1)
-	error("US DoD mode");
-      if(overwrite_byte(srm, 1, 0xF6) < 0) return -1;
-      if(overwrite_byte(srm, 2, 0x00) < 0) return -1;
-      if(overwrite_byte(srm, 3, 0xFF) < 0) return -1;
-      if(overwrite_random(srm, 4, 1) < 0) return -1;
-      if(overwrite_byte(srm, 5, 0x00) < 0) return -1;
-      if(overwrite_byte(srm, 6, 0xFF) < 0) return -1;
-      if(overwrite_random(srm, 7, 1) < 0) return -1;
+      int e=errno;
+      extattr_free(srm);
+      free(buffer);
+      srm->buffer = NULL;
+      errno=e;
+      return -1;
     }
-  else if(srm->options & SRM_MODE_DOE)
+#endif
+
+  ret = overwrite_passes(srm);
+  if (ret == 0)
+    journal_done(srm);
+
+  {
+    int e=errno;
+#ifdef HAVE_EXTATTR
+    extattr_free(srm);
+#endif
+    free(buffer);
+    srm->buffer = NULL;
+    errno=e;
+  }
+  return ret;
+}
+
+/**
+   make the last pass written to the targets durable with one barrier
+   per file system instead of one per file.
+   @param entries if set the renamed directory entries must be durable
+   too, which flush() of a file does not cover, sync() is the fallback then.
+*/
+static void group_barrier(struct srm_target *targets, const unsigned num, const int entries)
+{
+  unsigned i;
+  int need_sync = 0;
+#if defined(HAVE_SYNCFS)
+  const struct srm_fs_info *synced[16];
+  unsigned j, num_synced = 0;
+
+  for (i = 0; i < num; i++)
     {
-      if((srm->options&SRM_OPT_V) > 1)
-	error("US DoE mode");
-      if(overwrite_random(srm, 1, 2) < 0) return -1;
-      if(overwrite_bytes(srm, 3, 'D', 'o', 'E') < 0) return -1;
+      if (targets[i].fd < 0)
+	continue;
+      for (j = 0; j < num_synced; j++)
+	if (synced[j] == targets[i].fs)
+	  break;
+      if (j < num_synced)
+	continue;
+      if (targets[i].fs && num_synced < sizeof(synced)/sizeof(synced[0]) && syncfs(targets[i].fd) == 0)
+	synced[num_synced++] = targets[i].fs;
+      else if (entries)
+	need_sync = 1;
+      else
+	flush(targets[i].fd);
     }
-  else if(srm->options & SRM_MODE_OPENBSD)
+#else
+  for (i = 0; i < num; i++)
+    if (targets[i].fd >= 0)
+      {
+	if (entries)
+	  need_sync = 1;
+	else
+	  flush(targets[i].fd);
+      }
+#endif
+  if (need_sync)
+    sync();
+}
+
+/**
+   overwrite a group of small files pass by pass. Each pass is written
+   to every file of the group before a single barrier makes it
+   durable, so the passes stay ordered on disk like with
+   overwrite_selector() while the number of syncs no longer depends on
+   the number of files.
+
+   All targets must have been opened by sunlink_open() and must not be
+   larger than buffer_size. If overwriting a target fails, an error is
+   printed, its fd is closed and set to -1 and the other targets are
+   still processed.
+
+   @return 0 upon success, negative if the pattern buffer could not be allocated.
+*/
+int overwrite_group(struct srm_target *targets, const unsigned num, const unsigned buffer_size, const int options)
+{
+  const struct srm_scheme *scheme = scheme_lookup(options);
+  unsigned char *buffer;
+  unsigned i, p;
+
+  if (!targets || num == 0 || buffer_size == 0) return -1;
+
+  if ((buffer = (unsigned char*)malloc(buffer_size)) == NULL)
     {
-      if((srm->options&SRM_OPT_V) > 1)
-	error("OpenBSD mode");
-      if(overwrite_byte(srm, 1, 0xFF) < 0) return -1;
-      if(overwrite_byte(srm, 2, 0x00) < 0) return -1;
-      if(overwrite_byte(srm, 3, 0xFF) < 0) return -1;
+      errno = ENOMEM;
+      return -1;
     }
-  else if(srm->options & SRM_MODE_SIMPLE)
+
+  if ((options&SRM_OPT_V) > 1)
+    error("%s for %u files", scheme->name, num);
+
+  for (i = 0; i < num; i++)
     {
-      if((srm->options&SRM_OPT_V) > 1)
-	error("Simple mode");
-      if(overwrite_byte(srm, 1, 0x00) < 0) return -1;
+      struct srm_target *srm = targets + i;
+      srm->buffer = buffer;
+      srm->buffer_size = buffer_size;
+      srm->defer_sync = 1;
+#ifdef HAVE_EXTATTR
+      if (extattr_list(srm) < 0)
+	{
+	  if (options & SRM_OPT_V)
+	    errorp("could not overwrite file %s", srm->file_name);
+	  extattr_free(srm);
+	  close(srm->fd);
+	  srm->fd = -1;
+	}
+#endif
     }
-  else if(srm->options & SRM_MODE_RCMP)
+
+  for (p = 0; p < scheme->num_passes; p++)
     {
-      if((srm->options&SRM_OPT_V) > 1)
-	error("RCMP mode");
-      if(overwrite_byte(srm, 1, 0x00) < 0) return -1;
-      if(overwrite_byte(srm, 2, 0xFF) < 0) return -1;
-      if(overwrite_string(srm, 3, "RCMP") < 0) return -1;
+      const struct srm_pass *pass = &scheme->passes[p];
+      if (pass->len > 0)
+	pass_fill(buffer, buffer_size, pass);
+
+      for (i = 0; i < num; i++)
+	{
+	  struct srm_target *srm = targets + i;
+	  if (srm->fd < 0)
+	    continue;
+	  if (pass->len == 0)
+	    pass_fill(buffer, buffer_size, pass);
+	  if (overwrite(srm, p+1, 0) < 0)
+	    {
+	      if (options & SRM_OPT_V)
+		errorp("could not overwrite file %s", srm->file_name);
+#ifdef HAVE_EXTATTR
+	      extattr_free(srm);
+#endif
+	      close(srm->fd);
+	      srm->fd = -1;
+	    }
+	}
+
+      if ((options & SRM_OPT_V) > 1)
+	{
+	  printf("\rpass %u sync                        ", p+1);
+	  fflush(stdout);
+	}
+      group_barrier(targets, num, 0);
     }
-  else
+
+  for (i = 0; i < num; i++)
     {
-      if(! (srm->options & SRM_MODE_35))
-	error("something is strange, did not have mode_35 bit");
-      if((srm->options&SRM_OPT_V) > 1)
-	error("Full 35-pass mode (Gutmann method)");
-      if(overwrite_random(srm, 1, 4) < 0) return -1;
-      if(overwrite_byte(srm, 5, 0x55) < 0) return -1;
-      if(overwrite_byte(srm, 6, 0xAA) < 0) return -1;
-      if(overwrite_bytes(srm, 7, 0x92, 0x49, 0x24) < 0) return -1;
-      if(overwrite_bytes(srm, 8, 0x49, 0x24, 0x92) < 0) return -1;
-      if(overwrite_bytes(srm, 9, 0x24, 0x92, 0x49) < 0) return -1;
-      if(overwrite_byte(srm, 10, 0x00) < 0) return -1;
-      if(overwrite_byte(srm, 11, 0x11) < 0) return -1;
-      if(overwrite_byte(srm, 12, 0x22) < 0) return -1;
-      if(overwrite_byte(srm, 13, 0x33) < 0) return -1;
-      if(overwrite_byte(srm, 14, 0x44) < 0) return -1;
-      if(overwrite_byte(srm, 15, 0x55) < 0) return -1;
-      if(overwrite_byte(srm, 16, 0x66) < 0) return -1;
-      if(overwrite_byte(srm, 17, 0x77) < 0) return -1;
-      if(overwrite_byte(srm, 18, 0x88) < 0) return -1;
-      if(overwrite_byte(srm, 19, 0x99) < 0) return -1;
-      if(overwrite_byte(srm, 20, 0xAA) < 0) return -1;
-      if(overwrite_byte(srm, 21, 0xBB) < 0) return -1;
-      if(overwrite_byte(srm, 22, 0xCC) < 0) return -1;
-      if(overwrite_byte(srm, 23, 0xDD) < 0) return -1;
-      if(overwrite_byte(srm, 24, 0xEE) < 0) return -1;
-      if(overwrite_byte(srm, 25, 0xFF) < 0) return -1;
-      if(overwrite_bytes(srm, 26, 0x92, 0x49, 0x24) < 0) return -1;
-      if(overwrite_bytes(srm, 27, 0x49, 0x24, 0x92) < 0) return -1;
-      if(overwrite_bytes(srm, 28, 0x24, 0x92, 0x49) < 0) return -1;
-      if(overwrite_bytes(srm, 29, 0x6D, 0xB6, 0xDB) < 0) return -1;
-      if(overwrite_bytes(srm, 30, 0xB6, 0xDB, 0x6D) < 0) return -1;
-      if(overwrite_bytes(srm, 31, 0xDB, 0x6D, 0xB6) < 0) return -1;
-      if(overwrite_random(srm, 32, 4) < 0) return -1;
-      /* if you want to backup your partition or shrink your vmware image having the file zero-ed gives best compression results. */
-      if(overwrite_byte(srm, 36, 0x00) < 0) return -1;
-    }
-#if 0
-  if((srm->options & SRM_OPT_V) > 1)
-    printf("\n");
+      if (targets[i].fd >= 0)
+	journal_done(targets + i);
+#ifdef HAVE_EXTATTR
+      extattr_free(targets + i);
 #endif
+      targets[i].buffer = NULL;
+      targets[i].defer_sync = 0;
+    }
+  journal_commit();
+  free(buffer);
+  return 0;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+  const struct srm_range *x = (const struct srm_range*)a, *y = (const struct srm_range*)b;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+   release the space of the erased ranges with SRM_OPT_PUNCH or
+   SRM_OPT_COLLAPSE. Ranges are collapsed from the highest offset down
+   so that the offsets of the others stay valid.
+*/
+static int erase_release(struct srm_target *srm, const struct srm_range *ranges, const unsigned num)
+{
+  unsigned i = num;
+
+  if (!(srm->options & (SRM_OPT_PUNCH|SRM_OPT_COLLAPSE)))
+    return 0;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_COLLAPSE_RANGE)
+  while (i-- > 0)
+    {
+      if (srm->options & SRM_OPT_PUNCH)
+	{
+	  if (fallocate(srm->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, ranges[i].offset, ranges[i].length) < 0)
+	    return -1;
+	}
+      else if (ranges[i].offset + ranges[i].length >= srm->file_size)
+	{
+	  /* a range up to the end of the file can not be collapsed, it is cut off */
+	  if (ftruncate(srm->fd, ranges[i].offset) < 0)
+	    return -1;
+	  srm->file_size = ranges[i].offset;
+	}
+      else
+	{
+	  if (fallocate(srm->fd, FALLOC_FL_COLLAPSE_RANGE, ranges[i].offset, ranges[i].length) < 0)
+	    return -1;
+	  srm->file_size -= ranges[i].length;
+	}
+    }
+  flush(srm->fd);
   return 0;
+#else
+  (void)i;
+  (void)ranges;
+  errno = EOPNOTSUPP;
+  return -1;
+#endif
+}
+
+/**
+   overwrite byte ranges of a file which stays in place, see srm.h.
+*/
+int serase(const char *path, const struct srm_range *ranges, const unsigned num, const int options)
+{
+  const int oflags = O_WRONLY|O_SYNC|_O_BINARY;
+  const struct srm_scheme *scheme = scheme_lookup(options);
+  struct srm_range *sorted;
+  struct srm_target srm;
+  my_stat_t statbuf;
+  unsigned i, n, p;
+  int ret = 0;
+
+  if (!path || (!ranges && num > 0) || ((options & SRM_OPT_PUNCH) && (options & SRM_OPT_COLLAPSE)))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+#if defined(_MSC_VER)
+  if (_stat64(path, &statbuf) < 0)
+    return -1;
+#else
+  if (lstat(path, &statbuf) < 0)
+    return -1;
+#endif
+  if (!S_ISREG(statbuf.st_mode))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  /* clip the ranges to the file, sort them and reject overlaps */
+  if ((sorted = (struct srm_range*)malloc((num ? num : 1) * sizeof(*sorted))) == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+  for (i = n = 0; i < num; i++)
+    {
+      if (ranges[i].offset < 0 || ranges[i].length < 0)
+	{
+	  free(sorted);
+	  errno = EINVAL;
+	  return -1;
+	}
+      if (ranges[i].offset >= statbuf.st_size)
+	continue;
+      sorted[n] = ranges[i];
+      if (sorted[n].length == 0 || sorted[n].length > statbuf.st_size - sorted[n].offset)
+	sorted[n].length = statbuf.st_size - sorted[n].offset;
+      n++;
+    }
+  qsort(sorted, n, sizeof(*sorted), range_cmp);
+  for (i = 1; i < n; i++)
+    if (sorted[i].offset < sorted[i-1].offset + sorted[i-1].length)
+      {
+	free(sorted);
+	errno = EINVAL;
+	return -1;
+      }
+
+  if (n == 0)
+    {
+      /* nothing of the file is in the ranges */
+      free(sorted);
+      return 0;
+    }
+
+  memset(&srm, 0, sizeof(srm));
+  srm.file_name = path;
+  srm.file_size = statbuf.st_size;
+  srm.options = options;
+#ifdef _MSC_VER
+  srm.buffer_size = 4096;
+#else
+  srm.buffer_size = statbuf.st_blksize;
+#endif
+  if (srm.buffer_size < 16)
+    srm.buffer_size = 512;
+
+  /* the same lock and checks as for a file which is removed */
+  if (sunlink_open(&srm, &statbuf, oflags) < 0)
+    {
+      free(sorted);
+      return -1;
+    }
+  if ((srm.buffer = (unsigned char*)malloc(srm.buffer_size)) == NULL)
+    {
+      close(srm.fd);
+      free(sorted);
+      errno = ENOMEM;
+      return -1;
+    }
+
+  if ((options & SRM_OPT_V) > 1)
+    error("%s for %u ranges of %s", scheme->name, n, path);
+
+  /* every pass covers all ranges before one barrier, like overwrite_group() */
+  srm.defer_sync = 1;
+  for (p = 0; p < scheme->num_passes && ret == 0; p++)
+    {
+      const struct srm_pass *pass = &scheme->passes[p];
+      if (pass->len > 0)
+	pass_fill(srm.buffer, srm.buffer_size, pass);
+      for (i = 0; i < n; i++)
+	{
+	  if (pass->len == 0)
+	    pass_fill(srm.buffer, srm.buffer_size, pass);
+	  /* overwrite() writes from its offset up to file_size */
+	  srm.file_size = sorted[i].offset + sorted[i].length;
+	  if (overwrite(&srm, p+1, sorted[i].offset) < 0)
+	    {
+	      ret = -1;
+	      break;
+	    }
+	}
+      if (ret == 0)
+	flush(srm.fd);
+    }
+  srm.file_size = statbuf.st_size;
+  if ((options & SRM_OPT_V) > 1)
+    putchar('\n');
+
+  if (ret == 0 && erase_release(&srm, sorted, n) < 0)
+    ret = -1;
+
+  {
+    int e=errno;
+    free(srm.buffer);
+    free(sorted);
+    close(srm.fd);
+    errno=e;
+  }
+  return ret;
 }
 
 #ifdef _MSC_VER
@@ -562,35 +1058,389 @@ static my_off_t getFileSize(WCHAR *fn)
     WCHAR fn2[32767];
     WIN32_FILE_ATTRIBUTE_DATA w32_fad;
 
-    wcscpy(fn2, L"\\\\?\\");
-    wcscat(fn2, fn);
-    if (! GetFileAttributesEx((char*)fn2, GetFileExInfoStandard, &w32_fad)) {
-	error("could not get file attributes of %S", fn2);
-	return 0;
+    wcscpy(fn2, L"\\\\?\\");
+    wcscat(fn2, fn);
+    if (! GetFileAttributesEx((char*)fn2, GetFileExInfoStandard, &w32_fad)) {
+	error("could not get file attributes of %S", fn2);
+	return 0;
+    }
+    return (((long long)w32_fad.nFileSizeHigh) << 32) | ((long long)w32_fad.nFileSizeLow);
+#endif
+}
+
+int ntfsHardLinks(const char *fn)
+{
+    int ret = -1;
+    BY_HANDLE_FILE_INFORMATION hfi;
+    HANDLE hFile = CreateFile(fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+	return ret;
+    }
+
+    if (GetFileInformationByHandle(hFile, &hfi)) {
+	ret = hfi.nNumberOfLinks;
+    }
+
+    CloseHandle(hFile);
+    return ret;
+}
+#endif
+
+/**
+   open the regular file srm->file_name for overwriting, lock it and
+   check that the file system will let us remove it afterwards.
+
+   @param srm target with file_name, file_size, buffer_size and options set
+   @param statbuf lstat() result for srm->file_name
+   @param oflags flags for open()
+
+   @return 0 upon success with srm->fd open, negative upon error (see the errno variable for details).
+*/
+int sunlink_open(struct srm_target *srm, const my_stat_t *statbuf, const int oflags)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  struct flock flock;
+#endif
+
+  if ( (srm->fd = open(srm->file_name, oflags)) < 0)
+    return -1;
+  srm->progress_seen = progress_requests;
+
+#if defined(HAVE_SYS_VFS_H) || (defined(HAVE_SYS_PARAM_H) && defined(HAVE_SYS_MOUNT_H))
+  if ((srm->fs = fs_info_lookup(srm->fd, statbuf->st_dev, 0, srm->options)) == NULL)
+    {
+      int e=errno;
+      close(srm->fd);
+      errno=e;
+      return -1;
+    }
+
+  /* the strategy of the file system syncs once per pass or less,
+     O_SYNC can only be dropped by opening the file again */
+  if (srm->fs->strategy && srm->fs->strategy->sync != SYNC_WRITE && (oflags & O_SYNC))
+    {
+      close(srm->fd);
+      if ( (srm->fd = open(srm->file_name, oflags & ~O_SYNC)) < 0)
+	return -1;
+    }
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+  flock.l_type = F_WRLCK;
+  flock.l_whence = SEEK_SET;
+  flock.l_start = 0;
+  flock.l_len = 0;
+  if (fcntl(srm->fd, F_SETLK, &flock) < 0) {
+    int e=errno;
+    flock.l_type = F_WRLCK;
+    flock.l_whence = SEEK_SET;
+    flock.l_start = 0;
+    flock.l_len = 0;
+    flock.l_pid = 0;
+    if (fcntl(srm->fd, F_GETLK, &flock) == 0 && flock.l_pid > 0) {
+      error("can't unlink %s, locked by process %i", srm->file_name, flock.l_pid);
+    }
+    close(srm->fd);
+    errno=e;
+    return -1;
+  }
+#endif
+
+#if defined(HAVE_SYS_VFS_H) || (defined(HAVE_SYS_PARAM_H) && defined(HAVE_SYS_MOUNT_H))
+  {
+    const struct srm_strategy *strategy = srm->fs->strategy;
+
+    if (strategy && strategy->io_size > 0)
+      srm->buffer_size = strategy->io_size;
+    else if (srm->fs->io_size > 0)
+      srm->buffer_size = srm->fs->io_size;
+    /* whole stripes per write, so that a RAID need not read to update its parity */
+    if (srm->fs->stripe > 0 && srm->buffer_size % srm->fs->stripe)
+      srm->buffer_size = srm->buffer_size < srm->fs->stripe ? srm->fs->stripe
+	: srm->buffer_size - srm->buffer_size % srm->fs->stripe;
+    if (strategy && strategy->discard >= 0)
+      srm->options = strategy->discard ? srm->options | SRM_OPT_DISCARD : srm->options & ~SRM_OPT_DISCARD;
+    if((srm->options & SRM_OPT_V) > 2)
+      error("buffer_size=%u", srm->buffer_size);
+
+#if defined(HAVE_LINUX_EXT2_FS_H) || defined(HAVE_LINUX_EXT3_FS_H)
+    if (srm->fs->fs_type == EXT2_SUPER_MAGIC ) /* EXT2_SUPER_MAGIC and EXT3_SUPER_MAGIC are the same */
+      {
+	int flags = 0;
+
+	  if (ioctl(srm->fd, EXT2_IOC_GETFLAGS, &flags) < 0)
+	    {
+	      int e=errno;
+	      close(srm->fd);
+	      errno=e;
+	      return -1;
+	    }
+
+	  if ( (flags & EXT2_UNRM_FL) ||
+	       (flags & EXT2_IMMUTABLE_FL) ||
+	       (flags & EXT2_APPEND_FL) )
+	    {
+              if((srm->options & SRM_OPT_V) > 2) {
+                  error("%s has ext2 undelete, immutable or append-only flag", srm->file_name);
+              }
+	      close(srm->fd);
+	      errno = EPERM;
+	      return -1;
+	    }
+
+#ifdef HAVE_LINUX_EXT3_FS_H
+	  /* if we have the required capabilities we can disable data journaling on ext3 */
+	  if(srm->fs->fs_type == EXT3_SUPER_MAGIC) /* superflous check again, just to make it clear again */
+	    {
+	      flags &= ~EXT3_JOURNAL_DATA_FL;
+	      if (ioctl(srm->fd, EXT3_IOC_SETFLAGS, flags) < 0) {
+                  if (srm->options & SRM_OPT_V)
+                      errorp("could not clear journal data flag for ext3 on %s", srm->file_name);
+	      }
+	    }
+#endif
+	}
+#endif /* HAVE_LINUX_EXT2_FS_H */
+  }
+#endif /* HAVE_SYS_VFS_H */
+
+/* chflags(2) turns out to be a different system call in every BSD
+   derivative. The important thing is to make sure we'll be able to
+   unlink it after we're through messing around. Unlinking it first
+   would remove the need for any of these checks, but would leave the
+   user with no way to overwrite the file if the process was
+   interupted during the overwriting. So, instead we assume that the
+   open() above will fail on immutable and append-only files and try
+   and catch only platforms supporting NOUNLINK here.
+
+   OpenBSD - doesn't support nounlink (As of 3.1)
+   FreeBSD - supports nounlink (from 4.4 on?)
+   Tru64   - unknown
+   MacOS X - doesn't support NOUNLINK (as of 10.3.5)
+*/
+
+#if defined(HAVE_CHFLAGS) && defined(__FreeBSD__)
+  if ((statbuf->st_flags & UF_IMMUTABLE) ||
+      (statbuf->st_flags & UF_APPEND) ||
+      (statbuf->st_flags & UF_NOUNLINK) ||
+      (statbuf->st_flags & SF_IMMUTABLE) ||
+      (statbuf->st_flags & SF_APPEND) ||
+      (statbuf->st_flags & SF_NOUNLINK))
+    {
+      if((srm->options & SRM_OPT_V) > 2) {
+          error("%s has ext2 nounlink, immutable or append-only flag", srm->file_name);
+      }
+      close(srm->fd);
+      errno = EPERM;
+      return -1;
+    }
+#endif /* HAVE_CHFLAGS */
+
+  /* check that the srm struct contains useful values */
+  if (srm->file_name == 0) {
+    error("internal error: srm->file_name is NULL");
+    close(srm->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  if (srm->file_size == 0) {
+    error("internal error: srm->file_size is 0");
+    close(srm->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  if (srm->buffer_size == 0) {
+    error("internal error: srm->buffer_size is 0");
+    close(srm->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+   mark, discard and truncate an overwritten target. Its descriptor
+   stays open, upon error it is closed.
+
+   @return 0 upon success, negative upon error (see the errno variable for details).
+*/
+static int finish_truncate(struct srm_target *srm, const int oflags)
+{
+  (void)oflags;
+
+#if defined(HAVE_LINUX_EXT2_FS_H) || defined(HAVE_LINUX_EXT3_FS_H)
+  ioctl(srm->fd, EXT2_IOC_SETFLAGS, EXT2_SECRM_FL);
+#endif
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+  /* give the overwritten blocks back to the SSD or thin pool */
+  if ((srm->options & SRM_OPT_DISCARD) && srm->file_size > 0 && fs_info_punch_hole(srm->fs, srm->fd)) {
+    if (fallocate(srm->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, srm->file_size) < 0
+	&& (srm->options & SRM_OPT_V))
+      errorp("could not punch hole into %s", srm->file_name);
+  }
+#endif
+
+  if (ftruncate(srm->fd, 0) < 0) {
+    int e=errno;
+    close(srm->fd);
+    srm->fd = -1;
+    errno=e;
+    return -1;
+  }
+
+#ifdef __APPLE__
+  /* Also overwrite the file's resource fork, if present. */
+  {
+    struct srm_target rsrc = *srm;
+    struct stat statbuf;
+    struct flock flock;
+    rsrc.file_name = (char *)alloca(strlen(srm->file_name) + sizeof(_PATH_RSRCFORKSPEC) + 1);
+    if (rsrc.file_name == NULL)
+      {
+	errno = ENOMEM;
+	goto rsrc_fork_failed;
+      }
+
+    if (snprintf((char*)rsrc.file_name, MAXPATHLEN, "%s" _PATH_RSRCFORKSPEC, srm->file_name) > MAXPATHLEN - 1)
+      {
+	errno = ENAMETOOLONG;
+	goto rsrc_fork_failed;
+      }
+
+    if (lstat(rsrc.file_name, &statbuf) != 0)
+      {
+	if (errno == ENOENT || errno == ENOTDIR) {
+	  rsrc.file_size = 0;
+	} else {
+	  goto rsrc_fork_failed;
+	}
+      }
+    else
+      {
+	rsrc.file_size = statbuf.st_size;
+      }
+
+    if (rsrc.file_size > 0)
+      {
+	if ((rsrc.fd = open(rsrc.file_name, oflags)) < 0) {
+	  goto rsrc_fork_failed;
+	}
+
+	flock.l_type = F_WRLCK;
+	flock.l_whence = SEEK_SET;
+	flock.l_start = 0;
+	flock.l_len = 0;
+	if (fcntl(rsrc.fd, F_SETLK, &flock) == -1)
+	  {
+	    close(rsrc.fd);
+	    goto rsrc_fork_failed;
+	  }
+
+	if (rsrc.options & SRM_OPT_V) {
+	  error("removing %s", rsrc.file_name);
+	}
+
+	if(overwrite_selector(&rsrc) < 0)
+	  {
+	    if (rsrc.options & SRM_OPT_V) {
+	      errorp("could not overwrite resource fork %s", rsrc.file_name);
+	    }
+	  }
+
+	ftruncate(rsrc.fd, 0);
+	close(rsrc.fd);
+      }
+    goto rsrc_fork_done;
+
+  rsrc_fork_failed:
+    if (rsrc.options & SRM_OPT_V) {
+      errorp("could not access resource fork %s", srm->file_name);
     }
-    return (((long long)w32_fad.nFileSizeHigh) << 32) | ((long long)w32_fad.nFileSizeLow);
-#endif
+
+  rsrc_fork_done: ;
+  }
+#endif /* __APPLE__ */
+
+  return 0;
 }
 
-int ntfsHardLinks(const char *fn)
+/**
+   truncate, close and unlink an overwritten target opened by sunlink_open().
+
+   @return 0 upon success, negative upon error (see the errno variable for details).
+*/
+int sunlink_finish(struct srm_target *srm, const int oflags)
 {
-    int ret = -1;
-    BY_HANDLE_FILE_INFORMATION hfi;
-    HANDLE hFile = CreateFile(fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hFile == INVALID_HANDLE_VALUE) {
-	return ret;
+  if (finish_truncate(srm, oflags) < 0)
+    return -1;
+  close(srm->fd);
+  srm->fd = -1;
+  return rename_unlink(srm->file_name);
+}
+
+/**
+   truncate and unlink the targets of overwrite_group(). All of them are
+   renamed first and one barrier per file system makes the new names
+   durable, instead of the sync() of rename_unlink() for every file.
+   Targets whose fd is negative were not overwritten and fail with EIO.
+
+   @param failed set to the errno value of each target that could not be
+   removed, 0 for the removed ones
+   @return the number of targets that could not be removed.
+*/
+int sunlink_finish_group(struct srm_target *targets, const unsigned num, const int oflags, int *failed)
+{
+  char **names;
+  unsigned i;
+  int ret = 0;
+
+  if ((names = (char**)calloc(num, sizeof(char*))) == NULL)
+    {
+      /* one file after the other then */
+      for (i = 0; i < num; i++)
+	{
+	  failed[i] = targets[i].fd < 0 ? EIO : sunlink_finish(targets + i, oflags) < 0 ? errno : 0;
+	  ret += failed[i] != 0;
+	}
+      return ret;
     }
 
-    if (GetFileInformationByHandle(hFile, &hfi)) {
-	ret = hfi.nNumberOfLinks;
+  for (i = 0; i < num; i++)
+    {
+      struct srm_target *srm = targets + i;
+      failed[i] = 0;
+      if (srm->fd < 0)
+	failed[i] = EIO;
+      else if (finish_truncate(srm, oflags) < 0 || (names[i] = rename_random(srm->file_name)) == NULL)
+	{
+	  failed[i] = errno;
+	  if (srm->fd >= 0)
+	    close(srm->fd);
+	  srm->fd = -1;
+	}
     }
 
-    CloseHandle(hFile);
-    return ret;
+  group_barrier(targets, num, 1);
+
+  for (i = 0; i < num; i++)
+    {
+      if (!failed[i])
+	{
+	  close(targets[i].fd);
+	  targets[i].fd = -1;
+	  if (unlink(names[i]) < 0)
+	    failed[i] = errno;
+	}
+      ret += failed[i] != 0;
+      free(names[i]);
+    }
+  free(names);
+  return ret;
 }
-#endif
 
-int sunlink_impl(const char *path, const int options)
+int sunlink(const char *path, const int options)
 {
   const int oflags = O_WRONLY|O_SYNC|_O_BINARY;
   struct srm_target srm;
@@ -599,9 +1449,6 @@ int sunlink_impl(const char *path, const int options)
 #else
   struct stat statbuf;
 #endif
-#if defined(__unix__) || defined(__APPLE__)
-  struct flock flock;
-#endif
 
   /* check function arguments */
   if(!path) return -1;
@@ -638,69 +1485,7 @@ int sunlink_impl(const char *path, const int options)
 
 #if defined(__linux__)
   if(S_ISBLK(statbuf.st_mode))
-    {
-      int secsize=512;
-      long blocks=0;
-      uint64_t u=0, u_;
-
-      if( (srm.fd = open(srm.file_name, O_WRONLY)) < 0)
-	return -1;
-
-      if(ioctl(srm.fd, BLKSSZGET, &secsize) < 0)
-	{
-	  perror("could not ioctl(BLKSSZGET)");
-	  return -1;
-	}
-      if((options&SRM_OPT_V) > 2)
-	error("sector size %i bytes", secsize);
-
-      if(ioctl(srm.fd, BLKGETSIZE, &blocks) < 0)
-	{
-	  perror("could not ioctl(BLKGETSIZE)");
-	  return -1;
-	}
-      if((options&SRM_OPT_V) > 2)
-	error("BLKGETSIZE %i blocks", (int)blocks);
-
-      if(ioctl(srm.fd, BLKGETSIZE64, &u) < 0)
-	{
-	  perror("could not ioctl(BLKGETSIZE64)");
-	  return -1;
-	}
-      if((options&SRM_OPT_V) > 2)
-	error("BLKGETSIZE64 %llu bytes", (unsigned long long)u);
-
-      u_=((uint64_t)blocks)*secsize;
-      if(u_ != u)
-	  error("!Warning! sectorsize*blocks:%llu != bytes:%llu", (long long unsigned) u_, (long long unsigned) u);
-
-      srm.file_size = u;
-      srm.buffer_size = secsize;
-
-      if(srm.file_size == 0)
-	{
-	  close(srm.fd);
-	  if (srm.options & SRM_OPT_V)
-	    error("could not determine block device %s filesize", srm.file_name);
-	  errno = EIO;
-	  return -1;
-	}
-
-      if((options&SRM_OPT_V) > 1)
-	error("block device %s size: %llu bytes", srm.file_name, (unsigned long long)u);
-
-      if(overwrite_selector(&srm) < 0)
-	{
-	  int e=errno;
-	  if (srm.options & SRM_OPT_V)
-	    errorp("could not overwrite device %s", srm.file_name);
-	  close(srm.fd);
-	  errno=e;
-	  return -1;
-	}
-      close(srm.fd);
-      return 0;
-    }
+    return blockdev_remove(path, &statbuf, options);
 #endif
 
     if (!S_ISREG(statbuf.st_mode)) {
@@ -811,143 +1596,8 @@ next_ads:
     return rename_unlink(srm.file_name);
   }
 
-  if ( (srm.fd = open(srm.file_name, oflags)) < 0)
-    return -1;
-
-#if defined(__unix__) || defined(__APPLE__)
-  flock.l_type = F_WRLCK;
-  flock.l_whence = SEEK_SET;
-  flock.l_start = 0;
-  flock.l_len = 0;
-  if (fcntl(srm.fd, F_SETLK, &flock) < 0) {
-    int e=errno;
-    flock.l_type = F_WRLCK;
-    flock.l_whence = SEEK_SET;
-    flock.l_start = 0;
-    flock.l_len = 0;
-    flock.l_pid = 0;
-    if (fcntl(srm.fd, F_GETLK, &flock) == 0 && flock.l_pid > 0) {
-      error("can't unlink %s, locked by process %i", srm.file_name, flock.l_pid);
-    }
-    close(srm.fd);
-    errno=e;
-    return -1;
-  }
-#endif
-
-#if defined(HAVE_SYS_VFS_H) || (defined(HAVE_SYS_PARAM_H) && defined(HAVE_SYS_MOUNT_H))
-  {
-    struct statfs fs_stats;
-    if (fstatfs(srm.fd, &fs_stats) < 0 && errno != ENOSYS)
-      {
-	int e=errno;
-	close(srm.fd);
-	errno=e;
-	return -1;
-      }
-
-#if defined(__linux__)
-    srm.buffer_size = fs_stats.f_bsize;
-#elif defined(__FreeBSD__) || defined(__APPLE__)
-    srm.buffer_size = fs_stats.f_iosize;
-#else
-#error Please define your platform.
-#endif
-    if((srm.options & SRM_OPT_V) > 2)
-      error("buffer_size=%u", srm.buffer_size);
-
-#if defined(HAVE_LINUX_EXT2_FS_H) || defined(HAVE_LINUX_EXT3_FS_H)
-    if (fs_stats.f_type == EXT2_SUPER_MAGIC ) /* EXT2_SUPER_MAGIC and EXT3_SUPER_MAGIC are the same */
-      {
-	int flags = 0;
-
-	  if (ioctl(srm.fd, EXT2_IOC_GETFLAGS, &flags) < 0)
-	    {
-	      int e=errno;
-	      close(srm.fd);
-	      errno=e;
-	      return -1;
-	    }
-
-	  if ( (flags & EXT2_UNRM_FL) ||
-	       (flags & EXT2_IMMUTABLE_FL) ||
-	       (flags & EXT2_APPEND_FL) )
-	    {
-              if((srm.options & SRM_OPT_V) > 2) {
-                  error("%s has ext2 undelete, immutable or append-only flag", srm.file_name);
-              }
-	      close(srm.fd);
-	      errno = EPERM;
-	      return -1;
-	    }
-
-#ifdef HAVE_LINUX_EXT3_FS_H
-	  /* if we have the required capabilities we can disable data journaling on ext3 */
-	  if(fs_stats.f_type == EXT3_SUPER_MAGIC) /* superflous check again, just to make it clear again */
-	    {
-	      flags &= ~EXT3_JOURNAL_DATA_FL;
-	      if (ioctl(srm.fd, EXT3_IOC_SETFLAGS, flags) < 0) {
-                  if (srm.options & SRM_OPT_V)
-                      errorp("could not clear journal data flag for ext3 on %s", srm.file_name);
-	      }
-	    }
-#endif
-	}
-#endif /* HAVE_LINUX_EXT2_FS_H */
-  }
-#endif /* HAVE_SYS_VFS_H */
-
-/* chflags(2) turns out to be a different system call in every BSD
-   derivative. The important thing is to make sure we'll be able to
-   unlink it after we're through messing around. Unlinking it first
-   would remove the need for any of these checks, but would leave the
-   user with no way to overwrite the file if the process was
-   interupted during the overwriting. So, instead we assume that the
-   open() above will fail on immutable and append-only files and try
-   and catch only platforms supporting NOUNLINK here.
-
-   OpenBSD - doesn't support nounlink (As of 3.1)
-   FreeBSD - supports nounlink (from 4.4 on?)
-   Tru64   - unknown
-   MacOS X - doesn't support NOUNLINK (as of 10.3.5)
-*/
-
-#if defined(HAVE_CHFLAGS) && defined(__FreeBSD__)
-  if ((statbuf.st_flags & UF_IMMUTABLE) ||
-      (statbuf.st_flags & UF_APPEND) ||
-      (statbuf.st_flags & UF_NOUNLINK) ||
-      (statbuf.st_flags & SF_IMMUTABLE) ||
-      (statbuf.st_flags & SF_APPEND) ||
-      (statbuf.st_flags & SF_NOUNLINK))
-    {
-      if((srm.options & SRM_OPT_V) > 2) {
-          error("%s has ext2 nounlink, immutable or append-only flag", srm.file_name);
-      }
-      close(srm.fd);
-      errno = EPERM;
-      return -1;
-    }
-#endif /* HAVE_CHFLAGS */
-
-  /* check that the srm struct contains useful values */
-  if (srm.file_name == 0) {
-    error("internal error: srm.file_name is NULL");
-    close(srm.fd);
-    errno = ENOSYS;
-    return -1;
-  }
-  if (srm.file_size == 0) {
-    error("internal error: srm.file_size is 0");
-    close(srm.fd);
-    errno = ENOSYS;
-    return -1;
-  }
-  if (srm.buffer_size == 0) {
-    error("internal error: srm.buffer_size is 0");
-    close(srm.fd);
-    errno = ENOSYS;
+  if (sunlink_open(&srm, &statbuf, oflags) < 0)
     return -1;
-  }
 
   if(overwrite_selector(&srm) < 0)
     {
@@ -959,90 +1609,5 @@ next_ads:
       return -1;
     }
 
-#if defined(HAVE_LINUX_EXT2_FS_H) || defined(HAVE_LINUX_EXT3_FS_H)
-  ioctl(srm.fd, EXT2_IOC_SETFLAGS, EXT2_SECRM_FL);
-#endif
-
-  if (ftruncate(srm.fd, 0) < 0) {
-    int e=errno;
-    close(srm.fd);
-    errno=e;
-    return -1;
-  }
-
-  close(srm.fd);
-  srm.fd = -1;
-
-#ifdef __APPLE__
-  /* Also overwrite the file's resource fork, if present. */
-  {
-    struct srm_target rsrc = srm;
-    rsrc.file_name = (char *)alloca(strlen(srm.file_name) + sizeof(_PATH_RSRCFORKSPEC) + 1);
-    if (rsrc.file_name == NULL)
-      {
-	errno = ENOMEM;
-	goto rsrc_fork_failed;
-      }
-
-    if (snprintf((char*)rsrc.file_name, MAXPATHLEN, "%s" _PATH_RSRCFORKSPEC, srm.file_name) > MAXPATHLEN - 1)
-      {
-	errno = ENAMETOOLONG;
-	goto rsrc_fork_failed;
-      }
-
-    if (lstat(rsrc.file_name, &statbuf) != 0)
-      {
-	if (errno == ENOENT || errno == ENOTDIR) {
-	  rsrc.file_size = 0;
-	} else {
-	  goto rsrc_fork_failed;
-	}
-      }
-    else
-      {
-	rsrc.file_size = statbuf.st_size;
-      }
-
-    if (rsrc.file_size > 0)
-      {
-	if ((rsrc.fd = open(rsrc.file_name, oflags)) < 0) {
-	  goto rsrc_fork_failed;
-	}
-
-	flock.l_type = F_WRLCK;
-	flock.l_whence = SEEK_SET;
-	flock.l_start = 0;
-	flock.l_len = 0;
-	if (fcntl(rsrc.fd, F_SETLK, &flock) == -1)
-	  {
-	    close(rsrc.fd);
-	    goto rsrc_fork_failed;
-	  }
-
-	if (rsrc.options & SRM_OPT_V) {
-	  error("removing %s", rsrc.file_name);
-	}
-
-	if(overwrite_selector(&rsrc) < 0)
-	  {
-	    if (rsrc.options & SRM_OPT_V) {
-	      errorp("could not overwrite resource fork %s", rsrc.file_name);
-	    }
-	  }
-
-	ftruncate(rsrc.fd, 0);
-	close(rsrc.fd);
-      }
-    goto rsrc_fork_done;
-
-  rsrc_fork_failed:
-    if (rsrc.options & SRM_OPT_V) {
-      errorp("could not access resource fork %s", srm.file_name);
-    }
-
-  rsrc_fork_done: ;
-  }
-#endif /* __APPLE__ */
-
-  return rename_unlink(srm.file_name);
+  return sunlink_finish(&srm, oflags);
 }
@@ -0,0 +1,470 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+/* srm should not starve the other users of a disk. Every write goes
+   through throttle(), which takes its bytes and one operation out of
+   token buckets: one for the whole process and one per device, each
+   for bytes per second and for operations per second. A bucket may go
+   into debt; the thread that made it so sleeps until the debt is paid,
+   so all writer threads share the rate in the order they asked.
+
+   The limits come from --rate-limit and --device-rate-limit, or from a
+   --limit-file which is read again on SIGHUP.
+
+   With --pressure the limits adapt to the I/O pressure stall
+   information of the cgroup of srm, or of the whole system. Once a
+   second throttle() looks at the share of time in which tasks waited
+   for I/O. Above the target the bandwidth is halved to half of what
+   was written in the last second and the block device engine runs
+   fewer writers, see throttle_depth(). Below half the target both grow
+   again by a quarter per second until the bandwidth is no longer
+   limited. The stall counts srm's own waits as well, so the rate
+   settles where the pressure meets the target. */
+
+/* a bucket holds at most this many seconds of its rate */
+#define THROTTLE_BURST 0.1
+/* seconds between two looks at the pressure */
+#define PSI_INTERVAL 1.0
+/* the pressure limit goes no lower than this many bytes per second */
+#define PSI_MIN_RATE (1024.0 * 1024.0)
+/* and the queue depth no lower than this share */
+#define PSI_MIN_LEVEL (1.0 / 64)
+
+struct bucket
+{
+  double rate, tokens, last;
+};
+
+struct throttle_dev
+{
+  struct throttle_dev *next;
+  unsigned long long dev;
+  struct bucket bytes, ops;
+};
+
+/** limit of the whole process, bytes and operations per second, 0 for no limit */
+double throttle_rate = 0, throttle_ops = 0;
+/** limit of every device */
+double throttle_dev_rate = 0, throttle_dev_ops = 0;
+
+static const char *limit_file = NULL;
+static struct bucket total_bytes, total_ops;
+static struct throttle_dev *devs = NULL;
+static double slept = 0;
+/* --pressure: target share of stalled time, source, state of the controller */
+static double psi_target = 0;
+static char psi_file[512];
+static int psi_options = 0;
+static struct bucket psi_bytes;
+static double psi_rate = 0, psi_level = 1, psi_peak = 0, psi_last = 0, psi_written = 0;
+static unsigned long long psi_total = 0;
+static unsigned long psi_backoffs = 0;
+#if defined(SIGHUP)
+static volatile sig_atomic_t reload = 0;
+#endif
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+   parse BYTES[,OPS], BYTES with the suffixes of parse_size().
+   @return 0 upon success, negative if arg is invalid.
+*/
+int throttle_parse(const char *arg, double *rate, double *ops)
+{
+  const char *comma = strchr(arg, ',');
+  char buf[32];
+  my_off_t size;
+
+  if (!comma)
+    comma = arg + strlen(arg);
+  if ((size_t)(comma - arg) >= sizeof(buf))
+    return -1;
+  memcpy(buf, arg, comma - arg);
+  buf[comma - arg] = 0;
+  if (parse_size(buf, &size) < 0)
+    return -1;
+  *rate = (double)size;
+  *ops = 0;
+  if (*comma)
+    {
+      char *end;
+      *ops = strtod(comma + 1, &end);
+      if (end == comma + 1 || *end || *ops < 0)
+	return -1;
+    }
+  return 0;
+}
+
+/* must be called with throttle_lock held */
+static void limit_load(void)
+{
+  char line[128];
+  FILE *f;
+
+  if ((f = fopen(limit_file, "r")) == NULL)
+    {
+      errorp("could not read %s, keeping the limits", limit_file);
+      return;
+    }
+  while (fgets(line, sizeof(line), f))
+    {
+      double rate, ops;
+      char *value;
+      line[strcspn(line, "\r\n")] = 0;
+      if (line[0] == 0 || line[0] == '#')
+	continue;
+      if ((value = strchr(line, '=')) == NULL || throttle_parse(value + 1, &rate, &ops) < 0)
+	{
+	  error("%s: invalid line %s", limit_file, line);
+	  continue;
+	}
+      *value = 0;
+      if (!strcmp(line, "rate-limit"))
+	{
+	  throttle_rate = rate;
+	  throttle_ops = ops;
+	}
+      else if (!strcmp(line, "device-rate-limit"))
+	{
+	  throttle_dev_rate = rate;
+	  throttle_dev_ops = ops;
+	}
+      else
+	error("%s: unknown limit %s", limit_file, line);
+    }
+  fclose(f);
+}
+
+#if defined(SIGHUP)
+static void sighup_handler(int signo)
+{
+  (void)signo;
+  reload = 1;
+}
+#endif
+
+/**
+   read the limits from file now and again on every SIGHUP.
+   @return 0 upon success, negative if file can not be read.
+*/
+int throttle_file(const char *file)
+{
+  FILE *f;
+
+  if ((f = fopen(file, "r")) == NULL)
+    return -1;
+  fclose(f);
+  limit_file = file;
+  limit_load();
+#if defined(SIGHUP)
+  signal(SIGHUP, sighup_handler);
+#endif
+  return 0;
+}
+
+/**
+   set the I/O scheduling class of the process, inherited by the
+   threads it starts later: "idle" only gets the disk when nobody else uses it,
+   "best-effort[:LEVEL]" with LEVEL 0 (highest) to 7.
+   @return 0 upon success, negative upon error.
+*/
+int throttle_ionice(const char *arg)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  /* see linux/ioprio.h */
+  const int who_process = 1, class_shift = 13, class_be = 2, class_idle = 3;
+  int prio;
+
+  if (!strcmp(arg, "idle"))
+    prio = class_idle << class_shift;
+  else if (!strncmp(arg, "best-effort", 11) && (arg[11] == 0 || (arg[11] == ':' && arg[12] >= '0' && arg[12] <= '7' && arg[13] == 0)))
+    prio = class_be << class_shift | (arg[11] ? arg[12] - '0' : 4);
+  else
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  return syscall(SYS_ioprio_set, who_process, 0, prio) < 0 ? -1 : 0;
+#else
+  (void)arg;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/**
+   take amount out of bucket b at time now.
+   @return the time until b is out of debt.
+*/
+static double bucket_take(struct bucket *b, const double rate, const double amount, const double now)
+{
+  double burst;
+
+  if (rate <= 0)
+    return 0;
+  burst = rate * THROTTLE_BURST;
+  if (burst < amount)
+    burst = amount;
+  if (b->rate != rate || b->last == 0)
+    {
+      /* new or changed limit, start with a full bucket */
+      b->rate = rate;
+      b->tokens = burst;
+    }
+  else
+    {
+      b->tokens += (now - b->last) * rate;
+      if (b->tokens > burst)
+	b->tokens = burst;
+    }
+  b->last = now;
+  b->tokens -= amount;
+  return b->tokens < 0 ? -b->tokens / rate : 0;
+}
+
+/* must be called with throttle_lock held */
+static struct throttle_dev *throttle_dev(const unsigned long long dev)
+{
+  struct throttle_dev *d;
+
+  for (d = devs; d; d = d->next)
+    if (d->dev == dev)
+      return d;
+  if ((d = (struct throttle_dev*)calloc(1, sizeof(*d))) == NULL)
+    return NULL;
+  d->dev = dev;
+  d->next = devs;
+  devs = d;
+  return d;
+}
+
+/* the limits only change under throttle_lock after startup if there is a limit file */
+static int throttle_active(void)
+{
+  return limit_file || psi_target > 0 || throttle_rate > 0 || throttle_ops > 0
+    || throttle_dev_rate > 0 || throttle_dev_ops > 0;
+}
+
+/**
+   read the total stalled time in microseconds of the "some" line of
+   an io.pressure file.
+   @return 0 upon success, negative upon error.
+*/
+static int psi_read(const char *file, unsigned long long *total)
+{
+  char line[256];
+  FILE *f;
+  int ret = -1;
+
+  if ((f = fopen(file, "r")) == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f))
+    {
+      const char *t;
+      if (!strncmp(line, "some ", 5) && (t = strstr(line, "total=")) != NULL && sscanf(t + 6, "%llu", total) == 1)
+	{
+	  ret = 0;
+	  break;
+	}
+    }
+  fclose(f);
+  return ret;
+}
+
+/**
+   adapt the limits to a target of I/O pressure, see above.
+
+   @param target share of time, 0..1, in which tasks may be stalled on I/O
+   @param options SRM_OPT_* bits, -v reports, -vv every change
+   @return 0 upon success, negative if there is no pressure information.
+*/
+int throttle_pressure(const double target, const int options)
+{
+  char line[448];
+  FILE *f;
+
+  psi_file[0] = 0;
+  /* the cgroup v2 of srm, on the unified or the hybrid hierarchy */
+  if ((f = fopen("/proc/self/cgroup", "r")) != NULL)
+    {
+      while (fgets(line, sizeof(line), f))
+	if (!strncmp(line, "0::/", 4))
+	  {
+	    unsigned long long total;
+	    line[strcspn(line, "\n")] = 0;
+	    /* the root cgroup */
+	    if (!strcmp(line, "0::/"))
+	      line[3] = 0;
+	    snprintf(psi_file, sizeof(psi_file), "/sys/fs/cgroup%s/io.pressure", line + 3);
+	    if (psi_read(psi_file, &total) < 0)
+	      snprintf(psi_file, sizeof(psi_file), "/sys/fs/cgroup/unified%s/io.pressure", line + 3);
+	    if (psi_read(psi_file, &total) < 0)
+	      psi_file[0] = 0;
+	    break;
+	  }
+      fclose(f);
+    }
+  if (!psi_file[0])
+    snprintf(psi_file, sizeof(psi_file), "/proc/pressure/io");
+  if (psi_read(psi_file, &psi_total) < 0)
+    return -1;
+
+  psi_target = target;
+  psi_options = options;
+  psi_last = plan_clock();
+  if ((options & SRM_OPT_V) > 1)
+    error("pressure: %s, target %.1f%%", psi_file, target * 100);
+  return 0;
+}
+
+/* must be called with throttle_lock held */
+static void psi_update(const double now)
+{
+  unsigned long long total;
+  double stall, rate;
+
+  if (now - psi_last < PSI_INTERVAL || psi_read(psi_file, &total) < 0)
+    return;
+  stall = (double)(total - psi_total) / 1e6 / (now - psi_last);
+  rate = psi_written / (now - psi_last);
+  psi_total = total;
+  psi_last = now;
+  psi_written = 0;
+  if (psi_rate == 0 && rate > psi_peak)
+    psi_peak = rate;
+
+  if (stall > psi_target)
+    {
+      psi_rate = rate / 2 > PSI_MIN_RATE ? rate / 2 : PSI_MIN_RATE;
+      psi_level = psi_level / 2 > PSI_MIN_LEVEL ? psi_level / 2 : PSI_MIN_LEVEL;
+      ++psi_backoffs;
+    }
+  else if (stall < psi_target / 2 && (psi_rate > 0 || psi_level < 1))
+    {
+      psi_level = psi_level * 1.25 < 1 ? psi_level * 1.25 : 1;
+      psi_rate *= 1.25;
+      /* no longer below what srm wrote without a limit */
+      if (psi_rate > psi_peak)
+	psi_rate = 0;
+    }
+  else
+    return;
+
+  if ((psi_options & SRM_OPT_V) > 1)
+    error("pressure %.1f%%, %.1f MiB/s: limit %.1f MiB/s, queue depth %.0f%%",
+	  stall * 100, rate / (1024 * 1024), psi_rate / (1024 * 1024), psi_level * 100);
+}
+
+/**
+   @return the number of writers to run instead of depth, fewer when
+   the I/O pressure is above the --pressure target.
+*/
+unsigned throttle_depth(const unsigned depth)
+{
+  unsigned d;
+
+  if (psi_target <= 0)
+    return depth;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&throttle_lock);
+#endif
+  d = (unsigned)(depth * psi_level + 0.5);
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&throttle_lock);
+#endif
+  return d > 0 ? d : 1;
+}
+
+/**
+   account for a write of bytes to the device of fs and wait if it
+   goes over a limit.
+*/
+void throttle(const struct srm_fs_info *fs, const size_t bytes)
+{
+  double wait, w, now;
+
+  if (!throttle_active())
+    return;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&throttle_lock);
+#endif
+#if defined(SIGHUP)
+  if (reload && limit_file)
+    {
+      reload = 0;
+      limit_load();
+    }
+#endif
+  now = plan_clock();
+  wait = bucket_take(&total_bytes, throttle_rate, (double)bytes, now);
+  if (psi_target > 0)
+    {
+      psi_update(now);
+      psi_written += bytes;
+      if ((w = bucket_take(&psi_bytes, psi_rate, (double)bytes, now)) > wait)
+	wait = w;
+    }
+  if ((w = bucket_take(&total_ops, throttle_ops, 1, now)) > wait)
+    wait = w;
+  if (fs && (throttle_dev_rate > 0 || throttle_dev_ops > 0))
+    {
+      struct throttle_dev *d = throttle_dev(fs->dev);
+      if (d && (w = bucket_take(&d->bytes, throttle_dev_rate, (double)bytes, now)) > wait)
+	wait = w;
+      if (d && (w = bucket_take(&d->ops, throttle_dev_ops, 1, now)) > wait)
+	wait = w;
+    }
+  slept += wait;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&throttle_lock);
+#endif
+
+  if (wait > 0)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+      struct timespec ts;
+      ts.tv_sec = (time_t)wait;
+      ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+      while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	;
+#endif
+    }
+}
+
+/**
+   print how long the writers waited for the limits, for -v.
+*/
+void throttle_report(const int options)
+{
+  if ((options & SRM_OPT_V) && slept > 0)
+    error("rate limit: writers waited %.2fs", slept);
+  if ((options & SRM_OPT_V) && psi_target > 0)
+    error("pressure: backed off %lu times, limit at the end %s%.1f MiB/s", psi_backoffs,
+	  psi_rate > 0 ? "" : "none, peak ", (psi_rate > 0 ? psi_rate : psi_peak) / (1024 * 1024));
+}
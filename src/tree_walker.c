@@ -44,6 +44,10 @@
 #include <fts.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "srm.h"
 #include "impl.h"
 
@@ -54,9 +58,18 @@
 static int prompt_user(const char *msg, const char *arg)
 {
   char inbuf[8];
+  int ret;
+#ifdef HAVE_PTHREAD_H
+  /* the threads of parallel_walker() ask one at a time */
+  static pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&prompt_lock);
+#endif
   printf(msg, arg); fflush(stdout);
-  if(fgets(inbuf, sizeof(inbuf), stdin) == 0) return 0;
-  return inbuf[0]=='y' || inbuf[0]=='Y';
+  ret = fgets(inbuf, sizeof(inbuf), stdin) != 0 && (inbuf[0]=='y' || inbuf[0]=='Y');
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&prompt_lock);
+#endif
+  return ret;
 }
 
 /**
@@ -156,11 +169,15 @@ static int prompt_file(const char *path, const int options)
 /**
  * callback function for FTS/FTW.
  * @param flag FTS/FTW flag.
+ * @param node for FTS_DP the node of the directory itself, otherwise
+ * the node of the directory containing path. May be NULL.
  * @param options bitfield of SRM_OPT_* bits
  * @return true if the file was removed; false otherwise.
  */
-int process_file(char *path, const int flag, const int options)
+int process_file(char *path, const int flag, struct walk_node *node, const int options)
 {
+  int file_options;
+
   if(!path) return 0;
 
   while (path[strlen(path) - 1] == SRM_DIRSEP)
@@ -176,12 +193,14 @@ int process_file(char *path, const int flag, const int options)
 #ifdef FTS_DC
   case FTS_DC:
     error("cyclic directory entry %s", path);
+    walk_node_fail(node);
     return 0;
 #endif
 
 #ifdef FTS_DNR
   case FTS_DNR:
     error("%s: permission denied", path);
+    walk_node_fail(node);
     return 0;
 #endif
 
@@ -192,10 +211,24 @@ int process_file(char *path, const int flag, const int options)
 
 #ifdef FTS_DP
   case FTS_DP:
+    if ((options & SRM_OPT_R) && plan_format != PLAN_OFF) {
+      if (plan_file(path, options) < 0)
+	errorp("could not stat %s", path);
+      walk_node_keep(node);
+      walk_node_release(node, 0);
+      return 1;
+    }
     if (options & SRM_OPT_R) {
       if (! prompt_file(path, options)) {
+	walk_node_keep(node);
+	walk_node_release(node, 0);
 	return 0;
       }
+      /* the directory is removed once its last entry is gone */
+      if (node) {
+	walk_node_release(node, 0);
+	return 1;
+      }
       if (rename_unlink(path) < 0) {
 	errorp("unable to remove %s", path);
 	return 0;
@@ -210,14 +243,12 @@ int process_file(char *path, const int flag, const int options)
 #ifdef FTS_ERR
   case FTS_ERR:
     error("fts error on %s", path);
+    walk_node_fail(node);
     return 0;
 #endif
 
 #ifdef FTS_NS
   case FTS_NS:
-#endif
-#ifdef FTS_NSOK
-  case FTS_NSOK:
 #endif
     /* if we have 32bit system and file is >2GiB the fts functions can not stat them, so we just ignore the fts error. */
 #ifndef LARGE_FILES_ARE_ENABLED
@@ -225,11 +256,18 @@ int process_file(char *path, const int flag, const int options)
     if ( !(options & SRM_OPT_F) )
       {
 	error("unable to stat %s", path);
+	walk_node_fail(node);
 	return 0;
       }
 #endif
     /* no break here */
 
+#ifdef FTS_NSOK
+  case FTS_NSOK:
+    /* not stat()ed with FTS_NOSTAT, nothing below needs it: the
+       directories are still reported as FTS_D and everything else is
+       stat()ed once it is removed */
+#endif
 #ifdef FTS_DEFAULT
   case FTS_DEFAULT:
 #endif
@@ -242,10 +280,41 @@ int process_file(char *path, const int flag, const int options)
 #ifdef FTS_SLNONE
   case FTS_SLNONE:
 #endif
+    /* the --policy rule of the file selects its mode */
+    file_options = policy_apply(path, options);
+    if (plan_format != PLAN_OFF) {
+      /* --plan only counts, the directory stays */
+      walk_node_keep(node);
+      if (plan_file(path, file_options) < 0) {
+	errorp("could not stat %s", path);
+	return 0;
+      }
+      return 1;
+    }
     if (! prompt_file(path, options)) {
+      walk_node_fail(node);
       return 0;
     }
-    if (sunlink(path, options) < 0) {
+    /* overwritten by an interrupted run, only the unlink is missing */
+    if (journal_completed(path)) {
+      if (rename_unlink(path) < 0) {
+	errorp("unable to remove %s", path);
+	walk_node_fail(node);
+	return 0;
+      }
+      return 1;
+    }
+    /* the pipeline and the batch release node once the file is gone */
+    if (pipeline_active() && pipeline_submit(path, node, file_options)) {
+      return 1;
+    }
+    if (!(file_options & SRM_OPT_NO_BATCH) && batch_add(path, node, file_options)) {
+      return 1;
+    }
+    if (order_add(path, node, file_options)) {
+      return 1;
+    }
+    if (sunlink(path, file_options) < 0) {
       if (errno == EMLINK) {
 	if (options & SRM_OPT_V) {
 	  error("%s has multiple links, this one has been unlinked but not overwritten", path);
@@ -253,12 +322,14 @@ int process_file(char *path, const int flag, const int options)
 	return 1;
       }
       errorp("unable to remove %s", path);
+      walk_node_fail(node);
       return 0;
     }
     return 1;
 
   default:
     error("unknown fts flag: %i", flag);
+    walk_node_fail(node);
   }
   return 0;
 }
@@ -273,33 +344,78 @@ int tree_walker(char **trees, const int options)
 {
   FTSENT *current_file=0;
   FTS *stream=0;
-  int i = 0, opt = FTS_PHYSICAL | FTS_NOCHDIR, ret = 0;
+  int opt = FTS_PHYSICAL | FTS_NOCHDIR, ret = 0;
+  unsigned i = 0;
+  char *tree, *one_tree[2];
 
   if(!trees) return +1;
 
-  /* remove trailing slashes free trees */
-  while (trees[i] != NULL) {
-    while (trees[i][strlen(trees[i]) - 1] == SRM_DIRSEP)
-      trees[i][strlen(trees[i]) -1] = '\0';
-    i++;
-  }
-
   if(options & SRM_OPT_X)
     opt |= FTS_XDEV;
-
-  if ( (stream = fts_open(trees, opt, NULL)) == NULL ) {
-    errorp("fts_open() returned NULL");
-    return +2;
-  } else {
+  /* with only name predicates fts need not stat the entries that
+     filter_name() drops, the others are stat()ed when they are removed */
+  if (filter_active() && !filter_needs_stat())
+    opt |= FTS_NOSTAT;
+
+  (void)pipeline_start(options);
+  /* one tree at a time, the --files-from list is read while the trees are removed */
+  while ((tree = next_tree(trees, &i)) != NULL) {
+    /* remove trailing slashes */
+    while (strlen(tree) > 1 && tree[strlen(tree) - 1] == SRM_DIRSEP)
+      tree[strlen(tree) -1] = '\0';
+    one_tree[0] = tree;
+    one_tree[1] = NULL;
+
+    if ( (stream = fts_open(one_tree, opt, NULL)) == NULL ) {
+      errorp("fts_open() returned NULL");
+      ret = +2;
+      break;
+    }
     while ( (current_file = fts_read(stream)) != NULL) {
-      if (! process_file(current_file->fts_path, current_file->fts_info, options)) {
-	ret = 1;
+      struct walk_node *node = NULL;
+      if (options & SRM_OPT_R) {
+	struct walk_node *parent = NULL;
+	if (current_file->fts_level > FTS_ROOTLEVEL)
+	  parent = (struct walk_node*)current_file->fts_parent->fts_pointer;
+	if (current_file->fts_info == FTS_D) {
+	  if (current_file->fts_level > FTS_ROOTLEVEL && !filter_name(current_file->fts_name, 1)) {
+	    /* excluded, fts returns it once more as FTS_DP without entering it */
+	    current_file->fts_number = 1;
+	    walk_node_keep(parent);
+	    fts_set(stream, current_file, FTS_SKIP);
+	    continue;
+	  }
+	  current_file->fts_pointer = walk_node_new(parent, current_file->fts_path);
+	}
+	if (current_file->fts_info == FTS_DP && current_file->fts_number)
+	  continue;
+	node = current_file->fts_info == FTS_DP ? (struct walk_node*)current_file->fts_pointer : parent;
+      }
+      if (filter_active() && current_file->fts_info != FTS_D && current_file->fts_info != FTS_DP
+	  && current_file->fts_info != FTS_DNR && current_file->fts_info != FTS_DC
+	  && (!filter_name(current_file->fts_name, 0)
+	      || (current_file->fts_info != FTS_NS && current_file->fts_info != FTS_NSOK
+		  && !filter_stat(current_file->fts_statp)))) {
+	walk_node_keep(node);
+	continue;
+      }
+      if (! process_file(current_file->fts_path, current_file->fts_info, node, options)) {
+	if (ret == 0)
+	  ret = 1;
       }
       if ( !(options & SRM_OPT_R) )
 	fts_set(stream, current_file, FTS_SKIP);
     }
     fts_close(stream);
   }
+  if (pipeline_finish(options) > 0)
+    ret = 1;
+  if (batch_flush(options) > 0)
+    ret = 1;
+  if (order_flush(options) > 0)
+    ret = 1;
+  if (walk_node_failures() > 0)
+    ret = 1;
   return ret;
 }
 
@@ -315,18 +431,59 @@ int tree_walker(char **trees, const int options)
 
 static int ftw_options;
 static int ftw_ret;
+/* walk_node of the directories above the current entry, indexed by level */
+static struct walk_node **ftw_nodes = NULL;
+static int ftw_nodes_size = 0;
+
+/**
+ * nftw only reports a directory after its entries, so the node of a
+ * directory is created when its first entry is seen.
+ * @param path the directory is the first len characters of path
+ * @return the node of the directory at level, NULL if it could not be created.
+ */
+static struct walk_node *ftw_node(const char *path, size_t len, const int level)
+{
+  char *dir;
+  size_t parent_len;
+
+  if (level < 0)
+    return NULL;
+  if (level >= ftw_nodes_size)
+    {
+      int n = level + 16;
+      struct walk_node **nodes = (struct walk_node**)realloc(ftw_nodes, n * sizeof(*nodes));
+      if (!nodes)
+	return NULL;
+      memset(nodes + ftw_nodes_size, 0, (n - ftw_nodes_size) * sizeof(*nodes));
+      ftw_nodes = nodes;
+      ftw_nodes_size = n;
+    }
+  if (ftw_nodes[level])
+    return ftw_nodes[level];
+
+  if ((dir = (char*)malloc(len + 1)) == NULL)
+    return NULL;
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+  for (parent_len = len; parent_len > 0 && dir[parent_len - 1] != SRM_DIRSEP; parent_len--)
+    ;
+  ftw_nodes[level] = walk_node_new(level > 0 && parent_len > 0 ? ftw_node(dir, parent_len - 1, level - 1) : NULL, dir);
+  /* nftw can not skip the entries of an excluded directory, they are dropped one by one */
+  if (level > 0 && !filter_name(dir + parent_len, 1))
+    walk_node_prune(ftw_nodes[level]);
+  free(dir);
+  return ftw_nodes[level];
+}
 
 /**
  * @return true if walking the FTS tree should continue; false otherwise.
  */
-static int ftw_process_path(const char *opath, const struct stat* statbuf, int flag, struct FTW* dummy)
+static int ftw_process_path(const char *opath, const struct stat* statbuf, int flag, struct FTW* ftw)
 {
   size_t path_size;
   char *path;
   int ret = 0;
-
-  (void)statbuf;
-  (void)dummy;
+  struct walk_node *node = NULL;
 
   if(!opath) return 0;
 
@@ -339,27 +496,50 @@ static int ftw_process_path(const char *opath, const struct stat* statbuf, int f
   }
   strncpy(path, opath, path_size);
 
+  if (ftw_options & SRM_OPT_R) {
+    if (flag == FTW_DP) {
+      node = ftw_node(path, path_size - 1, ftw->level);
+      if (ftw->level < ftw_nodes_size)
+	ftw_nodes[ftw->level] = NULL;
+    } else if (ftw->level > 0 && ftw->base > 0) {
+      node = ftw_node(path, ftw->base - 1, ftw->level - 1);
+    }
+  }
+
+  if (filter_active()) {
+    if (walk_node_pruned(node)) {
+      if (flag == FTW_DP)
+	walk_node_release(node, 0);
+      return 0;
+    }
+    if (flag != FTW_D && flag != FTW_DP && flag != FTW_DNR
+	&& (!filter_name(path + ftw->base, 0) || (flag != FTW_NS && !filter_stat(statbuf)))) {
+      walk_node_keep(node);
+      return 0;
+    }
+  }
+
   switch (flag) {
   case FTW_F:
-    ret = process_file(path, FTS_F, ftw_options);
+    ret = process_file(path, FTS_F, node, ftw_options);
     break;
   case FTW_SL:
-    ret = process_file(path, FTS_SL, ftw_options);
+    ret = process_file(path, FTS_SL, node, ftw_options);
     break;
   case FTW_SLN:
-    ret = process_file(path, FTS_SLNONE, ftw_options);
+    ret = process_file(path, FTS_SLNONE, node, ftw_options);
     break;
   case FTW_D:
-    ret = process_file(path, FTS_D, ftw_options);
+    ret = process_file(path, FTS_D, node, ftw_options);
     break;
   case FTW_DP:
-    ret = process_file(path, FTS_DP, ftw_options);
+    ret = process_file(path, FTS_DP, node, ftw_options);
     break;
   case FTW_DNR:
-    ret = process_file(path, FTS_DNR, ftw_options);
+    ret = process_file(path, FTS_DNR, node, ftw_options);
     break;
   case FTW_NS:
-    ret = process_file(path, FTS_NS, ftw_options);
+    ret = process_file(path, FTS_NS, node, ftw_options);
     break;
   default:
     error("unknown nftw flag: %i", flag);
@@ -376,8 +556,9 @@ static int ftw_process_path(const char *opath, const struct stat* statbuf, int f
  */
 int tree_walker(char **trees, const int options)
 {
-  int i = 0;
+  unsigned i = 0;
   int opt = 0;
+  char *tree;
 
   if(!trees) return +2;
   ftw_options = options;
@@ -388,15 +569,26 @@ int tree_walker(char **trees, const int options)
   if(ftw_options & SRM_OPT_R)
     opt |= FTW_DEPTH|FTW_PHYS;
 
-  while (trees[i] != NULL)
+  (void)pipeline_start(options);
+  while ((tree = next_tree(trees, &i)) != NULL)
     {
       /* remove trailing slashes */
-      while (trees[i][strlen(trees[i]) - 1] == SRM_DIRSEP)
-	trees[i][strlen(trees[i]) -1] = '\0';
+      while (strlen(tree) > 1 && tree[strlen(tree) - 1] == SRM_DIRSEP)
+	tree[strlen(tree) -1] = '\0';
 
-      nftw(trees[i], ftw_process_path, 10, opt);
-      ++i;
+      nftw(tree, ftw_process_path, 10, opt);
     }
+  if (pipeline_finish(options) > 0)
+    ftw_ret = +1;
+  if (batch_flush(options) > 0)
+    ftw_ret = +1;
+  if (order_flush(options) > 0)
+    ftw_ret = +1;
+  if (walk_node_failures() > 0)
+    ftw_ret = +1;
+  free(ftw_nodes);
+  ftw_nodes = NULL;
+  ftw_nodes_size = 0;
   return ftw_ret;
 }
 
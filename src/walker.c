@@ -0,0 +1,720 @@
+/* this file is part of srm http://srm.sourceforge.net/
+   It is licensed under the MIT/X11 license */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(HAVE_FTS_OPEN) && !defined(__linux__)
+/* process_file() expects the FTS_* flags of tree_walker.c */
+#include <fts.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "srm.h"
+#include "impl.h"
+
+/* fts and nftw read one directory after the other. On network file
+   systems, or when the inodes are not cached, waiting for readdir()
+   and lstat() takes longer than overwriting the files. The parallel
+   walker scans several directories at once: every thread takes a
+   directory from the work queue, removes the files it finds right
+   away (or submits them to the pipeline) and puts the subdirectories
+   back into the queue. Directories are removed as soon as their last
+   entry is gone, see walk_node_release(). */
+
+/** number of threads scanning directories, 0 uses fts/nftw. */
+unsigned walk_threads = 0;
+
+/* A directory can be removed once all its entries are gone. With the
+   pipeline or the parallel walker the entries are removed by other
+   threads, so each directory gets a walk_node which counts the
+   references to it: one for the walker until it has seen every entry,
+   one for each entry that is still being removed elsewhere and one
+   for each subdirectory. Whoever drops the last reference removes the
+   directory, and then drops the reference it held on its parent. A
+   directory which lost an entry is kept without touching the disk,
+   which replaces the readdir() check of rename_unlink(). */
+
+#if defined(__GNUC__)
+#define ATOMIC_INC(p) __sync_add_and_fetch(p, 1)
+#define ATOMIC_DEC(p) __sync_sub_and_fetch(p, 1)
+#elif defined(HAVE_PTHREAD_H)
+static pthread_mutex_t atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+static int atomic_add(int *p, const int n)
+{
+  int v;
+  pthread_mutex_lock(&atomic_lock);
+  v = *p += n;
+  pthread_mutex_unlock(&atomic_lock);
+  return v;
+}
+#define ATOMIC_INC(p) atomic_add(p, 1)
+#define ATOMIC_DEC(p) atomic_add(p, -1)
+#else
+#define ATOMIC_INC(p) (++*(p))
+#define ATOMIC_DEC(p) (--*(p))
+#endif
+
+/** upper limit for the memory of the directory records in bytes, 0 for no limit. */
+unsigned long walk_memory_limit = 0;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+#define WALK_LOCK() pthread_mutex_lock(&walk_lock)
+#define WALK_UNLOCK() pthread_mutex_unlock(&walk_lock)
+#else
+#define WALK_LOCK()
+#define WALK_UNLOCK()
+#endif
+
+/* The records live in chunks which are filled front to back, there is
+   no malloc() per directory. A chunk is freed once all of its records
+   are released. Only the name of a directory is stored, its path is
+   put together from the parents when it is needed. */
+#define WALK_CHUNK_SIZE 65536
+
+struct walk_chunk
+{
+  size_t size, used;
+  unsigned live;
+};
+
+struct walk_node
+{
+  struct walk_node *parent;
+  /* work queue of the parallel walker */
+  struct walk_node *next;
+  struct walk_chunk *chunk;
+  int refs;
+  /* an entry could not be removed, report the directory as not empty */
+  unsigned char failed;
+  /* the directory is kept on purpose, e.g. the user declined or an entry was filtered */
+  unsigned char keep;
+  /* excluded by --exclude, nothing below it is removed */
+  unsigned char pruned;
+  /* length of name, the full path for a tree root */
+  unsigned name_len;
+  char name[1];
+};
+
+static struct walk_chunk *arena_chunk = NULL;
+static unsigned long arena_bytes = 0, arena_peak = 0, arena_records = 0;
+static int walk_node_failed = 0;
+
+/**
+   @return true if the directory records use more memory than walk_memory_limit.
+*/
+static int walk_over_limit(void)
+{
+  return walk_memory_limit > 0 && arena_bytes >= walk_memory_limit;
+}
+
+/**
+   take size bytes for a record from the current chunk.
+*/
+static struct walk_node *arena_alloc(size_t size)
+{
+  struct walk_node *node;
+  struct walk_chunk *chunk;
+  const size_t header = (sizeof(struct walk_chunk) + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+  WALK_LOCK();
+  if ((chunk = arena_chunk) == NULL || chunk->used + size > chunk->size)
+    {
+      size_t chunk_size = header + size > WALK_CHUNK_SIZE ? header + size : WALK_CHUNK_SIZE;
+      if ((chunk = (struct walk_chunk*)malloc(chunk_size)) == NULL)
+	{
+	  WALK_UNLOCK();
+	  return NULL;
+	}
+      chunk->size = chunk_size;
+      chunk->used = header;
+      chunk->live = 0;
+      /* the old chunk is freed with its last record */
+      if (arena_chunk && arena_chunk->live == 0)
+	{
+	  arena_bytes -= arena_chunk->size;
+	  free(arena_chunk);
+	}
+      arena_chunk = chunk;
+      arena_bytes += chunk_size;
+      if (arena_bytes > arena_peak)
+	arena_peak = arena_bytes;
+    }
+  node = (struct walk_node*)((char*)chunk + chunk->used);
+  chunk->used += size;
+  ++chunk->live;
+  ++arena_records;
+  WALK_UNLOCK();
+
+  node->chunk = chunk;
+  return node;
+}
+
+static void arena_free(struct walk_node *node)
+{
+  struct walk_chunk *chunk = node->chunk;
+
+  WALK_LOCK();
+  if (--chunk->live == 0 && chunk != arena_chunk)
+    {
+      arena_bytes -= chunk->size;
+      free(chunk);
+#ifdef HAVE_PTHREAD_H
+      /* walkers waiting for memory may continue */
+      if (walk_memory_limit > 0)
+	pthread_cond_broadcast(&walk_cond);
+#endif
+    }
+  WALK_UNLOCK();
+}
+
+/**
+   @return the path of node in a buffer allocated with malloc(), or NULL.
+*/
+static char *walk_node_path(const struct walk_node *node)
+{
+  const struct walk_node *n;
+  size_t len = node->name_len;
+  char *path;
+
+  for (n = node->parent; n; n = n->parent)
+    len += n->name_len + 1;
+  if ((path = (char*)malloc(len + 1)) == NULL)
+    return NULL;
+  path[len] = '\0';
+  for (n = node; n; n = n->parent)
+    {
+      len -= n->name_len;
+      memcpy(path + len, n->name, n->name_len);
+      if (len > 0)
+	path[--len] = SRM_DIRSEP;
+    }
+  return path;
+}
+
+/**
+   create the node of directory path, holding a reference on parent.
+   If there is not enough memory, parent is marked as failed.
+   @return the node with one reference for the caller, or NULL.
+*/
+struct walk_node *walk_node_new(struct walk_node *parent, const char *path)
+{
+  struct walk_node *node;
+  const char *name = path;
+  size_t len;
+
+  if (parent)
+    {
+      const char *p = strrchr(path, SRM_DIRSEP);
+      if (p)
+	name = p + 1;
+    }
+  len = strlen(name);
+
+  if ((node = arena_alloc(sizeof(*node) + len)) == NULL)
+    {
+      errorp("could not allocate memory for %s", path);
+      walk_node_fail(parent);
+      return NULL;
+    }
+  node->parent = parent;
+  node->next = NULL;
+  node->refs = 1;
+  node->failed = 0;
+  node->keep = 0;
+  node->pruned = parent ? parent->pruned : 0;
+  if (node->pruned)
+    node->keep = 1;
+  node->name_len = (unsigned)len;
+  memcpy(node->name, name, len + 1);
+  walk_node_hold(parent);
+  return node;
+}
+
+/**
+   add a reference for an entry of node which is removed asynchronously.
+*/
+void walk_node_hold(struct walk_node *node)
+{
+  if (node)
+    (void)ATOMIC_INC(&node->refs);
+}
+
+/**
+   an entry of node could not be removed, so node can not be removed either.
+*/
+void walk_node_fail(struct walk_node *node)
+{
+  if (node)
+    node->failed = 1;
+}
+
+/**
+   node should not be removed, without reporting an error for it.
+*/
+void walk_node_keep(struct walk_node *node)
+{
+  if (node)
+    node->keep = 1;
+}
+
+/**
+   node was excluded, it is kept together with everything below it.
+*/
+void walk_node_prune(struct walk_node *node)
+{
+  if (node)
+    node->pruned = node->keep = 1;
+}
+
+/**
+   @return true if node or one of its parents was excluded.
+*/
+int walk_node_pruned(const struct walk_node *node)
+{
+  return node && node->pruned;
+}
+
+/**
+   drop a reference on node. The last reference removes the directory
+   and drops the reference on its parent. A kept directory keeps its
+   parent as well, a failed one makes its parent fail.
+   @param failed true if the entry the reference was held for could not be removed
+*/
+void walk_node_release(struct walk_node *node, const int failed)
+{
+  int f = failed;
+
+  while (node)
+    {
+      struct walk_node *parent = node->parent;
+      char *path;
+
+      if (f)
+	node->failed = 1;
+      /* the decrement is a full barrier, so the last owner sees every failed flag */
+      if (ATOMIC_DEC(&node->refs) > 0)
+	return;
+
+      f = 1;
+      if (!node->failed && node->keep)
+	{
+	  f = 0;
+	  walk_node_keep(parent);
+	}
+      else if ((path = walk_node_path(node)) == NULL)
+	{
+	  errorp("could not allocate memory");
+	  (void)ATOMIC_INC(&walk_node_failed);
+	}
+      else
+	{
+	  if (node->failed)
+	    {
+	      errno = ENOTEMPTY;
+	      errorp("unable to remove %s", path);
+	      (void)ATOMIC_INC(&walk_node_failed);
+	    }
+	  else if (rename_unlink_dir(path) < 0)
+	    {
+	      errorp("unable to remove %s", path);
+	      (void)ATOMIC_INC(&walk_node_failed);
+	    }
+	  else
+	    f = 0;
+	  free(path);
+	}
+      arena_free(node);
+      node = parent;
+    }
+}
+
+/**
+   @return the number of directories that could not be removed.
+*/
+int walk_node_failures(void)
+{
+  return walk_node_failed;
+}
+
+/**
+   print the memory used by the walk.
+*/
+static void walk_report(const int options)
+{
+  if (!(options & SRM_OPT_V))
+    return;
+  error("directory records: %lu, peak memory %lu KiB", arena_records, (arena_peak + 1023) / 1024);
+#if defined(__unix__) || defined(__APPLE__)
+  {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+#if defined(__APPLE__)
+      error("peak resident memory %ld KiB", (long)usage.ru_maxrss / 1024);
+#else
+      error("peak resident memory %ld KiB", (long)usage.ru_maxrss);
+#endif
+  }
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static struct walk_node *queue_head = NULL, *queue_tail = NULL;
+/* threads currently scanning a directory */
+static unsigned busy = 0;
+static unsigned long num_dirs = 0, num_entries = 0;
+static int walk_ret = 0;
+/* set while the main thread may still add trees */
+static int trees_open = 0;
+
+/**
+   queue directory path for scanning.
+   @return 0 upon success, negative upon error.
+*/
+static int add_dir(struct walk_node *parent, const char *path)
+{
+  struct walk_node *node;
+
+  if ((node = walk_node_new(parent, path)) == NULL)
+    return -1;
+
+  pthread_mutex_lock(&walk_lock);
+  if (walk_over_limit())
+    {
+      /* depth first: finishing the deepest directories frees their records soonest */
+      if ((node->next = queue_head) == NULL)
+	queue_tail = node;
+      queue_head = node;
+    }
+  else
+    {
+      if (queue_tail)
+	queue_tail->next = node;
+      else
+	queue_head = node;
+      queue_tail = node;
+    }
+  ++num_dirs;
+  pthread_cond_signal(&walk_cond);
+  pthread_mutex_unlock(&walk_lock);
+  return 0;
+}
+
+static void walk_failed(void)
+{
+  pthread_mutex_lock(&walk_lock);
+  walk_ret = 1;
+  pthread_mutex_unlock(&walk_lock);
+}
+
+/**
+   read the entries of the directory of node. Files are removed,
+   subdirectories are queued. The directory itself is removed by
+   whoever finishes its last entry.
+*/
+static void scan_dir(struct walk_node *node, const int options)
+{
+  DIR *dp;
+  struct dirent *de;
+  struct stat statbuf;
+  char *path;
+  size_t dir_len, path_size;
+  unsigned long entries = 0;
+  dev_t dev = 0;
+
+  if ((path = walk_node_path(node)) == NULL)
+    {
+      errorp("could not allocate memory");
+      walk_failed();
+      walk_node_release(node, 1);
+      return;
+    }
+  dir_len = strlen(path);
+  path_size = dir_len + 1;
+
+  if ((dp = opendir(path)) == NULL)
+    {
+      (void)process_file(path, FTS_DNR, NULL, options);
+      free(path);
+      walk_failed();
+      walk_node_keep(node);
+      walk_node_fail(node->parent);
+      walk_node_release(node, 0);
+      return;
+    }
+  /* subdirectories on other file systems are left alone */
+  if ((options & SRM_OPT_X) && fstat(dirfd(dp), &statbuf) == 0)
+    dev = statbuf.st_dev;
+
+  while ((de = readdir(dp)) != NULL)
+    {
+      size_t name_len;
+      int is_dir = 1, known = 0;
+
+      if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	continue;
+      ++entries;
+
+      name_len = strlen(de->d_name);
+      if (dir_len + name_len + 2 > path_size)
+	{
+	  char *p;
+	  path_size = dir_len + name_len + 256;
+	  if ((p = (char*)realloc(path, path_size)) == NULL)
+	    {
+	      errorp("could not allocate memory");
+	      walk_failed();
+	      walk_node_fail(node);
+	      break;
+	    }
+	  path = p;
+	}
+      path[dir_len] = SRM_DIRSEP;
+      memcpy(path + dir_len + 1, de->d_name, name_len + 1);
+
+#ifdef DT_DIR
+      if (de->d_type != DT_UNKNOWN)
+	{
+	  known = 1;
+	  is_dir = de->d_type == DT_DIR;
+	}
+#endif
+      /* names are filtered before the inode is read */
+      if (known && !filter_name(de->d_name, is_dir))
+	{
+	  walk_node_keep(node);
+	  continue;
+	}
+      /* only directories need a stat of their own, sunlink() checks the rest */
+      if (!known || is_dir || filter_needs_stat())
+	{
+	  if (lstat(path, &statbuf) < 0)
+	    {
+	      if (! process_file(path, FTS_NS, node, options))
+		walk_failed();
+	      continue;
+	    }
+	  is_dir = S_ISDIR(statbuf.st_mode);
+	  if ((!known && !filter_name(de->d_name, is_dir)) || !filter_stat(&statbuf))
+	    {
+	      walk_node_keep(node);
+	      continue;
+	    }
+	}
+
+      if (!is_dir)
+	{
+	  if (! process_file(path, FTS_F, node, options))
+	    walk_failed();
+	  continue;
+	}
+
+      if ((options & SRM_OPT_X) && statbuf.st_dev != dev)
+	{
+	  walk_node_fail(node);
+	  continue;
+	}
+
+      if (add_dir(node, path) < 0)
+	walk_failed();
+    }
+
+  closedir(dp);
+
+  pthread_mutex_lock(&walk_lock);
+  num_entries += entries;
+  pthread_mutex_unlock(&walk_lock);
+
+  /* drop the reference of the scan */
+  path[dir_len] = '\0';
+  if (! process_file(path, FTS_DP, node, options))
+    walk_failed();
+  free(path);
+}
+
+static void *walk_thread(void *arg)
+{
+  const int options = *(const int*)arg;
+
+  pthread_mutex_lock(&walk_lock);
+  for (;;)
+    {
+      struct walk_node *node;
+
+      /* the walk is finished once the queue is empty and nobody can add
+	 to it. Above the memory limit only one thread scans at a time,
+	 the others wait for records to be released. */
+      while ((busy > 0 && (!queue_head || walk_over_limit())) || (!queue_head && trees_open))
+	pthread_cond_wait(&walk_cond, &walk_lock);
+      if ((node = queue_head) == NULL)
+	break;
+      if ((queue_head = node->next) == NULL)
+	queue_tail = NULL;
+      ++busy;
+      pthread_mutex_unlock(&walk_lock);
+
+      scan_dir(node, options);
+
+      pthread_mutex_lock(&walk_lock);
+      --busy;
+      if (!queue_head || walk_memory_limit > 0)
+	pthread_cond_broadcast(&walk_cond);
+    }
+  pthread_mutex_unlock(&walk_lock);
+  return NULL;
+}
+
+static double now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int walk_trees(char **trees, const int options)
+{
+  pthread_t *threads;
+  unsigned i, started = 0;
+  double start;
+  char *tree;
+
+  if ((threads = (pthread_t*)calloc(walk_threads, sizeof(pthread_t))) == NULL)
+    {
+      errorp("could not allocate memory");
+      return +2;
+    }
+
+  start = now();
+  walk_ret = 0;
+  num_dirs = num_entries = 0;
+  trees_open = 1;
+  (void)pipeline_start(options);
+
+  for (i = 0; i < walk_threads; i++)
+    {
+      if (pthread_create(&threads[i], NULL, walk_thread, (void*)&options) != 0)
+	{
+	  errorp("could not start walker thread");
+	  break;
+	}
+      ++started;
+    }
+
+  /* the threads scan the first trees while the --files-from list is read */
+  i = 0;
+  while ((tree = next_tree(trees, &i)) != NULL)
+    {
+      struct stat statbuf;
+
+      /* remove trailing slashes */
+      while (strlen(tree) > 1 && tree[strlen(tree) - 1] == SRM_DIRSEP)
+	tree[strlen(tree) - 1] = '\0';
+
+      if (lstat(tree, &statbuf) < 0)
+	{
+	  if (! process_file(tree, FTS_NS, NULL, options))
+	    walk_failed();
+	}
+      else if (!S_ISDIR(statbuf.st_mode))
+	{
+	  const char *name = strrchr(tree, SRM_DIRSEP);
+	  if (!filter_name(name ? name + 1 : tree, 0) || !filter_stat(&statbuf))
+	    continue;
+	  if (! process_file(tree, FTS_F, NULL, options))
+	    walk_failed();
+	}
+      else if (add_dir(NULL, tree) < 0)
+	walk_failed();
+    }
+
+  pthread_mutex_lock(&walk_lock);
+  trees_open = 0;
+  pthread_cond_broadcast(&walk_cond);
+  pthread_mutex_unlock(&walk_lock);
+
+  if (started == 0)
+    walk_thread((void*)&options);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (options & SRM_OPT_V)
+    error("walker: %lu directories, %lu entries in %.2fs with %u threads",
+	  num_dirs, num_entries, now() - start, started ? started : 1);
+
+  /* the pipeline removes the remaining files and their directories */
+  if (pipeline_finish(options) > 0)
+    walk_ret = 1;
+  if (walk_node_failures() > 0)
+    walk_ret = 1;
+
+  return walk_ret;
+}
+
+#endif
+
+/**
+   remove the trees like tree_walker(), but scan directories with
+   walk_threads threads. Falls back to tree_walker() if the options
+   do not allow a parallel walk.
+
+   @param options bitfield of SRM_OPT_* bits
+   @return 0 if all files/directories could be removed; > 0 otherwise.
+*/
+int parallel_walker(char **trees, const int options)
+{
+  int ret;
+
+  if(!trees) return +1;
+
+#ifdef HAVE_PTHREAD_H
+  if (walk_threads > 0 && (options & SRM_OPT_R) && (options & SRM_OPT_I) && (options & SRM_OPT_V))
+    /* prompts for every file must come in order */
+    error("interactive mode, scanning directories with a single thread");
+  if (walk_threads > 0 && (options & SRM_OPT_R) && !(options & SRM_OPT_I))
+    ret = walk_trees(trees, options);
+  else
+#else
+  if (walk_threads > 0 && (options & SRM_OPT_V))
+    error("parallel directory scan not supported on this platform, continuing without it");
+#endif
+    ret = tree_walker(trees, options);
+
+  /* --plan leaves the completed-set of --resume alone */
+  journal_close(ret != 0 || plan_format != PLAN_OFF, options);
+  walk_report(options);
+  order_report(options);
+  cow_report(options);
+  throttle_report(options);
+  blockdev_report(options);
+  if (plan_format != PLAN_OFF)
+    plan_report(options);
+  else
+    {
+      if (options & SRM_OPT_V)
+	policy_report(PLAN_OFF);
+      plan_save(options);
+    }
+  return ret;
+}
@@ -7,6 +7,9 @@ make
 test/fill_test
 
 SRM="src/srm -vvvvvvv"
+# keep the measured throughput of the test runs out of ~/.cache
+XDG_CACHE_HOME=`pwd`/test.cache
+export XDG_CACHE_HOME
 
 # test different file types
 
@@ -76,6 +79,348 @@ cd ..
 
 testremove test.dir
 
+# batched small files
+echo
+echo "testing batch mode..."
+mkdir -p test.dir/sub
+for i in 1 2 3 4 5 6 7 8 9 ; do
+    echo "TEST$i" > test.dir/file$i
+    echo "TEST$i" > test.dir/sub/file$i
+done
+$SRM -r --batch=4 test.dir
+if [ -e test.dir ] ; then
+    echo could not remove test.dir in batch mode
+    exit 1
+fi
+
+# pipeline
+echo
+echo "testing pipeline..."
+mkdir -p test.dir/sub
+for i in 1 2 3 4 5 6 7 8 9 ; do
+    echo "TEST$i" > test.dir/file$i
+    echo "TEST$i" > test.dir/sub/file$i
+done
+ln test.dir/file1 test.dir/link1
+$SRM -r --pipeline=1,2,1 --pipeline-queue=2 test.dir
+if [ -e test.dir ] ; then
+    echo could not remove test.dir with pipeline
+    exit 1
+fi
+
+# parallel directory scan
+echo
+echo "testing parallel directory scan..."
+mkdir -p test.dir/a/b/c test.dir/d
+for i in 1 2 3 4 5 6 7 8 9 ; do
+    echo "TEST$i" > test.dir/file$i
+    echo "TEST$i" > test.dir/a/b/file$i
+    echo "TEST$i" > test.dir/d/file$i
+done
+$SRM -r --walk-threads=4 test.dir
+if [ -e test.dir ] ; then
+    echo could not remove test.dir with parallel directory scan
+    exit 1
+fi
+mkdir -p test.dir/a/b
+echo "TEST" > test.dir/a/b/file
+$SRM -r --walk-threads=2 --walk-memory=1 --pipeline test.dir
+if [ -e test.dir ] ; then
+    echo could not remove test.dir with parallel directory scan and pipeline
+    exit 1
+fi
+
+# list of files
+echo
+echo "testing files from list..."
+mkdir -p test.dir/sub
+for i in 1 2 3 ; do
+    echo "TEST$i" > "test.dir/file $i"
+    echo "TEST$i" > test.dir/sub/file$i
+done
+printf 'test.dir/file 1\n\ntest.dir/file 2\n' | $SRM --files-from=-
+if [ -e "test.dir/file 1" -o -e "test.dir/file 2" -o ! -e "test.dir/file 3" ] ; then
+    echo could not remove files from newline separated list
+    exit 1
+fi
+if echo y | src/srm -i --files-from=- 2> /dev/null ; then
+    echo -i was accepted with --files-from=-
+    exit 1
+fi
+printf 'test.dir/file 3\000test.dir/sub\000' > test.list
+$SRM -r -0 --files-from=test.list --walk-threads=2
+rm -f test.list
+if [ -e "test.dir/file 3" -o -e test.dir/sub ] ; then
+    echo could not remove files from NUL separated list
+    exit 1
+fi
+rmdir test.dir
+
+# filters
+echo
+echo "testing filters..."
+for walk in "" "--walk-threads=2" ; do
+    mkdir -p test.dir/keep test.dir/sub/deep
+    echo "TEST" > test.dir/a.key
+    echo "TEST" > test.dir/a.txt
+    echo "TEST" > test.dir/keep/b.key
+    echo "TEST" > test.dir/sub/deep/c.key
+    $SRM -r $walk --include='*.key' --exclude=keep test.dir
+    if [ -e test.dir/a.key -o -e test.dir/sub ] ; then
+	echo could not remove filtered files $walk
+	exit 1
+    fi
+    if [ ! -e test.dir/a.txt -o ! -e test.dir/keep/b.key ] ; then
+	echo removed files which did not match the filters $walk
+	exit 1
+    fi
+    $SRM -r $walk --min-size=100 test.dir
+    if [ ! -e test.dir/a.txt ] ; then
+	echo removed file smaller than --min-size $walk
+	exit 1
+    fi
+    $SRM -r $walk test.dir
+done
+
+# dry run
+echo
+echo "testing --plan..."
+mkdir -p test.dir/sub
+echo "TEST" > test.dir/a
+echo "TEST" > test.dir/sub/b
+for fmt in text json ; do
+    if ! $SRM -r --plan=$fmt test.dir > test.plan ; then
+	echo --plan=$fmt failed
+	exit 1
+    fi
+    if [ ! -e test.dir/a -o ! -e test.dir/sub/b ] ; then
+	echo --plan=$fmt removed files
+	exit 1
+    fi
+done
+if ! grep -q '"files":2,"directories":2,' test.plan ; then
+    echo --plan did not count the files
+    exit 1
+fi
+rm -f test.plan
+$SRM -r test.dir
+
+# policy
+echo
+echo "testing --policy..."
+mkdir -p test.dir
+echo "TEST" > test.dir/a.key
+echo "TEST" > test.dir/b.txt
+printf '# test policy\nname=*.key scheme=gutmann\n' > test.policy
+if ! $SRM -r --policy=test.policy --plan=json test.dir > test.plan ; then
+    echo --policy failed
+    exit 1
+fi
+if ! grep -q '"line":2,"scheme":"Full 35-pass mode (Gutmann method)","files":1,"bytes":5,"written":180' test.plan ; then
+    echo --policy did not select the mode
+    exit 1
+fi
+$SRM -r --policy=test.policy --batch test.dir
+if [ -e test.dir ] ; then
+    echo could not remove test.dir with --policy
+    exit 1
+fi
+echo "bogus=1 scheme=simple" > test.policy
+if $SRM -r --policy=test.policy test.dir 2> /dev/null ; then
+    echo invalid policy was accepted
+    exit 1
+fi
+rm -f test.policy test.plan
+
+# journal
+echo
+echo "testing --journal..."
+dd if=/dev/zero of=test.big bs=1048576 count=64 2> /dev/null
+if ! $SRM --journal=test.journal --resume test.big ; then
+    echo failed to remove test.big with --journal
+    exit 1
+fi
+if [ -e test.big ] ; then
+    echo could not remove test.big with --journal
+    exit 1
+fi
+mkdir -p test.dir/a
+echo 1 > test.dir/a/1
+echo 2 > test.dir/2
+if ! $SRM -r --journal=test.journal --resume test.dir ; then
+    echo failed to remove test.dir with --journal
+    exit 1
+fi
+if [ -e test.dir ] || [ -e test.journal.done ] ; then
+    echo could not remove test.dir with --journal
+    exit 1
+fi
+rm -f test.journal
+# resume from a checkpoint halfway through the first pass, the journal
+# must be on another device to be used
+if [ -d /dev/shm ] && [ "`stat -c %d /dev/shm 2> /dev/null`" != "`stat -c %d . 2> /dev/null`" ] ; then
+    dd if=/dev/zero bs=1048576 count=64 2> /dev/null | tr '\0' a > test.big
+    printf 'srm-journal 1\n%s 67108864 65536 0 33554432\n' "`stat -c '%d %i' test.big`" > /dev/shm/test.journal.$$
+    if ! $SRM -s --image --journal=/dev/shm/test.journal.$$ --resume test.big ; then
+	echo failed to resume test.big
+	exit 1
+    fi
+    if [ "`head -c 33554432 test.big | tr -d a | wc -c`" -ne 0 ] || [ "`tail -c 33554432 test.big | tr -d '\0' | wc -c`" -ne 0 ] ; then
+	echo test.big was not resumed from its checkpoint
+	exit 1
+    fi
+    rm -f test.big /dev/shm/test.journal.$$ /dev/shm/test.journal.$$.done
+fi
+if src/srm --resume test.file 2> /dev/null ; then
+    echo --resume without --journal was accepted
+    exit 1
+fi
+
+# range erase
+echo
+echo "testing --erase..."
+dd if=/dev/zero bs=1024 count=8 2> /dev/null | tr '\0' a > test.file
+if ! $SRM -s --erase=4k:2k --erase=7k test.file ; then
+    echo failed to erase ranges of test.file
+    exit 1
+fi
+if [ "`tr -d '\0' < test.file | wc -c`" -ne 5120 ] || [ "`head -c 4096 test.file | tr -d a | wc -c`" -ne 0 ] ; then
+    echo wrong bytes erased in test.file
+    exit 1
+fi
+# a progress request must not end the run
+if kill -l USR2 > /dev/null 2>&1 ; then
+    dd if=/dev/zero of=test.file bs=1048576 count=128 2> /dev/null
+    src/srm -G --erase=0 test.file > /dev/null &
+    sleep 1
+    kill -USR2 $! 2> /dev/null
+    if ! wait $! ; then
+	echo --erase did not survive SIGUSR2
+	exit 1
+    fi
+fi
+rm -f test.file
+
+# disk images
+echo
+echo "testing --image..."
+dd if=/dev/zero bs=1024 count=3000 2> /dev/null | tr '\0' a > test.img1
+cp test.img1 test.img2
+if ! $SRM -s --image --queue-depth=3 --zero-offload test.img1 test.img2 ; then
+    echo failed to overwrite test.img1 and test.img2
+    exit 1
+fi
+for f in test.img1 test.img2 ; do
+    if [ ! -f $f ] || [ "`wc -c < $f`" -ne 3072000 ] || [ "`tr -d '\0' < $f | wc -c`" -ne 0 ] ; then
+	echo $f was not overwritten
+	exit 1
+    fi
+done
+rm -f test.img1 test.img2
+# the adaptive queue depth writes with O_DIRECT, but not the unaligned tail
+dd if=/dev/zero bs=1000 count=3001 2> /dev/null | tr '\0' a > test.img1
+if ! $SRM -s --image test.img1 ; then
+    echo failed to overwrite test.img1 with the adaptive queue depth
+    exit 1
+fi
+if [ "`wc -c < test.img1`" -ne 3001000 ] || [ "`tr -d '\0' < test.img1 | wc -c`" -ne 0 ] ; then
+    echo test.img1 was not overwritten with the adaptive queue depth
+    exit 1
+fi
+# the filters select images as they select files
+echo a > test.img1
+if ! $SRM -s --image --exclude='*.img1' test.img1 || [ "`cat test.img1`" != a ] ; then
+    echo --exclude did not keep test.img1
+    exit 1
+fi
+rm -f test.img1
+
+# physical order
+echo
+echo "testing --order..."
+mkdir -p test.dir/a
+dd if=/dev/zero of=test.dir/big bs=1024 count=1000 2> /dev/null
+echo 1 > test.dir/a/1
+echo 2 > test.dir/2
+if ! $SRM -r --order=2 test.dir ; then
+    echo failed to remove test.dir with --order
+    exit 1
+fi
+if [ -e test.dir ] ; then
+    echo could not remove test.dir with --order
+    exit 1
+fi
+
+# copy-on-write
+echo
+echo "testing --cow..."
+echo cow > test.file
+if ! $SRM --cow=skip test.file ; then
+    echo failed to remove test.file with --cow=skip
+    exit 1
+fi
+if src/srm --cow=bogus test.file 2> /dev/null ; then
+    echo invalid --cow value was accepted
+    exit 1
+fi
+
+# file system strategies
+echo
+echo "testing --fs-strategy..."
+dd if=/dev/zero of=test.file bs=1024 count=300 2> /dev/null
+if ! $SRM --fs-strategy=default:io=64k,sync=pass,direct=1 --fs-strategy=0x12345678:sync=none,passes=1 test.file ; then
+    echo failed to remove test.file with --fs-strategy
+    exit 1
+fi
+if [ -e test.file ] ; then
+    echo could not remove test.file with --fs-strategy
+    exit 1
+fi
+if src/srm --fs-strategy=nfs:sync=later test.file 2> /dev/null ; then
+    echo invalid --fs-strategy value was accepted
+    exit 1
+fi
+
+# rate limit
+echo
+echo "testing --rate-limit..."
+dd if=/dev/zero of=test.file bs=1024 count=300 2> /dev/null
+echo "device-rate-limit=100M,1000" > test.limit
+if ! $SRM --rate-limit=100M --limit-file=test.limit test.file ; then
+    echo failed to remove test.file with --rate-limit
+    exit 1
+fi
+rm -f test.limit
+if [ -e test.file ] ; then
+    echo could not remove test.file with --rate-limit
+    exit 1
+fi
+if src/srm --rate-limit=fast test.file 2> /dev/null ; then
+    echo invalid --rate-limit value was accepted
+    exit 1
+fi
+if src/srm --pressure=0 test.file 2> /dev/null ; then
+    echo invalid --pressure value was accepted
+    exit 1
+fi
+
+# discard
+echo
+echo "testing --discard..."
+dd if=/dev/zero of=test.file bs=1024 count=100 2> /dev/null
+if ! $SRM --discard test.file ; then
+    echo failed to remove test.file with --discard
+    exit 1
+fi
+if [ -e test.file ] ; then
+    echo could not remove test.file with --discard
+    exit 1
+fi
+if src/srm --discard=bogus test.file 2> /dev/null ; then
+    echo invalid --discard value was accepted
+    exit 1
+fi
+
 # device nodes
 echo
 if [ "$I" = root ] ; then
@@ -239,5 +584,6 @@ do
     testsrm
 done
 
+rm -rf test.cache
 echo "all tests successful."
 exit 0
@@ -2,45 +2,59 @@
 #include <set>
 
 #include <cassert>
+#include <cstring>
 #include <unistd.h>
 
 #include <srm.h>
 #include <impl.h>
 
 /**
+ * fn is extended in place for the entries of a directory, so there
+ * is only one path buffer for the whole tree.
  * @return true if all files/directories could be removed; false otherwise.
  */
-static int delFn(const std::string& fn, const int options)
+static int delFn(std::string& fn, const int options)
 {
-  int flag=FTS_F, ret = 1;
+  int flag=FTS_F, ret = 1, kept = 0;
 
   struct stat statbuf;
   if(lstat(fn.c_str(), &statbuf) == 0)
   {
     if(S_ISDIR(statbuf.st_mode))
     {
-      std::string spec=fn; spec+="\\*.*";
+      const std::string::size_type len=fn.size();
+      fn+="\\*.*";
 
       struct _finddata_t fileinfo;
-      intptr_t h=_findfirst(spec.c_str(), &fileinfo);
+      intptr_t h=_findfirst(fn.c_str(), &fileinfo);
+      fn.resize(len);
       if(h == -1) return 0;
 
       do
       {
-	std::string fi=fileinfo.name;
-        if(fi!="." && fi!="..") {
-          if (! delFn(fn+'\\'+fi, options)) {
+	const char *fi=fileinfo.name;
+        if(strcmp(fi, ".") && strcmp(fi, "..")) {
+	  const int is_dir = (fileinfo.attrib & _A_SUBDIR) != 0;
+	  fn+='\\'; fn+=fi;
+	  my_stat_t st;
+	  if (!filter_name(fi, is_dir) ||
+	      (!is_dir && filter_needs_stat() && _stat64(fn.c_str(), &st) == 0 && !filter_stat(&st))) {
+	    kept = 1;
+	  } else if (! delFn(fn, options)) {
 	    ret = 0;
 	  }
+	  fn.resize(len);
 	}
       } while(_findnext(h, &fileinfo) == 0);
       _findclose(h);
 
+      /* the directory still holds the entries that were filtered out */
+      if (kept) return ret;
       flag=FTS_DP;
     }
   }
 
-  if (! process_file(const_cast<char*>(fn.c_str()), flag, options)) {
+  if (! process_file(const_cast<char*>(fn.c_str()), flag, NULL, options)) {
     ret = 0;
   }
   return ret;
@@ -51,15 +65,18 @@ static int delFn(const std::string& fn, const int options)
  */
 extern "C" int tree_walker(char **trees, const int options)
 {
-  int i = 0, ret = 0;
+  int ret = 0;
+  unsigned i = 0;
+  char *tree;
   if(!trees) return +2;
 
-  while (trees[i] != NULL)
+  while ((tree = next_tree(trees, &i)) != NULL)
   { 
-    while (trees[i][strlen(trees[i]) - 1] == SRM_DIRSEP)
-      trees[i][strlen(trees[i]) -1] = '\0';
+    while (strlen(tree) > 1 && tree[strlen(tree) - 1] == SRM_DIRSEP)
+      tree[strlen(tree) -1] = '\0';
 
-    if (! delFn(trees[i++], options)) {
+    std::string fn=tree;
+    if (! delFn(fn, options)) {
       ret = +1;
     }
   }